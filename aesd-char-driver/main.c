@@ -19,6 +19,8 @@
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // for kfree and kmalloc
 #include <linux/uaccess.h> // for copy_to_user and copy_from_user
+#include <linux/uio.h> // for iov_iter
+#include <linux/version.h> // for LINUX_VERSION_CODE
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h" // Ensure this header is included for buffer functions
 #include "aesd_ioctl.h" // Include the ioctl header
@@ -163,6 +165,46 @@ out:
     return retval;
 }
 
+/**
+ * @brief Reads from the AESD character device into an iov_iter.
+ * Used by splice/sendfile so data can move to a socket without a user space copy.
+ * Unlike aesd_read, the iterator is filled across entry boundaries.
+ * @param iocb Kernel I/O control block holding the file and position.
+ * @param to Destination iterator.
+ * @return Number of bytes read on success, 0 for EOF, or negative error code.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    struct aesd_dev *dev = iocb->ki_filp->private_data;
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset = 0;
+    size_t bytes_to_copy, copied;
+    PDEBUG("read_iter %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
+
+    if (mutex_lock_killable(&dev->lock))
+        return -ERESTARTSYS;
+
+    while (iov_iter_count(to) > 0) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, iocb->ki_pos, &entry_offset);
+        if (!entry || entry_offset >= entry->size)
+            break; // EOF
+
+        bytes_to_copy = min(iov_iter_count(to), entry->size - entry_offset);
+        copied = copy_to_iter(entry->buffptr + entry_offset, bytes_to_copy, to);
+        iocb->ki_pos += copied;
+        retval += copied;
+        if (copied < bytes_to_copy) {
+            if (!retval)
+                retval = -EFAULT;
+            break;
+        }
+    }
+
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
 /**
  * @brief Writes data to the AESD character device.
  * @param filp Pointer to the file structure.
@@ -331,6 +373,12 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 struct file_operations aesd_fops = {
     .owner =          THIS_MODULE,
     .read =           aesd_read,
+    .read_iter =      aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =    copy_splice_read,
+#else
+    .splice_read =    generic_file_splice_read,
+#endif
     .write =          aesd_write,
     .open =           aesd_open,
     .release =        aesd_release,
@@ -0,0 +1,85 @@
+#! /bin/sh
+# Benchmark aesdsocket with aesdsocket-loadgen against the file backend and,
+# when /dev/aesdchar exists, the char device backend, in every server mode.
+# Each result is one line of key=value pairs on stdout, tagged with the
+# build, backend and mode, so runs of different builds can be compared. A
+# run where aesdsocket-loadgen fails (errors, or connections that made no
+# progress) is followed by a failed=exit_<status> line. Pool mode runs with
+# one worker per connection (-t), since a worker serves a single connection
+# until it closes; the thread count is recorded as threads=.
+#
+# Environment: DURATION (seconds per run, default 5), CONNECTIONS (default 8),
+# RECORD_SIZE (default 64), WORKLOADS (default "append echo seekto slow mixed"),
+# MODES (default "thread epoll pool uring").
+
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-8}
+RECORD_SIZE=${RECORD_SIZE:-64}
+WORKLOADS=${WORKLOADS:-"append echo seekto slow mixed"}
+MODES=${MODES:-"thread epoll pool uring"}
+
+cd "$(dirname "$0")" || exit 1
+build=$(git describe --always --dirty 2>/dev/null || echo unknown)
+workdir=$(mktemp -d) || exit 1
+trap 'rm -rf "$workdir"' EXIT
+
+# Build a server binary for one backend: 0 = file, 1 = /dev/aesdchar
+build_server() {
+    make -s clean >&2 &&
+    make -s CFLAGS="-Wall -O2 -g -DUSE_AESD_CHAR_DEVICE=$1" aesdsocket aesdsocket-loadgen >&2 &&
+    cp aesdsocket "$workdir/aesdsocket-$2" &&
+    cp aesdsocket-loadgen "$workdir/aesdsocket-loadgen"
+}
+
+# Wait until the server answers on port 9000, with STAT requests only so
+# nothing is stored before the measured run
+wait_for_server() {
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        if "$workdir/aesdsocket-loadgen" -c 1 -d 0.1 -w stat >/dev/null 2>&1; then
+            return 0
+        fi
+        sleep 0.2
+    done
+    return 1
+}
+
+run_backend() {
+    backend=$1
+    for mode in $MODES; do
+        for workload in $WORKLOADS; do
+            if [ "$backend" = file ]; then
+                rm -f /var/tmp/aesdsocketdata /var/tmp/aesdsocketdata.idx
+            fi
+            threads=
+            if [ "$mode" = pool ]; then
+                threads=$CONNECTIONS
+            fi
+            "$workdir/aesdsocket-$backend" -m "$mode" ${threads:+-t "$threads"} -l warning &
+            server=$!
+            if wait_for_server; then
+                "$workdir/aesdsocket-loadgen" -c "$CONNECTIONS" -d "$DURATION" -s "$RECORD_SIZE" -w "$workload" \
+                    >"$workdir/result"
+                status=$?
+                sed "s/^/build=$build backend=$backend mode=$mode threads=${threads:-default} /" "$workdir/result"
+                if [ $status -ne 0 ]; then
+                    echo "build=$build backend=$backend mode=$mode threads=${threads:-default} workload=$workload failed=exit_$status"
+                fi
+            else
+                echo "build=$build backend=$backend mode=$mode threads=${threads:-default} workload=$workload error=server_not_ready"
+            fi
+            kill -TERM $server
+            wait $server
+        done
+    done
+}
+
+build_server 0 file || exit 1
+run_backend file
+if [ -c /dev/aesdchar ]; then
+    build_server 1 aesdchar || exit 1
+    run_backend aesdchar
+else
+    echo "build=$build backend=aesdchar skipped=no_device"
+fi
+# Leave the default build in place
+make -s clean >&2 && make -s >&2
@@ -0,0 +1,197 @@
+/*
+ * aesdsocket-binary.c
+ *
+ * Binary protocol handling (see aesdsocket-protocol.h): frames are
+ * assembled in the connection's rx_buffer, executed in order against the
+ * data store, and answered through the connection output queue so data
+ * replies still go out with sendfile().
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <unistd.h>     // For POSIX API functions
+#include <endian.h>     // For htobe64, be64toh
+#include <syslog.h>     // For system logging
+
+#include "aesdsocket.h"
+#include "aesdsocket-protocol.h"
+
+// Queue a response frame: header, inline payload, then data file range [start, end)
+static int binary_reply(struct connection *conn, uint8_t opcode, int status,
+                        const void *payload, size_t payload_len, off_t start, off_t end) {
+    char prefix[sizeof(struct aesd_frame_header) + sizeof(struct aesd_stat_payload)];
+    if (end < start) {
+        end = start;
+    }
+    if (end - start > (off_t)(UINT32_MAX - payload_len)) {
+        end = start + (UINT32_MAX - payload_len);
+    }
+    struct aesd_frame_header header = {
+        .opcode = opcode,
+        .status = status,
+        .reserved = 0,
+        .length = htonl(payload_len + (end - start)),
+    };
+    memcpy(prefix, &header, sizeof(header));
+    if (payload_len > 0) {
+        memcpy(prefix + sizeof(header), payload, payload_len);
+    }
+    return connection_queue_reply(conn, prefix, sizeof(header) + payload_len, start, end);
+}
+
+// Reply to a request that failed with errno value error
+static int binary_reply_error(struct connection *conn, uint8_t opcode, int error) {
+    return binary_reply(conn, opcode, error, NULL, 0, 0, 0);
+}
+
+// Queue a response carrying the metrics report for this connection
+static int binary_reply_metrics(struct connection *conn) {
+    char *text;
+    ssize_t text_len = metrics_format(conn, &text);
+    if (text_len < 0) {
+        return binary_reply_error(conn, AESD_OP_METRICS, ENOMEM);
+    }
+    struct aesd_frame_header header = {
+        .opcode = AESD_OP_METRICS,
+        .status = 0,
+        .reserved = 0,
+        .length = htonl(text_len),
+    };
+    int status = CONN_ERROR;
+    char *frame = malloc(sizeof(header) + text_len);
+    if (frame) {
+        memcpy(frame, &header, sizeof(header));
+        memcpy(frame + sizeof(header), text, text_len);
+        status = connection_queue_reply(conn, frame, sizeof(header) + text_len, 0, 0);
+        free(frame);
+    }
+    free(text);
+    return status;
+}
+
+// Answer a request frame that only reads the store
+static int binary_query(struct connection *conn, uint8_t opcode, const char *payload, uint32_t length) {
+    switch (opcode) {
+        case AESD_OP_ECHO:
+            return binary_reply(conn, opcode, 0, NULL, 0, store_start(), store_length());
+        case AESD_OP_SEEKTO: {
+            uint32_t fields[2];
+            if (length != sizeof(fields)) {
+                return binary_reply_error(conn, opcode, EINVAL);
+            }
+            memcpy(fields, payload, sizeof(fields));
+            struct aesd_seekto seekto;
+            seekto.write_cmd = ntohl(fields[0]);
+            seekto.write_cmd_offset = ntohl(fields[1]);
+            off_t position;
+            if (store_seekto(conn->data_fd, &seekto, &position) != 0) {
+                return binary_reply_error(conn, opcode, errno);
+            }
+            return binary_reply(conn, opcode, 0, NULL, 0, position, store_length());
+        }
+        case AESD_OP_READ_RANGE: {
+            uint64_t fields[2];
+            if (length != sizeof(fields)) {
+                return binary_reply_error(conn, opcode, EINVAL);
+            }
+            memcpy(fields, payload, sizeof(fields));
+            uint64_t offset = be64toh(fields[0]);
+            uint64_t range_length = be64toh(fields[1]);
+            uint64_t data_length = store_length();
+            uint64_t start = offset < data_length ? offset : data_length;
+            if (start < (uint64_t)store_start()) {
+                start = store_start();
+            }
+            uint64_t end = range_length < data_length - start ? start + range_length : data_length;
+            return binary_reply(conn, opcode, 0, NULL, 0, start, end);
+        }
+        case AESD_OP_STAT: {
+            struct aesd_stat_payload stat = {
+                .data_length = htobe64(store_length()),
+                .commands = htobe64(store_command_count(conn->data_fd)),
+            };
+            return binary_reply(conn, opcode, 0, &stat, sizeof(stat), 0, 0);
+        }
+        case AESD_OP_METRICS:
+            return binary_reply_metrics(conn);
+        default:
+            return binary_reply_error(conn, opcode, EOPNOTSUPP);
+    }
+}
+
+// Execute one complete request frame. Queries hold appends off while their
+// reply is worked out, so its header and data agree on the char device.
+static int binary_execute(struct connection *conn, uint8_t opcode, const char *payload, uint32_t length) {
+    if (opcode == AESD_OP_APPEND) {
+        conn->append_iov[0].iov_base = (void *)payload;
+        conn->append_iov[0].iov_len = length;
+        return connection_append(conn, conn->append_iov, 1);
+    }
+    store_read_lock();
+    int status = binary_query(conn, opcode, payload, length);
+    store_read_unlock();
+    return status;
+}
+
+// Answer an APPEND frame once its payload is stored
+int binary_append_done(struct connection *conn) {
+    if (conn->append.error != 0) {
+        return binary_reply_error(conn, AESD_OP_APPEND, conn->append.error);
+    }
+    uint64_t reply = htobe64(conn->append.end);
+    return binary_reply(conn, AESD_OP_APPEND, 0, &reply, sizeof(reply), 0, 0);
+}
+
+// True when rx_buffer holds at least one complete frame
+bool binary_frame_ready(const struct connection *conn) {
+    struct aesd_frame_header header;
+    if (conn->rx_len < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, conn->rx_buffer, sizeof(header));
+    return conn->rx_len - sizeof(header) >= ntohl(header.length);
+}
+
+// Execute every complete frame in rx_buffer, in order, until the output
+// queue fills up or an APPEND parks the connection; the rest stays buffered
+// for connection_resume_input()
+int binary_process_frames(struct connection *conn) {
+    size_t pos = 0;
+    size_t frames = 0;
+    int status = CONN_OK;
+
+    while (!conn->output_throttled && !conn->append_pending &&
+           conn->rx_len - pos >= sizeof(struct aesd_frame_header)) {
+        struct aesd_frame_header header;
+        memcpy(&header, conn->rx_buffer + pos, sizeof(header));
+        uint32_t length = ntohl(header.length);
+        if (length > AESD_FRAME_MAX) {
+            log_message(LOG_ERR, "Frame of %u bytes from %s exceeds the limit", length, conn->client_ip);
+            return CONN_ERROR;
+        }
+        if (conn->rx_len - pos - sizeof(header) < length) {
+            break; // Wait for the rest of the frame
+        }
+        status = binary_execute(conn, header.opcode, conn->rx_buffer + pos + sizeof(header), length);
+        pos += sizeof(header) + length;
+        frames++;
+        if (status == CONN_ERROR) {
+            return CONN_ERROR;
+        }
+        if (conn->append_pending) {
+            // The payload stays where it is until stored
+            status = connection_detach_input(conn, pos);
+            pos = 0;
+            break;
+        }
+    }
+    // Keep only the unprocessed tail
+    if (pos > 0) {
+        memmove(conn->rx_buffer, conn->rx_buffer + pos, conn->rx_len - pos);
+        conn->rx_len -= pos;
+    }
+    limit_charge(conn, 0, frames);
+    return status;
+}
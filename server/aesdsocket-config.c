@@ -0,0 +1,812 @@
+/*
+ * aesdsocket-config.c
+ *
+ * Settings from a configuration file (-F) and the command line. Every
+ * setting has a key, written "key = value" in the file and -O key=value on
+ * the command line, and most keep an option letter of their own; the file
+ * is read first and the command line overrides it. SIGHUP reads both again
+ * and applies the reloadable settings (log level and file, admission and
+ * rate limits, client socket options, output watermarks) to the running
+ * server, leaving open connections alone; a change to any other setting is
+ * logged and waits for a restart, e.g. a hot restart with -H.
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdarg.h>     // For va_list
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <strings.h>    // For strcasecmp
+#include <errno.h>      // For error number definitions
+#include <limits.h>     // For INT_MAX
+#include <ctype.h>      // For isspace
+#include <unistd.h>     // For getopt
+#include <signal.h>     // For sigwait
+#include <netinet/tcp.h> // For TCP_NODELAY, TCP_CORK
+#include <sys/socket.h> // For setsockopt
+#include <sys/un.h>     // For struct sockaddr_un
+
+#include "aesdsocket.h"
+
+#define CONFIG_LINE_MAX 1024
+
+// A setting: how it is named, parsed and applied
+struct config_key {
+    const char *name;                  // Key in the file and for -O
+    int letter;                        // Command-line option, 0 if only -O sets it
+    const char *flag_value;            // Value the letter stands for, NULL if it takes an argument
+    bool reloadable;                   // Applied by SIGHUP
+    int (*set)(struct server_options *options, const char *value);
+};
+
+struct server_tunables tunables;
+
+static char **loaded_values;           // Text each key was last set to, NULL if left at its default
+static int saved_argc;
+static char **saved_argv;
+static const char *program_name;
+static bool reloading;                 // Report errors to the log instead of stderr
+static pthread_t reload_thread;
+static bool reload_started;
+static _Atomic bool reload_stopping;
+
+static void config_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void config_error(const char *format, ...) {
+    char text[LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (reloading) {
+        log_message(LOG_ERR, "%s", text);
+    } else {
+        fprintf(stderr, "%s\n", text);
+    }
+}
+
+// Parse an integer in [min, max]. Returns -1 if invalid.
+static int parse_integer(const char *text, long long min, long long max, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    return end == text || *end != '\0' || errno != 0 || *value < min || *value > max ? -1 : 0;
+}
+
+// Parse a byte count with an optional k, m or g suffix. Returns -1 if invalid.
+static off_t parse_size(const char *text) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (end == text || *end != '\0' || value < 0 || value > (LLONG_MAX >> shift)) {
+        return -1;
+    }
+    return (off_t)(value << shift);
+}
+
+// Parse seconds, fractions allowed, in [0, max]. Returns -1 if invalid.
+static int parse_seconds(const char *text, double max, double *seconds) {
+    char *end;
+    *seconds = strtod(text, &end);
+    return end == text || *end != '\0' || *seconds < 0 || *seconds > max ? -1 : 0;
+}
+
+static int parse_bool(const char *text, bool *value) {
+    if (strcasecmp(text, "yes") == 0 || strcasecmp(text, "true") == 0 ||
+        strcasecmp(text, "on") == 0 || strcmp(text, "1") == 0) {
+        *value = true;
+    } else if (strcasecmp(text, "no") == 0 || strcasecmp(text, "false") == 0 ||
+               strcasecmp(text, "off") == 0 || strcmp(text, "0") == 0) {
+        *value = false;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int set_daemon(struct server_options *options, const char *value) {
+    return parse_bool(value, &options->daemon);
+}
+
+static int set_mode(struct server_options *options, const char *value) {
+    if (strcmp(value, "thread") == 0) {
+        options->mode = SERVER_MODE_THREAD;
+    } else if (strcmp(value, "epoll") == 0) {
+        options->mode = SERVER_MODE_EPOLL;
+    } else if (strcmp(value, "pool") == 0) {
+        options->mode = SERVER_MODE_POOL;
+    } else if (strcmp(value, "uring") == 0) {
+        options->mode = SERVER_MODE_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int set_threads(struct server_options *options, const char *value) {
+    long long count;
+    if (parse_integer(value, 1, INT_MAX, &count) != 0) {
+        return -1;
+    }
+    options->num_threads = count;
+    return 0;
+}
+
+static int set_queue_capacity(struct server_options *options, const char *value) {
+    long long capacity;
+    if (parse_integer(value, 1, INT_MAX, &capacity) != 0) {
+        return -1;
+    }
+    options->queue_capacity = capacity;
+    return 0;
+}
+
+static int set_overload(struct server_options *options, const char *value) {
+    if (strcmp(value, "reject") == 0) {
+        options->overload = OVERLOAD_REJECT;
+    } else if (strcmp(value, "queue") == 0) {
+        options->overload = OVERLOAD_QUEUE;
+    } else if (strcmp(value, "shed") == 0) {
+        options->overload = OVERLOAD_SHED;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int set_persist_index(struct server_options *options, const char *value) {
+    return parse_bool(value, &options->persist_index);
+}
+
+static int set_map_store(struct server_options *options, const char *value) {
+    return parse_bool(value, &options->map_store);
+}
+
+static int set_echo_cache_size(struct server_options *options, const char *value) {
+    off_t size = parse_size(value);
+    if (size < 0) {
+        return -1;
+    }
+    options->echo_cache_size = size;
+    return 0;
+}
+
+static int set_fsync(struct server_options *options, const char *value) {
+    long long interval_ms;
+    if (strcmp(value, "none") == 0) {
+        options->fsync_policy = FSYNC_NONE;
+    } else if (strcmp(value, "batch") == 0) {
+        options->fsync_policy = FSYNC_BATCH;
+    } else if (parse_integer(value, 1, INT_MAX, &interval_ms) == 0) {
+        options->fsync_policy = FSYNC_INTERVAL;
+        options->fsync_interval_ms = interval_ms;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int set_segment_size(struct server_options *options, const char *value) {
+    options->segment_size = parse_size(value);
+    return options->segment_size < 1 ? -1 : 0;
+}
+
+static int set_retain_size(struct server_options *options, const char *value) {
+    options->retain_bytes = parse_size(value);
+    return options->retain_bytes < 1 ? -1 : 0;
+}
+
+static int set_retain_age(struct server_options *options, const char *value) {
+    long long seconds;
+    if (parse_integer(value, 1, INT_MAX, &seconds) != 0) {
+        return -1;
+    }
+    options->retain_age = seconds;
+    return 0;
+}
+
+static int set_retain_commands(struct server_options *options, const char *value) {
+    long long count;
+    if (parse_integer(value, 1, UINT32_MAX, &count) != 0) {
+        return -1;
+    }
+    options->retain_commands = count;
+    return 0;
+}
+
+// Seconds, fractions allowed; 0 turns timestamps off
+static int set_timestamp_interval(struct server_options *options, const char *value) {
+    double seconds;
+    if (parse_seconds(value, 86400, &seconds) != 0) {
+        return -1;
+    }
+    options->timestamp_interval_ns = (int64_t)(seconds * 1e9);
+    return 0;
+}
+
+static int set_drain_timeout(struct server_options *options, const char *value) {
+    double seconds;
+    if (parse_seconds(value, 3600, &seconds) != 0) {
+        return -1;
+    }
+    options->drain_timeout_ms = (int)(seconds * 1000);
+    return 0;
+}
+
+static int set_handoff_socket(struct server_options *options, const char *value) {
+    options->handoff_path = value;
+    return 0;
+}
+
+// 0 lifts the limit, e.g. when a reload removes it
+static int set_connections_per_client(struct server_options *options, const char *value) {
+    long long count;
+    if (parse_integer(value, 0, UINT_MAX, &count) != 0) {
+        return -1;
+    }
+    options->max_client_connections = count;
+    return 0;
+}
+
+static int set_byte_rate(struct server_options *options, const char *value) {
+    off_t rate = parse_size(value);
+    if (rate < 0) {
+        return -1;
+    }
+    options->byte_rate = rate;
+    return 0;
+}
+
+static int set_record_rate(struct server_options *options, const char *value) {
+    long long rate;
+    if (parse_integer(value, 0, LLONG_MAX, &rate) != 0) {
+        return -1;
+    }
+    options->record_rate = rate;
+    return 0;
+}
+
+static int set_log_level(struct server_options *options, const char *value) {
+    options->log_level = log_parse_level(value);
+    return options->log_level < 0 ? -1 : 0;
+}
+
+static int set_log_file(struct server_options *options, const char *value) {
+    options->log_file = value;
+    return 0;
+}
+
+static int set_stats_socket(struct server_options *options, const char *value) {
+    options->stats_path = value;
+    return 0;
+}
+
+static int set_backlog(struct server_options *options, const char *value) {
+    long long backlog;
+    if (parse_integer(value, 1, INT_MAX, &backlog) != 0) {
+        return -1;
+    }
+    options->backlog = backlog;
+    return 0;
+}
+
+static int set_shard_listeners(struct server_options *options, const char *value) {
+    return parse_bool(value, &options->shard_listeners);
+}
+
+static int set_worker_cpus(struct server_options *options, const char *value) {
+    options->worker_cpus = value;
+    return 0;
+}
+
+static int set_accept_cpus(struct server_options *options, const char *value) {
+    options->accept_cpus = value;
+    return 0;
+}
+
+static int set_port(struct server_options *options, const char *value) {
+    long long port;
+    if (parse_integer(value, 1, 65535, &port) != 0) {
+        return -1;
+    }
+    options->port = port;
+    return 0;
+}
+
+// A leading '@' names a socket in the abstract namespace
+static int set_local_socket(struct server_options *options, const char *value) {
+    struct sockaddr_un addr;
+    if (*value == '\0' || strcmp(value, "@") == 0 || strlen(value) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    options->local_path = value;
+    return 0;
+}
+
+static int set_data_file(struct server_options *options, const char *value) {
+    if (*value == '\0') {
+        return -1;
+    }
+    options->data_file = value;
+    return 0;
+}
+
+static int set_rx_buffer_size(struct server_options *options, const char *value) {
+    off_t size = parse_size(value);
+    if (size < BUFFER_SIZE || size > RX_SEGMENT_SIZE_MAX) {
+        return -1;
+    }
+    options->rx_buffer_size = size;
+    return 0;
+}
+
+static int set_tcp_nodelay(struct server_options *options, const char *value) {
+    return parse_bool(value, &options->tcp_nodelay);
+}
+
+static int set_tcp_cork(struct server_options *options, const char *value) {
+    return parse_bool(value, &options->tcp_cork);
+}
+
+static int set_send_buffer(struct server_options *options, const char *value) {
+    off_t size = parse_size(value);
+    if (size < 0 || size > INT_MAX / 2) {
+        return -1;
+    }
+    options->send_buffer = size;
+    return 0;
+}
+
+static int set_receive_buffer(struct server_options *options, const char *value) {
+    off_t size = parse_size(value);
+    if (size < 0 || size > INT_MAX / 2) {
+        return -1;
+    }
+    options->receive_buffer = size;
+    return 0;
+}
+
+static int set_output_high_watermark(struct server_options *options, const char *value) {
+    off_t size = parse_size(value);
+    if (size < 1) {
+        return -1;
+    }
+    options->output_high_watermark = size;
+    return 0;
+}
+
+static int set_output_low_watermark(struct server_options *options, const char *value) {
+    off_t size = parse_size(value);
+    if (size < 0) {
+        return -1;
+    }
+    options->output_low_watermark = size;
+    return 0;
+}
+
+static const struct config_key keys[] = {
+    { "daemon", 'd', "yes", false, set_daemon },
+    { "mode", 'm', NULL, false, set_mode },
+    { "threads", 't', NULL, false, set_threads },
+    { "queue_capacity", 'q', NULL, false, set_queue_capacity },
+    { "overload", 'o', NULL, false, set_overload },
+    { "persist_index", 'i', "yes", false, set_persist_index },
+    { "map_store", 'M', "yes", false, set_map_store },
+    { "echo_cache_size", 'e', NULL, false, set_echo_cache_size },
+    { "fsync", 'f', NULL, false, set_fsync },
+    { "segment_size", 'g', NULL, false, set_segment_size },
+    { "retain_size", 'k', NULL, false, set_retain_size },
+    { "retain_age", 'a', NULL, false, set_retain_age },
+    { "retain_commands", 'n', NULL, false, set_retain_commands },
+    { "timestamp_interval", 'T', NULL, false, set_timestamp_interval },
+    { "drain_timeout", 'D', NULL, false, set_drain_timeout },
+    { "handoff_socket", 'H', NULL, false, set_handoff_socket },
+    { "connections_per_client", 'c', NULL, true, set_connections_per_client },
+    { "byte_rate", 'r', NULL, true, set_byte_rate },
+    { "record_rate", 'R', NULL, true, set_record_rate },
+    { "log_level", 'l', NULL, true, set_log_level },
+    { "log_file", 'L', NULL, true, set_log_file },
+    { "stats_socket", 'S', NULL, false, set_stats_socket },
+    { "backlog", 'b', NULL, false, set_backlog },
+    { "shard_listeners", 'P', "no", false, set_shard_listeners },
+    { "worker_cpus", 'C', NULL, false, set_worker_cpus },
+    { "accept_cpus", 'A', NULL, false, set_accept_cpus },
+    { "port", 'p', NULL, false, set_port },
+    { "local_socket", 'U', NULL, false, set_local_socket },
+    { "data_file", 0, NULL, false, set_data_file },
+    { "rx_buffer_size", 0, NULL, false, set_rx_buffer_size },
+    { "tcp_nodelay", 0, NULL, true, set_tcp_nodelay },
+    { "tcp_cork", 0, NULL, true, set_tcp_cork },
+    { "send_buffer", 0, NULL, true, set_send_buffer },
+    { "receive_buffer", 0, NULL, true, set_receive_buffer },
+    { "output_high_watermark", 0, NULL, true, set_output_high_watermark },
+    { "output_low_watermark", 0, NULL, true, set_output_low_watermark },
+};
+
+#define CONFIG_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+static void config_defaults(struct server_options *options) {
+    *options = (struct server_options){
+        .daemon = false,
+        .mode = SERVER_MODE_THREAD,
+        .num_threads = 0,
+        .queue_capacity = 64,
+        .overload = OVERLOAD_QUEUE,
+        .persist_index = false,
+        .fsync_policy = FSYNC_NONE,
+        .fsync_interval_ms = 0,
+        .segment_size = 0,
+        .retain_bytes = 0,
+        .retain_age = 0,
+        .retain_commands = 0,
+        .map_store = false,
+        .echo_cache_size = ECHO_CACHE_SIZE,
+#if USE_AESD_CHAR_DEVICE
+        .timestamp_interval_ns = 0,
+#else
+        .timestamp_interval_ns = TIMESTAMP_INTERVAL * 1000000000LL,
+#endif
+        .timestamp_fd = -1,
+        .drain_timeout_ms = DRAIN_TIMEOUT_MS,
+        .max_client_connections = 0,
+        .byte_rate = 0,
+        .record_rate = 0,
+        .handoff_path = NULL,
+        .log_level = LOG_INFO,
+        .log_file = NULL,
+        .stats_path = NULL,
+        .backlog = BACKLOG,
+        .shard_listeners = true,
+        .listen_shards = 1,
+        .worker_cpus = NULL,
+        .accept_cpus = NULL,
+        .port = PORT,
+        .local_path = NULL,
+        .local_socket = -1,
+        .data_file = DATA_FILE,
+        .rx_buffer_size = RX_SEGMENT_SIZE,
+        .tcp_nodelay = false,
+        .tcp_cork = false,
+        .send_buffer = 0,
+        .receive_buffer = 0,
+        .output_high_watermark = OUTPUT_HIGH_WATERMARK,
+        .output_low_watermark = OUTPUT_LOW_WATERMARK,
+    };
+}
+
+static void config_usage(void) {
+    fprintf(stderr, "Usage: %s [-F config_file] [-O key=value] [-d] [-i] [-M] [-e echo_cache_size] [-f none|batch|interval_ms] "
+            "[-g segment_size] [-k retain_size] [-a retain_seconds] [-n retain_commands] [-T timestamp_seconds] "
+            "[-D drain_seconds] [-H handoff_socket] [-c connections_per_client] [-r bytes_per_second] "
+            "[-R records_per_second] [-m thread|epoll|pool|uring] [-t threads] [-q queue_capacity] "
+            "[-o reject|queue|shed] [-l level] [-L log_file] [-S stats_socket] [-b backlog] [-P] "
+            "[-C worker_cpus] [-A accept_cpus] [-p port] [-U unix_socket|@name]\nKeys for -O and the config file:", program_name);
+    for (size_t i = 0; i < CONFIG_KEYS; i++) {
+        fprintf(stderr, " %s%s", keys[i].name, keys[i].reloadable ? "*" : "");
+    }
+    fprintf(stderr, "\n(* reloaded on SIGHUP)\n");
+}
+
+static const struct config_key *config_find(const char *name) {
+    for (size_t i = 0; i < CONFIG_KEYS; i++) {
+        if (strcmp(keys[i].name, name) == 0) {
+            return &keys[i];
+        }
+    }
+    return NULL;
+}
+
+// Set key to value in options, recording the text in values. The setter
+// may keep a pointer to the copy, which lives as long as values does.
+static int config_set(struct server_options *options, char **values, const struct config_key *key,
+                      const char *value) {
+    char *copy = strdup(value);
+    if (!copy) {
+        config_error("Memory allocation failed");
+        return -1;
+    }
+    if (key->set(options, copy) != 0) {
+        config_error("Invalid %s: %s", key->name, value);
+        free(copy);
+        return -1;
+    }
+    size_t index = key - keys;
+    free(values[index]);
+    values[index] = copy;
+    return 0;
+}
+
+static char *config_trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return text;
+}
+
+// Apply the "key = value" lines of the file at path; blank lines and lines
+// starting with # are skipped
+static int config_read_file(struct server_options *options, char **values, const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        config_error("Failed to open config file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    char line[CONFIG_LINE_MAX];
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), in)) {
+        line_number++;
+        char *text = config_trim(line);
+        if (*text == '\0' || *text == '#') {
+            continue;
+        }
+        char *equals = strchr(text, '=');
+        if (!equals) {
+            config_error("%s:%d: expected key = value", path, line_number);
+            result = -1;
+            break;
+        }
+        *equals = '\0';
+        const struct config_key *key = config_find(config_trim(text));
+        if (!key) {
+            config_error("%s:%d: unknown key %s", path, line_number, config_trim(text));
+            result = -1;
+            break;
+        }
+        result = config_set(options, values, key, config_trim(equals + 1));
+    }
+    fclose(in);
+    return result;
+}
+
+// Build options from the defaults, the config file named by -F and the
+// command line, in that order
+static int config_parse(struct server_options *options, char **values, int argc, char *argv[]) {
+    char optstring[2 * CONFIG_KEYS + 8] = "F:O:";
+    size_t len = strlen(optstring);
+    for (size_t i = 0; i < CONFIG_KEYS; i++) {
+        if (keys[i].letter) {
+            optstring[len++] = keys[i].letter;
+            if (!keys[i].flag_value) {
+                optstring[len++] = ':';
+            }
+        }
+    }
+    optstring[len] = '\0';
+
+    config_defaults(options);
+    const char *config_file = NULL;
+    int c;
+    optind = 1;
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+        if (c == 'F') {
+            config_file = optarg;
+        } else if (c == '?') {
+            if (!reloading) {
+                config_usage();
+            }
+            return -1;
+        }
+    }
+    if (config_file && config_read_file(options, values, config_file) != 0) {
+        return -1;
+    }
+
+    optind = 1;
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+        if (c == 'F') {
+            continue;
+        }
+        if (c == 'O') {
+            char *equals = strchr(optarg, '=');
+            const struct config_key *key = NULL;
+            if (equals) {
+                *equals = '\0';
+                key = config_find(optarg);
+                *equals = '=';
+            }
+            if (!key) {
+                config_error("Expected key=value with a known key: %s", optarg);
+                return -1;
+            }
+            if (config_set(options, values, key, equals + 1) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        for (size_t i = 0; i < CONFIG_KEYS; i++) {
+            if (keys[i].letter == c) {
+                if (config_set(options, values, &keys[i], keys[i].flag_value ? keys[i].flag_value : optarg) != 0) {
+                    return -1;
+                }
+                break;
+            }
+        }
+    }
+
+    if ((options->retain_bytes > 0 || options->retain_age > 0) && options->segment_size == 0) {
+        config_error("Retention by size or age needs a segment size (-g)");
+        return -1;
+    }
+    if (options->output_low_watermark >= options->output_high_watermark) {
+        config_error("output_low_watermark must be below output_high_watermark");
+        return -1;
+    }
+    return 0;
+}
+
+// Make the reloadable settings of options current
+static void config_apply(const struct server_options *options) {
+    atomic_store(&log_level, options->log_level);
+    atomic_store(&tunables.tcp_nodelay, options->tcp_nodelay);
+    atomic_store(&tunables.tcp_cork, options->tcp_cork);
+    atomic_store(&tunables.send_buffer, (int)options->send_buffer);
+    atomic_store(&tunables.receive_buffer, (int)options->receive_buffer);
+    atomic_store(&tunables.output_high_watermark, options->output_high_watermark);
+    atomic_store(&tunables.output_low_watermark, options->output_low_watermark);
+}
+
+// Fill options from the defaults, the config file and the command line.
+// Prints the problem and returns -1 if a setting is invalid. SIGHUP is
+// blocked from here on, so every thread started later leaves it to the
+// reload thread.
+int config_load(struct server_options *options, int argc, char *argv[]) {
+    program_name = argv[0];
+    loaded_values = calloc(CONFIG_KEYS, sizeof(*loaded_values));
+    if (!loaded_values) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    if (config_parse(options, loaded_values, argc, argv) != 0) {
+        return -1;
+    }
+    saved_argc = argc;
+    saved_argv = argv;
+    rx_segment_size = options->rx_buffer_size;
+    io_buffer_cache.size = options->rx_buffer_size;
+    config_apply(options);
+
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    return 0;
+}
+
+static bool config_same(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+// Read the settings again and apply the reloadable ones; an invalid
+// configuration is reported and changes nothing
+static void config_reload(void) {
+    struct server_options next;
+    char *values[CONFIG_KEYS] = { NULL };
+    log_message(LOG_INFO, "SIGHUP received, reloading the configuration");
+    reloading = true;
+    if (config_parse(&next, values, saved_argc, saved_argv) != 0) {
+        log_message(LOG_ERR, "Configuration not reloaded, keeping the current settings");
+    } else {
+        for (size_t i = 0; i < CONFIG_KEYS; i++) {
+            if (config_same(loaded_values[i], values[i])) {
+                continue;
+            }
+            if (!keys[i].reloadable) {
+                log_message(LOG_WARNING, "%s changed, it takes effect after a restart", keys[i].name);
+                continue;
+            }
+            log_message(LOG_INFO, "%s set to %s", keys[i].name, values[i] ? values[i] : "its default");
+            free(loaded_values[i]);
+            loaded_values[i] = values[i];
+            values[i] = NULL;
+        }
+        if (log_reopen(next.log_file) != 0) {
+            log_message(LOG_WARNING, "Log destination kept, switching between syslog and a file needs a restart");
+        }
+        limit_start(&next);
+        config_apply(&next);
+        log_message(LOG_INFO, "Configuration reloaded");
+    }
+    reloading = false;
+    for (size_t i = 0; i < CONFIG_KEYS; i++) {
+        free(values[i]);
+    }
+}
+
+// Thread function: reload on every SIGHUP until config_stop()
+static void *config_reload_func(void *arg) {
+    (void)arg;
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    while (1) {
+        int signal;
+        if (sigwait(&hup, &signal) != 0) {
+            continue;
+        }
+        if (atomic_load(&reload_stopping)) {
+            break;
+        }
+        config_reload();
+    }
+    return NULL;
+}
+
+// Start the thread that waits for SIGHUP
+int config_start(void) {
+    atomic_store(&reload_stopping, false);
+    // Leave shutdown signals to the server threads
+    sigset_t block_mask, old_mask;
+    sigfillset(&block_mask);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+    int result = pthread_create(&reload_thread, NULL, config_reload_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (result != 0) {
+        log_message(LOG_ERR, "Failed to create reload thread: %s", strerror(result));
+        return -1;
+    }
+    reload_started = true;
+    return 0;
+}
+
+void config_stop(void) {
+    if (!reload_started) {
+        return;
+    }
+    atomic_store(&reload_stopping, true);
+    pthread_kill(reload_thread, SIGHUP);
+    pthread_join(reload_thread, NULL);
+    reload_started = false;
+}
+
+// Apply the client socket settings to a newly accepted connection; the TCP
+// options only when tcp is set
+void config_socket_setup(int client_socket, bool tcp) {
+    int value = atomic_load_explicit(&tunables.send_buffer, memory_order_relaxed);
+    if (value > 0 && setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) != 0) {
+        log_message(LOG_DEBUG, "Failed to set SO_SNDBUF: %s", strerror(errno));
+    }
+    value = atomic_load_explicit(&tunables.receive_buffer, memory_order_relaxed);
+    if (value > 0 && setsockopt(client_socket, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) != 0) {
+        log_message(LOG_DEBUG, "Failed to set SO_RCVBUF: %s", strerror(errno));
+    }
+    if (tcp && atomic_load_explicit(&tunables.tcp_nodelay, memory_order_relaxed)) {
+        value = 1;
+        if (setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) != 0) {
+            log_message(LOG_DEBUG, "Failed to set TCP_NODELAY: %s", strerror(errno));
+        }
+    }
+}
+
+// Clear the way to bind a Unix socket at path: remove a socket left behind
+// by a server that did not exit cleanly, but never one a live server still
+// accepts on. Returns -1 when the path is in use.
+int config_socket_reclaim(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    // Non-blocking, so a live server with a full backlog counts as in use
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe == -1) {
+        log_message(LOG_ERR, "Failed to create Unix socket: %s", strerror(errno));
+        return -1;
+    }
+    int result = connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+    int error = errno;
+    close(probe);
+    if (result != 0 && error == ECONNREFUSED) {
+        unlink(path);
+    } else if (result == 0 || error != ENOENT) {
+        log_message(LOG_ERR, "%s is already in use: %s", path,
+                    result == 0 ? "a server accepts on it" : strerror(error));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * aesdsocket-cpu.c
+ *
+ * Thread placement. Event loops (and, with -C, pool workers) are pinned one
+ * per CPU of the worker set, which defaults to every CPU the process may
+ * run on; -A pins the accepting thread to a set of its own. A connection's
+ * incoming CPU is the one the network stack processes its packets on (its
+ * RX queue's interrupt or steering target, SO_INCOMING_CPU): sharded
+ * listeners ask the kernel to hand each loop the connections arriving on
+ * its CPU, the pool queues a connection on the worker pinned there, and
+ * thread mode pins the client's thread to it. The CPU to NUMA node map is
+ * read from sysfs, so received bytes can be reported by how far they
+ * travelled from the incoming CPU.
+ */
+
+#define _GNU_SOURCE     // For pthread_setaffinity_np, CPU_SET and sched_getcpu
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <sched.h>      // For cpu_set_t
+#include <dirent.h>     // For opendir
+#include <sys/socket.h> // For SO_INCOMING_CPU
+
+#include "aesdsocket.h"
+
+static cpu_set_t process_cpus;         // Where the process could run at startup
+static int worker_cpus[CPU_SETSIZE];   // Worker set in ascending order
+static int worker_cpu_count;
+static bool workers_pinned;            // -C given: pool and client threads are placed too
+static bool acceptor_pinned;           // -A given: threads must not inherit the accept set
+static cpu_set_t accept_cpus;
+static short cpu_nodes[CPU_SETSIZE];   // NUMA node of each CPU, 0 if unknown
+static int node_count = 1;
+
+// Parse a CPU list such as "0-3,8,10-11" into set. Returns -1 if invalid.
+static int cpu_parse_list(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Fill cpu_nodes from the nodeN entries of /sys/devices/system/cpu/cpuM
+static void cpu_read_nodes(void) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &process_cpus)) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        DIR *dir = opendir(path);
+        if (!dir) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) == 1 && node >= 0) {
+                cpu_nodes[cpu] = node;
+                if (node + 1 > node_count) {
+                    node_count = node + 1;
+                }
+                break;
+            }
+        }
+        closedir(dir);
+    }
+}
+
+static void cpu_log_set(const char *what, const cpu_set_t *set) {
+    char list[256];
+    size_t len = 0;
+    list[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < sizeof(list) - 8; cpu++) {
+        if (CPU_ISSET(cpu, set)) {
+            len += snprintf(list + len, sizeof(list) - len, "%s%d", len ? "," : "", cpu);
+        }
+    }
+    log_message(LOG_INFO, "%s on CPU(s) %s", what, list);
+}
+
+// Work out the worker set and the NUMA layout; -C and -A sets are limited
+// to the CPUs the process may use. Returns -1 if a CPU list is invalid.
+int cpu_start(const struct server_options *options) {
+    cpu_set_t requested_workers, requested_accept;
+    if (options->worker_cpus && cpu_parse_list(options->worker_cpus, &requested_workers) != 0) {
+        log_message(LOG_ERR, "Invalid worker CPU list: %s", options->worker_cpus);
+        return -1;
+    }
+    if (options->accept_cpus && cpu_parse_list(options->accept_cpus, &requested_accept) != 0) {
+        log_message(LOG_ERR, "Invalid accept CPU list: %s", options->accept_cpus);
+        return -1;
+    }
+    if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0) {
+        CPU_ZERO(&process_cpus);
+        CPU_SET(0, &process_cpus);
+    }
+    cpu_set_t workers = process_cpus;
+    if (options->worker_cpus) {
+        CPU_AND(&workers, &workers, &requested_workers);
+        if (CPU_COUNT(&workers) == 0) {
+            log_message(LOG_WARNING, "No CPU of the worker set is available, using all of them");
+            workers = process_cpus;
+        } else {
+            workers_pinned = true;
+        }
+    }
+    worker_cpu_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &workers)) {
+            worker_cpus[worker_cpu_count++] = cpu;
+        }
+    }
+    if (options->accept_cpus) {
+        CPU_AND(&accept_cpus, &process_cpus, &requested_accept);
+        acceptor_pinned = CPU_COUNT(&accept_cpus) > 0;
+        if (!acceptor_pinned) {
+            log_message(LOG_WARNING, "No CPU of the accept set is available, accepting anywhere");
+        }
+    }
+    cpu_read_nodes();
+    if (workers_pinned) {
+        cpu_log_set("Workers pinned", &workers);
+    }
+    if (acceptor_pinned) {
+        cpu_log_set("Accepting", &accept_cpus);
+    }
+    if (node_count > 1) {
+        log_message(LOG_INFO, "%d NUMA nodes", node_count);
+    }
+    return 0;
+}
+
+// CPU for the thread serving loop, shard or worker index
+int cpu_worker(int index) {
+    return worker_cpu_count > 0 ? worker_cpus[index % worker_cpu_count] : -1;
+}
+
+bool cpu_workers_pinned(void) {
+    return workers_pinned;
+}
+
+static void cpu_set_thread(pthread_t thread, const cpu_set_t *set, const char *what) {
+    int result = pthread_setaffinity_np(thread, sizeof(*set), set);
+    if (result != 0) {
+        log_message(LOG_WARNING, "Failed to place %s thread: %s", what, strerror(result));
+    }
+}
+
+static void cpu_pin(pthread_t thread, int cpu, const char *what) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    cpu_set_thread(thread, &set, what);
+}
+
+// Pin the thread serving loop or shard index to its CPU of the worker set,
+// so each shard's accepts and clients stay on one core
+void server_pin_thread(pthread_t thread, int index) {
+    int cpu = cpu_worker(index);
+    if (cpu >= 0) {
+        cpu_pin(thread, cpu, "loop");
+    }
+}
+
+// Pool worker index: pinned like a loop with -C, otherwise kept off a
+// dedicated accept set
+void cpu_place_worker(pthread_t thread, int index) {
+    if (workers_pinned) {
+        server_pin_thread(thread, index);
+    } else if (acceptor_pinned) {
+        cpu_set_thread(thread, &process_cpus, "worker");
+    }
+}
+
+// Thread-per-connection client thread: with -C, pinned to the connection's
+// incoming CPU when that is a worker CPU and to the worker set otherwise
+void cpu_place_client(pthread_t thread, int incoming_cpu) {
+    if (workers_pinned) {
+        if (incoming_cpu >= 0 && incoming_cpu < CPU_SETSIZE) {
+            for (int i = 0; i < worker_cpu_count; i++) {
+                if (worker_cpus[i] == incoming_cpu) {
+                    cpu_pin(thread, incoming_cpu, "client");
+                    return;
+                }
+            }
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = 0; i < worker_cpu_count; i++) {
+            CPU_SET(worker_cpus[i], &set);
+        }
+        cpu_set_thread(thread, &set, "client");
+    } else if (acceptor_pinned) {
+        cpu_set_thread(thread, &process_cpus, "client");
+    }
+}
+
+// Move the calling thread onto the accept set, if one was given. Threads it
+// starts afterwards are placed explicitly.
+void cpu_pin_acceptor(void) {
+    if (acceptor_pinned) {
+        cpu_set_thread(pthread_self(), &accept_cpus, "accept");
+    }
+}
+
+// Ask the kernel to hand the listener for shard index the connections
+// whose packets arrive on that shard's CPU (SO_REUSEPORT groups honour
+// SO_INCOMING_CPU since Linux 6.2; older kernels ignore the preference)
+void cpu_steer_listener(int server_socket, int index) {
+    int cpu = cpu_worker(index);
+    if (cpu >= 0 && setsockopt(server_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0) {
+        log_message(LOG_DEBUG, "Failed to set SO_INCOMING_CPU: %s", strerror(errno));
+    }
+}
+
+// CPU the network stack last processed the socket's packets on, -1 if unknown
+int cpu_incoming(int client_socket) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+        return -1;
+    }
+    return cpu;
+}
+
+int cpu_node(int cpu) {
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_nodes[cpu] : 0;
+}
+
+int cpu_node_count(void) {
+    return node_count;
+}
+
+// CPU the caller is running on, -1 if unknown
+int cpu_current(void) {
+    return sched_getcpu();
+}
+
+// NUMA node of the CPU the caller is running on
+int cpu_current_node(void) {
+    return cpu_node(sched_getcpu());
+}
@@ -0,0 +1,476 @@
+/*
+ * aesdsocket-epoll.c
+ *
+ * Event loop server mode: a small number of loop threads multiplex every
+ * client socket with edge-triggered epoll, driving the same per-connection
+ * state machine that client_handler runs in thread-per-connection mode.
+ * Appends never block a loop: the connection is parked until the committer
+ * releases its records onto the loop's completion queue.
+ */
+
+#define _GNU_SOURCE      // For accept4
+#include <stdio.h>       // For standard I/O functions
+#include <stdlib.h>      // For standard library functions
+#include <string.h>      // For string manipulation functions
+#include <errno.h>       // For error number definitions
+#include <unistd.h>      // For POSIX API functions
+#include <fcntl.h>       // For file control options
+#include <syslog.h>      // For system logging
+#include <sys/socket.h>  // For socket API
+#include <sys/epoll.h>   // For epoll
+#include <sys/eventfd.h> // For eventfd
+#include <stddef.h>      // For offsetof
+
+#include "aesdsocket.h"
+
+#define MAX_EVENTS 64
+
+// One event loop thread and the clients it owns
+struct epoll_loop {
+    pthread_t thread_id;
+    int epoll_fd;
+    int server_socket;                 // Own SO_REUSEPORT listener, or the shared one
+    int wake_fd;
+    int timer_fd;                      // Timestamp timer, watched by the first loop only
+    struct store_completions completions; // Appends released by the committer
+    const struct server_options *options;
+    LIST_HEAD(connection_list, connection) connections;
+    struct connection_list closed;     // Closed during this batch, freed after it
+    TAILQ_HEAD(deferred_list, connection) deferred; // Yielded or rate limited clients, in turn order
+};
+
+// Markers stored in epoll_event.data.ptr for the non-client descriptors
+static char listener_tag;
+static char local_listener_tag;
+static char wake_tag;
+static char timer_tag;
+static char append_tag;
+
+// Serve conn again without waiting for an event: its turn is over, or it
+// is paused by a rate limit
+static void epoll_defer(struct epoll_loop *loop, struct connection *conn) {
+    if (!conn->deferred) {
+        TAILQ_INSERT_TAIL(&loop->deferred, conn, deferred_entries);
+        conn->deferred = true;
+    }
+}
+
+// Drive a connection as far as it can go without blocking, reading at most
+// FAIR_QUANTUM bytes before other clients get their turn.
+// Returns false when the connection should be closed.
+static bool epoll_service_connection(struct epoll_loop *loop, struct connection *conn) {
+    ssize_t budget = FAIR_QUANTUM;
+    while (1) {
+        // Flush queued echoes; a slow reader only stalls itself
+        if (connection_send_pending(conn) == CONN_ERROR) {
+            return false;
+        }
+        if (conn->output_throttled) {
+            return true; // Resumed on EPOLLOUT once below the low watermark
+        }
+        if (conn->append_pending) {
+            return true; // Resumed once the append completes
+        }
+        if (connection_input_pending(conn)) {
+            if (connection_resume_input(conn) == CONN_ERROR) {
+                return false;
+            }
+            continue;
+        }
+        if (budget <= 0 || limit_pause_ms(conn) > 0) {
+            epoll_defer(loop, conn);
+            return true;
+        }
+
+        size_t space;
+        char *rx = connection_rx_space(conn, &space);
+        if (!rx) {
+            return false;
+        }
+        ssize_t bytes_received = recv(conn->client_socket, rx, space, 0);
+        if (bytes_received == 0) {
+            // Close once the reply to a final command without a newline is
+            // out; recv() sees the end of input again after EPOLLOUT
+            connection_end_input(conn);
+            return conn->output_count > 0 && connection_send_pending(conn) == CONN_AGAIN;
+        }
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true; // Resumed on EPOLLIN
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERR, "Failed to receive data: %s", strerror(errno));
+            return false;
+        }
+        log_message(LOG_DEBUG, "Received %zd bytes of data", bytes_received);
+        budget -= bytes_received;
+
+        if (connection_handle_data(conn, bytes_received) == CONN_ERROR) {
+            return false;
+        }
+    }
+}
+
+// Stop serving conn: no more events or turns. Already done once it is closing.
+static void epoll_unwatch_connection(struct epoll_loop *loop, struct connection *conn) {
+    if (conn->closing) {
+        return;
+    }
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->client_socket, NULL);
+    if (conn->deferred) {
+        TAILQ_REMOVE(&loop->deferred, conn, deferred_entries);
+        conn->deferred = false;
+    }
+}
+
+// Close conn at once, waiting for an append still in flight. Its memory is
+// kept until the end of the epoll_wait() batch, which may still hold events
+// for it; they are skipped since it is closing.
+static void epoll_free_connection(struct epoll_loop *loop, struct connection *conn) {
+    epoll_unwatch_connection(loop, conn);
+    conn->closing = true;
+    LIST_REMOVE(conn, entries);
+    connection_close(conn);
+    LIST_INSERT_HEAD(&loop->closed, conn, entries);
+}
+
+// Free the connections closed during the last batch
+static void epoll_release_closed(struct epoll_loop *loop) {
+    while (!LIST_EMPTY(&loop->closed)) {
+        struct connection *conn = LIST_FIRST(&loop->closed);
+        LIST_REMOVE(conn, entries);
+        slab_free(&connection_cache, conn);
+    }
+}
+
+// Close conn once its records are stored; until then it stays on the loop's
+// list without events or turns
+static void epoll_drop_connection(struct epoll_loop *loop, struct connection *conn) {
+    epoll_unwatch_connection(loop, conn);
+    if (!connection_flush_input(conn)) {
+        epoll_free_connection(loop, conn);
+    }
+}
+
+// Finish the appends the committer has released and carry on serving their
+// connections, or close those that were waiting for them to close
+static void epoll_complete_appends(struct epoll_loop *loop) {
+    uint64_t count;
+    if (read(loop->completions.event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_message(LOG_ERR, "Failed to read append eventfd: %s", strerror(errno));
+    }
+    struct store_append *append = store_completions_take(&loop->completions);
+    while (append) {
+        struct store_append *next = append->next;
+        struct connection *conn = (struct connection *)((char *)append - offsetof(struct connection, append));
+        bool ok = connection_append_done(conn) == CONN_OK;
+        if (conn->closing || !ok || !epoll_service_connection(loop, conn)) {
+            epoll_drop_connection(loop, conn);
+        }
+        append = next;
+    }
+}
+
+// Accept every connection pending on listener and register it with this loop
+static void epoll_accept_connections(struct epoll_loop *loop, int listener) {
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = accept4(listener, (struct sockaddr *)&client_addr,
+                                    &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct connection *conn = slab_alloc(&connection_cache);
+        if (!conn) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            close(client_socket);
+            continue;
+        }
+        if (connection_open(conn, client_socket, (struct sockaddr *)&client_addr) != 0) {
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
+            continue;
+        }
+        conn->completions = &loop->completions;
+
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            log_message(LOG_ERR, "Failed to register client with epoll: %s", strerror(errno));
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
+            continue;
+        }
+        LIST_INSERT_HEAD(&loop->connections, conn, entries);
+    }
+}
+
+// Stop accepting and timestamping, leaving the open connections to drain
+// and their appends to complete
+static void epoll_stop(struct epoll_loop *loop) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->wake_fd, NULL);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->server_socket, NULL);
+    if (loop->options->local_socket != -1) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->options->local_socket, NULL);
+    }
+    if (loop->timer_fd != -1) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->timer_fd, NULL);
+    }
+}
+
+// Milliseconds until the first deferred client is due, -1 if there is none
+static int epoll_deferred_timeout(struct epoll_loop *loop) {
+    int timeout = -1;
+    struct connection *conn;
+    TAILQ_FOREACH(conn, &loop->deferred, deferred_entries) {
+        int wait_ms = limit_pause_ms(conn);
+        if (timeout < 0 || wait_ms < timeout) {
+            timeout = wait_ms;
+        }
+        if (timeout == 0) {
+            break;
+        }
+    }
+    return timeout;
+}
+
+// Give every deferred client that is due another turn, in the order they
+// were deferred; those deferred again wait for the next pass
+static void epoll_serve_deferred(struct epoll_loop *loop) {
+    struct connection *last = TAILQ_LAST(&loop->deferred, deferred_list);
+    struct connection *conn = TAILQ_FIRST(&loop->deferred);
+    while (conn) {
+        struct connection *next = conn == last ? NULL : TAILQ_NEXT(conn, deferred_entries);
+        if (limit_pause_ms(conn) == 0) {
+            TAILQ_REMOVE(&loop->deferred, conn, deferred_entries);
+            conn->deferred = false;
+            if (!epoll_service_connection(loop, conn)) {
+                epoll_drop_connection(loop, conn);
+            }
+        }
+        conn = next;
+    }
+}
+
+// Thread function: runs one event loop until the wake descriptor fires, then
+// serves the open connections until they close or the drain deadline passes
+static void *epoll_loop_func(void *arg) {
+    struct epoll_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    bool stopping = false;
+    uint64_t deadline = 0;
+
+    while (!stopping || !LIST_EMPTY(&loop->connections)) {
+        int timeout = epoll_deferred_timeout(loop);
+        if (stopping) {
+            int remaining = server_drain_remaining(deadline);
+            if (remaining == 0) {
+                log_message(LOG_INFO, "Drain deadline passed, closing the remaining connections");
+                break;
+            }
+            if (timeout < 0 || remaining < timeout) {
+                timeout = remaining;
+            }
+        }
+        int num_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < num_events; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &wake_tag) {
+                if (!stopping) {
+                    epoll_stop(loop);
+                    stopping = true;
+                    deadline = server_drain_deadline(loop->options);
+                }
+            } else if (ptr == &listener_tag) {
+                epoll_accept_connections(loop, loop->server_socket);
+            } else if (ptr == &local_listener_tag) {
+                epoll_accept_connections(loop, loop->options->local_socket);
+            } else if (ptr == &timer_tag) {
+                timestamp_timer_fire(loop->timer_fd);
+            } else if (ptr == &append_tag) {
+                epoll_complete_appends(loop);
+            } else {
+                struct connection *conn = ptr;
+                if (conn->closing) {
+                    continue; // Dropped earlier in this batch
+                }
+                if ((events[i].events & EPOLLERR) || !epoll_service_connection(loop, conn)) {
+                    epoll_drop_connection(loop, conn);
+                }
+            }
+        }
+        epoll_serve_deferred(loop);
+        epoll_release_closed(loop);
+    }
+
+    while (!LIST_EMPTY(&loop->connections)) {
+        epoll_free_connection(loop, LIST_FIRST(&loop->connections));
+    }
+    epoll_release_closed(loop);
+    return NULL;
+}
+
+// Close a loop's own listener; the shared one belongs to main()
+static void epoll_close_listener(struct epoll_loop *loop, int server_socket) {
+    if (loop->server_socket != server_socket && loop->server_socket != -1) {
+        close(loop->server_socket);
+    }
+    loop->server_socket = -1;
+}
+
+static int epoll_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_message(LOG_ERR, "Failed to make server socket non-blocking: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Run the epoll server until SIGINT/SIGTERM. With listen_shards set, every
+// loop after the first opens its own SO_REUSEPORT listener and the kernel
+// spreads new connections across them, preferring the loop pinned to the
+// CPU a connection arrives on; otherwise every loop watches the
+// shared listening socket with EPOLLEXCLUSIVE, so each accept wakes a single
+// loop. Either way the accepted client stays on that loop for its lifetime.
+// The Unix-domain listener (-U) is always shared that way. The first loop
+// also appends the timestamps when their timer fires.
+int epoll_server_run(int server_socket, const struct server_options *options) {
+    int num_threads = server_thread_count(options);
+    if (epoll_set_nonblocking(server_socket) != 0 ||
+        (options->local_socket != -1 && epoll_set_nonblocking(options->local_socket) != 0)) {
+        return -1;
+    }
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        log_message(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+    struct epoll_loop *loops = calloc(num_threads, sizeof(*loops));
+    if (!loops) {
+        log_message(LOG_ERR, "Memory allocation failed");
+        close(wake_fd);
+        return -1;
+    }
+
+    // Signals are handled here, loop threads only wake through wake_fd
+    sigset_t block_mask, old_mask;
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+
+    int started = 0;
+    for (; started < num_threads; started++) {
+        struct epoll_loop *loop = &loops[started];
+        loop->server_socket = server_socket;
+        if (started > 0 && options->listen_shards > 1) {
+            loop->server_socket = server_listen(options);
+            if (loop->server_socket == -1 || epoll_set_nonblocking(loop->server_socket) != 0) {
+                epoll_close_listener(loop, server_socket);
+                break;
+            }
+        }
+        loop->wake_fd = wake_fd;
+        loop->timer_fd = started == 0 ? options->timestamp_fd : -1;
+        loop->options = options;
+        LIST_INIT(&loop->connections);
+        LIST_INIT(&loop->closed);
+        TAILQ_INIT(&loop->deferred);
+        int append_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (append_fd == -1) {
+            log_message(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+            epoll_close_listener(loop, server_socket);
+            break;
+        }
+        store_completions_init(&loop->completions, append_fd);
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd == -1) {
+            log_message(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+            close(append_fd);
+            epoll_close_listener(loop, server_socket);
+            break;
+        }
+        struct epoll_event listen_event = {
+            .events = EPOLLIN | (options->listen_shards > 1 ? 0 : EPOLLEXCLUSIVE),
+            .data.ptr = &listener_tag,
+        };
+        struct epoll_event local_event = {
+            .events = EPOLLIN | EPOLLEXCLUSIVE,
+            .data.ptr = &local_listener_tag,
+        };
+        struct epoll_event wake_event = {
+            .events = EPOLLIN,
+            .data.ptr = &wake_tag,
+        };
+        struct epoll_event timer_event = {
+            .events = EPOLLIN,
+            .data.ptr = &timer_tag,
+        };
+        struct epoll_event append_event = {
+            .events = EPOLLIN,
+            .data.ptr = &append_tag,
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_socket, &listen_event) == -1 ||
+            (options->local_socket != -1 &&
+             epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, options->local_socket, &local_event) == -1) ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_event) == -1 ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, append_fd, &append_event) == -1 ||
+            (loop->timer_fd != -1 &&
+             epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &timer_event) == -1)) {
+            log_message(LOG_ERR, "Failed to register with epoll: %s", strerror(errno));
+            close(loop->epoll_fd);
+            close(append_fd);
+            epoll_close_listener(loop, server_socket);
+            break;
+        }
+        if (pthread_create(&loop->thread_id, NULL, epoll_loop_func, loop) != 0) {
+            log_message(LOG_ERR, "Failed to create epoll loop thread");
+            close(loop->epoll_fd);
+            close(append_fd);
+            epoll_close_listener(loop, server_socket);
+            break;
+        }
+        server_pin_thread(loop->thread_id, started);
+        if (options->listen_shards > 1) {
+            cpu_steer_listener(loop->server_socket, started);
+        }
+    }
+    log_message(LOG_INFO, "Started %d epoll loop thread(s)", started);
+
+    // Wait for shutdown, then wake every loop (wake_fd stays readable)
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (started > 0) {
+        server_wait_shutdown();
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        log_message(LOG_ERR, "Failed to wake epoll loops: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread_id, NULL);
+        close(loops[i].epoll_fd);
+        close(loops[i].completions.event_fd);
+        epoll_close_listener(&loops[i], server_socket);
+    }
+    free(loops);
+    close(wake_fd);
+    return started == num_threads ? 0 : -1;
+}
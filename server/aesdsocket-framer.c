@@ -0,0 +1,181 @@
+/*
+ * aesdsocket-framer.c
+ *
+ * Per-connection receive chain for the text protocol. recv() writes straight
+ * into fixed-size segments chained together, so a record of any size is
+ * assembled without realloc or copying. The newline scan resumes where it
+ * left off, so each received byte is searched once (memchr is vectorized
+ * in glibc), and complete records can be handed to the store as one iovec
+ * array covering every segment they span.
+ *
+ * Segment headers and their page-aligned data buffers come from object
+ * caches, so a busy connection reuses the same blocks record after record.
+ *
+ * Offsets taken and returned by these functions are logical: 0 is the
+ * first unconsumed byte of the chain.
+ */
+
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <syslog.h>     // For system logging
+
+#include "aesdsocket.h"
+
+size_t rx_segment_size = RX_SEGMENT_SIZE; // Set once at startup, see rx_buffer_size
+
+static struct slab_cache segment_cache = SLAB_CACHE("rx_segment", sizeof(struct rx_segment),
+                                                    _Alignof(struct rx_segment), SLAB_CACHED_MAX);
+
+static struct rx_segment *rx_segment_alloc(void) {
+    struct rx_segment *segment = slab_alloc(&segment_cache);
+    char *data = slab_alloc(&io_buffer_cache);
+    if (!segment || !data) {
+        log_message(LOG_ERR, "Memory allocation failed");
+        slab_free(&segment_cache, segment);
+        slab_free(&io_buffer_cache, data);
+        return NULL;
+    }
+    segment->next = NULL;
+    segment->len = 0;
+    segment->data = data;
+    return segment;
+}
+
+static void rx_segment_free(struct rx_segment *segment) {
+    slab_free(&io_buffer_cache, segment->data);
+    slab_free(&segment_cache, segment);
+}
+
+// Free space at the end of the chain for the next recv(), adding a segment if
+// the last one is full. Returns NULL if no memory is available.
+char *rx_chain_space(struct rx_chain *chain, size_t *space) {
+    if (!chain->tail || chain->tail->len == rx_segment_size) {
+        struct rx_segment *segment = rx_segment_alloc();
+        if (!segment) {
+            return NULL;
+        }
+        if (chain->tail) {
+            chain->tail->next = segment;
+        } else {
+            chain->head = segment;
+            chain->start = 0;
+        }
+        chain->tail = segment;
+    }
+    *space = rx_segment_size - chain->tail->len;
+    return chain->tail->data + chain->tail->len;
+}
+
+// Account for len bytes received into the space returned by rx_chain_space()
+void rx_chain_commit(struct rx_chain *chain, size_t len) {
+    chain->tail->len += len;
+    chain->length += len;
+}
+
+// Find the segment holding logical offset pos and the offset within it
+static struct rx_segment *rx_chain_locate(const struct rx_chain *chain, size_t pos, size_t *offset) {
+    struct rx_segment *segment = chain->head;
+    size_t physical = chain->start + pos;
+    while (segment && physical >= segment->len) {
+        physical -= segment->len;
+        segment = segment->next;
+    }
+    *offset = physical;
+    return segment;
+}
+
+// Logical offset of the first newline at or after chain->scanned, or -1 if
+// there is none. Bytes before the returned offset are not searched again.
+ssize_t rx_chain_find_newline(struct rx_chain *chain) {
+    size_t offset;
+    struct rx_segment *segment = rx_chain_locate(chain, chain->scanned, &offset);
+    while (segment) {
+        const char *found = memchr(segment->data + offset, '\n', segment->len - offset);
+        if (found) {
+            chain->scanned += found - (segment->data + offset);
+            return chain->scanned;
+        }
+        chain->scanned += segment->len - offset;
+        segment = segment->next;
+        offset = 0;
+    }
+    return -1;
+}
+
+// Copy up to len bytes starting at logical offset from into dst; returns bytes copied
+size_t rx_chain_copy(const struct rx_chain *chain, size_t from, size_t len, char *dst) {
+    size_t offset;
+    size_t copied = 0;
+    struct rx_segment *segment = rx_chain_locate(chain, from, &offset);
+    while (segment && copied < len) {
+        size_t chunk = segment->len - offset;
+        if (chunk > len - copied) {
+            chunk = len - copied;
+        }
+        memcpy(dst + copied, segment->data + offset, chunk);
+        copied += chunk;
+        segment = segment->next;
+        offset = 0;
+    }
+    return copied;
+}
+
+// Describe the first len bytes of the chain as an iovec array of at most
+// max_iov entries. Returns the number of entries, or -1 if max_iov is too small.
+int rx_chain_iovec(const struct rx_chain *chain, size_t len, struct iovec *iov, int max_iov) {
+    struct rx_segment *segment = chain->head;
+    size_t offset = chain->start;
+    int count = 0;
+    while (len > 0 && segment) {
+        if (count == max_iov) {
+            return -1;
+        }
+        size_t chunk = segment->len - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
+        iov[count].iov_base = segment->data + offset;
+        iov[count].iov_len = chunk;
+        count++;
+        len -= chunk;
+        segment = segment->next;
+        offset = 0;
+    }
+    return count;
+}
+
+// Number of segments the first len bytes of the chain span
+int rx_chain_segments(const struct rx_chain *chain, size_t len) {
+    size_t span = chain->start + len;
+    return (span + rx_segment_size - 1) / rx_segment_size;
+}
+
+// Drop the first len bytes, freeing segments that become empty. The last
+// segment is kept for reuse once everything has been consumed.
+void rx_chain_consume(struct rx_chain *chain, size_t len) {
+    chain->length -= len;
+    chain->scanned = chain->scanned > len ? chain->scanned - len : 0;
+    chain->start += len;
+    while (chain->head && chain->start >= chain->head->len && chain->head != chain->tail) {
+        struct rx_segment *segment = chain->head;
+        chain->start -= segment->len;
+        chain->head = segment->next;
+        rx_segment_free(segment);
+    }
+    if (chain->length == 0 && chain->head) {
+        chain->head->len = 0;
+        chain->start = 0;
+    }
+}
+
+void rx_chain_free(struct rx_chain *chain) {
+    while (chain->head) {
+        struct rx_segment *segment = chain->head;
+        chain->head = segment->next;
+        rx_segment_free(segment);
+    }
+    chain->tail = NULL;
+    chain->start = 0;
+    chain->length = 0;
+    chain->scanned = 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * aesdsocket-limit.c
+ *
+ * Admission control and rate limiting. A table of open connections per
+ * client address caps how many connections one source may hold (-c), and
+ * every connection carries token buckets for the bytes (-r) and records
+ * (-R) it sends. A bucket refills at its rate up to one second's worth and
+ * may go into debt: input is charged once it has arrived, and the server
+ * stops reading from the connection until the debt is repaid, so a large
+ * read costs a longer pause instead of being refused.
+ */
+
+#include <string.h>     // For string manipulation functions
+
+#include "aesdsocket.h"
+
+#define LIMIT_TABLE_SIZE 1024 // Hash chains of the per-address table
+
+// Open connections from one client address
+struct limit_client {
+    struct limit_client *next;
+    unsigned int connections;
+    char ip[INET6_ADDRSTRLEN];
+};
+
+// Replaced by limit_start() on every reload
+static _Atomic unsigned int max_per_client; // -c, 0 = no limit
+static _Atomic double byte_rate;            // -r, 0 = no limit
+static _Atomic double record_rate;          // -R, 0 = no limit
+
+static struct slab_cache client_cache = SLAB_CACHE("limit_client", sizeof(struct limit_client),
+                                                   _Alignof(struct limit_client), SLAB_CACHED_MAX);
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct limit_client *table[LIMIT_TABLE_SIZE]; // Protected by table_mutex
+
+// Take the limits from options, at startup and on reload. Connections
+// already open keep their buckets and are charged at the new rates; those
+// admitted before a per-address limit existed are not counted against it.
+void limit_start(const struct server_options *options) {
+    atomic_store(&max_per_client, options->max_client_connections);
+    atomic_store(&byte_rate, (double)options->byte_rate);
+    atomic_store(&record_rate, (double)options->record_rate);
+    if (options->max_client_connections > 0) {
+        log_message(LOG_INFO, "Admitting at most %u connection(s) per client address",
+                    options->max_client_connections);
+    }
+    if (options->byte_rate > 0 || options->record_rate > 0) {
+        log_message(LOG_INFO, "Rate limiting each connection to %llu bytes/s and %llu records/s (0 = unlimited)",
+                    (unsigned long long)options->byte_rate, (unsigned long long)options->record_rate);
+    }
+}
+
+// FNV-1a of the address text
+static unsigned int limit_hash(const char *ip) {
+    uint32_t hash = 2166136261u;
+    for (; *ip; ip++) {
+        hash = (hash ^ (unsigned char)*ip) * 16777619u;
+    }
+    return hash % LIMIT_TABLE_SIZE;
+}
+
+// Fill the buckets of a new connection and count it against its client
+// address. Returns false, leaving the count alone, if the address already
+// holds max_per_client connections.
+bool limit_admit(struct connection *conn) {
+    conn->admitted = false;
+    memset(&conn->byte_bucket, 0, sizeof(conn->byte_bucket));
+    memset(&conn->record_bucket, 0, sizeof(conn->record_bucket));
+    conn->byte_bucket.tokens = atomic_load_explicit(&byte_rate, memory_order_relaxed);
+    conn->record_bucket.tokens = atomic_load_explicit(&record_rate, memory_order_relaxed);
+    conn->paused_until = 0;
+    unsigned int limit = atomic_load_explicit(&max_per_client, memory_order_relaxed);
+    if (limit == 0) {
+        return true;
+    }
+
+    struct limit_client **chain = &table[limit_hash(conn->client_ip)];
+    pthread_mutex_lock(&table_mutex);
+    struct limit_client *client = *chain;
+    while (client && strcmp(client->ip, conn->client_ip) != 0) {
+        client = client->next;
+    }
+    if (!client) {
+        client = slab_alloc(&client_cache);
+        if (!client) {
+            pthread_mutex_unlock(&table_mutex);
+            log_message(LOG_ERR, "Memory allocation failed");
+            return false;
+        }
+        client->connections = 0;
+        strcpy(client->ip, conn->client_ip);
+        client->next = *chain;
+        *chain = client;
+    }
+    if (client->connections >= limit) {
+        pthread_mutex_unlock(&table_mutex);
+        metrics_limit_rejected();
+        log_message(LOG_WARNING, "Rejected connection from %s: %u connection(s) already open",
+                    conn->client_ip, client->connections);
+        return false;
+    }
+    client->connections++;
+    conn->admitted = true;
+    pthread_mutex_unlock(&table_mutex);
+    return true;
+}
+
+// Give back the admission of a closing connection
+void limit_release(struct connection *conn) {
+    if (!conn->admitted) {
+        return;
+    }
+    conn->admitted = false;
+    struct limit_client **link = &table[limit_hash(conn->client_ip)];
+    pthread_mutex_lock(&table_mutex);
+    while (*link && strcmp((*link)->ip, conn->client_ip) != 0) {
+        link = &(*link)->next;
+    }
+    struct limit_client *client = *link;
+    if (client && --client->connections == 0) {
+        *link = client->next;
+        slab_free(&client_cache, client);
+    }
+    pthread_mutex_unlock(&table_mutex);
+}
+
+// Refill bucket for the time since its last charge, take amount, and return
+// how long the debt takes to repay, 0 if none
+static uint64_t bucket_charge(struct token_bucket *bucket, double rate, double amount, uint64_t now) {
+    if (bucket->updated_ns != 0) {
+        bucket->tokens += rate * (now - bucket->updated_ns) / 1e9;
+        if (bucket->tokens > rate) {
+            bucket->tokens = rate; // Burst of one second's worth
+        }
+    }
+    bucket->updated_ns = now;
+    bucket->tokens -= amount;
+    return bucket->tokens < 0 ? (uint64_t)(-bucket->tokens / rate * 1e9) + 1 : 0;
+}
+
+// Charge bytes and records just received to the connection's buckets, and
+// pause reading from it until any debt is repaid
+void limit_charge(struct connection *conn, size_t bytes, size_t records) {
+    double bytes_per_second = atomic_load_explicit(&byte_rate, memory_order_relaxed);
+    double records_per_second = atomic_load_explicit(&record_rate, memory_order_relaxed);
+    if ((bytes_per_second == 0 || bytes == 0) && (records_per_second == 0 || records == 0)) {
+        return;
+    }
+    uint64_t now = metrics_now();
+    uint64_t wait = 0;
+    bool by_records = false;
+    if (bytes_per_second > 0 && bytes > 0) {
+        wait = bucket_charge(&conn->byte_bucket, bytes_per_second, bytes, now);
+    }
+    if (records_per_second > 0 && records > 0) {
+        uint64_t record_wait = bucket_charge(&conn->record_bucket, records_per_second, records, now);
+        if (record_wait > wait) {
+            wait = record_wait;
+            by_records = true;
+        }
+    }
+    if (wait > 0 && now + wait > conn->paused_until) {
+        if (conn->paused_until <= now) {
+            metrics_rate_limited(conn, by_records);
+        }
+        conn->paused_until = now + wait;
+    }
+}
+
+// Milliseconds, rounded up, before the connection may be read from again;
+// 0 once it is not paused
+int limit_pause_ms(struct connection *conn) {
+    if (conn->paused_until == 0) {
+        return 0;
+    }
+    uint64_t now = metrics_now();
+    if (now >= conn->paused_until) {
+        conn->paused_until = 0;
+        return 0;
+    }
+    return (int)((conn->paused_until - now + 999999) / 1000000);
+}
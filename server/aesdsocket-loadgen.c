@@ -0,0 +1,542 @@
+/*
+ * aesdsocket-loadgen.c
+ *
+ * Load generator for aesdsocket. Every connection runs in its own thread
+ * and speaks the binary protocol (aesdsocket-protocol.h), so each operation
+ * has a framed reply whose round trip can be timed. Workloads:
+ *
+ *   append   APPEND a record, wait for the acknowledged length
+ *   echo     APPEND a record, then ECHO the whole store
+ *   seekto   mostly SEEKTO one of the last commands, with an APPEND every 8th op
+ *   slow     APPEND and ECHO, reading the echo in small pieces with pauses
+ *   mixed    connections take the four workloads above in turn
+ *   stat     STAT only, writing nothing (a readiness probe)
+ *
+ * Results are printed as one line of key=value pairs per workload; a mixed
+ * run adds a line for all connections together (workload=all). Connections
+ * that completed no operation at all are counted as stalled, and the exit
+ * status is non-zero when there are any, or any errors. With -U the
+ * connections go to the server's Unix socket instead ('@' for an abstract
+ * name), for comparison with TCP loopback.
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <unistd.h>     // For POSIX API functions
+#include <stdint.h>     // For uint64_t
+#include <stdbool.h>    // For boolean data type
+#include <stdatomic.h>  // For the stop flag
+#include <pthread.h>    // For POSIX threads
+#include <time.h>       // For clock_gettime, nanosleep
+#include <endian.h>     // For htobe64, be64toh
+#include <netdb.h>      // For getaddrinfo
+#include <sys/socket.h> // For socket API
+#include <sys/un.h>     // For struct sockaddr_un
+#include <stddef.h>     // For offsetof
+#include <sys/time.h>   // For struct timeval
+#include <netinet/in.h> // For Internet address family
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <arpa/inet.h>  // For htonl
+
+#include "aesdsocket-protocol.h"
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define DISCARD_SIZE (64 * 1024)
+#define SLOW_READ_SIZE 4096
+#define SLOW_READ_PAUSE_NS 1000000 // Pause between reads of a slow reader
+#define SEEKTO_WINDOW 10           // Commands near the end that seekto targets
+
+enum workload {
+    WORKLOAD_APPEND,
+    WORKLOAD_ECHO,
+    WORKLOAD_SEEKTO,
+    WORKLOAD_SLOW,
+    WORKLOAD_COUNT,
+    WORKLOAD_MIXED = WORKLOAD_COUNT,
+    WORKLOAD_STAT,
+};
+
+static const char *workload_names[] = {
+    [WORKLOAD_APPEND] = "append",
+    [WORKLOAD_ECHO] = "echo",
+    [WORKLOAD_SEEKTO] = "seekto",
+    [WORKLOAD_SLOW] = "slow",
+    [WORKLOAD_MIXED] = "mixed",
+    [WORKLOAD_STAT] = "stat",
+};
+
+struct latency {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+struct client {
+    pthread_t thread;
+    enum workload workload;
+    int sock;
+    char *record;                // Payload for APPEND, newline terminated
+    unsigned int seed;
+    uint64_t commands;           // Commands stored, from the last STAT or APPEND
+    struct latency latency;
+    uint64_t ops;
+    uint64_t abandoned;          // Operations cut off by the end of the run
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t errors;
+    char discard[DISCARD_SIZE];
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *local_path;      // Unix socket to connect to instead, NULL = TCP
+    int connections;
+    double duration;
+    size_t record_size;
+    enum workload workload;
+} config = {
+    .host = "127.0.0.1",
+    .port = "9000",
+    .connections = 8,
+    .duration = 10,
+    .record_size = 64,
+    .workload = WORKLOAD_MIXED,
+};
+
+static _Atomic bool stopping;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static unsigned int latency_index(uint64_t value) {
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+static uint64_t latency_value(unsigned int index) {
+    if (index < (1u << HISTOGRAM_SUB_BITS)) {
+        return index;
+    }
+    unsigned int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = (1u << HISTOGRAM_SUB_BITS) | (index & ((1u << HISTOGRAM_SUB_BITS) - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+static void latency_record(struct latency *latency, uint64_t value) {
+    latency->buckets[latency_index(value)]++;
+    latency->count++;
+    if (value > latency->max) {
+        latency->max = value;
+    }
+}
+
+static void latency_merge(struct latency *into, const struct latency *from) {
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static uint64_t latency_quantile(const struct latency *latency, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * latency->count + 0.5);
+    uint64_t seen = 0;
+    if (latency->count == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += latency->buckets[i];
+        if (seen >= rank) {
+            return latency_value(i) < latency->max ? latency_value(i) : latency->max;
+        }
+    }
+    return latency->max;
+}
+
+static int send_all(struct client *client, const void *data, size_t len) {
+    const char *pos = data;
+    while (len > 0) {
+        ssize_t sent = send(client->sock, pos, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        pos += sent;
+        len -= sent;
+        client->bytes_out += sent;
+    }
+    return 0;
+}
+
+// Receive exactly len bytes into data, or discard them if data is NULL.
+// Slow readers take at most SLOW_READ_SIZE at a time and pause in between.
+static int recv_all(struct client *client, void *data, size_t len) {
+    char *pos = data;
+    while (len > 0) {
+        size_t want = len;
+        char *dst = pos ? pos : client->discard;
+        if (!pos && want > DISCARD_SIZE) {
+            want = DISCARD_SIZE;
+        }
+        if (client->workload == WORKLOAD_SLOW && want > SLOW_READ_SIZE) {
+            want = SLOW_READ_SIZE;
+        }
+        if (atomic_load_explicit(&stopping, memory_order_relaxed)) {
+            return -1; // Abandon the reply, the benchmark is over
+        }
+        ssize_t received = recv(client->sock, dst, want, 0);
+        if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        if (pos) {
+            pos += received;
+        }
+        len -= received;
+        client->bytes_in += received;
+        if (client->workload == WORKLOAD_SLOW && len > 0) {
+            struct timespec pause = { .tv_sec = 0, .tv_nsec = SLOW_READ_PAUSE_NS };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return 0;
+}
+
+// Send one request and read its response. Up to reply_len bytes of the
+// payload are stored in reply; the rest is discarded. Returns the response
+// status, or -1 if the connection failed.
+static int request(struct client *client, uint8_t opcode, const void *payload, uint32_t length,
+                   void *reply, size_t reply_len) {
+    struct aesd_frame_header header = {
+        .opcode = opcode,
+        .status = 0,
+        .reserved = 0,
+        .length = htonl(length),
+    };
+    if (send_all(client, &header, sizeof(header)) != 0 ||
+        (length > 0 && send_all(client, payload, length) != 0) ||
+        recv_all(client, &header, sizeof(header)) != 0) {
+        return -1;
+    }
+    uint32_t response_len = ntohl(header.length);
+    size_t keep = response_len < reply_len ? response_len : reply_len;
+    if ((keep > 0 && recv_all(client, reply, keep) != 0) ||
+        recv_all(client, NULL, response_len - keep) != 0) {
+        return -1;
+    }
+    return header.status;
+}
+
+static int op_append(struct client *client) {
+    uint64_t length;
+    int status = request(client, AESD_OP_APPEND, client->record, config.record_size, &length, sizeof(length));
+    if (status == 0) {
+        client->commands++;
+    }
+    return status;
+}
+
+static int op_stat(struct client *client) {
+    struct aesd_stat_payload stat;
+    int status = request(client, AESD_OP_STAT, NULL, 0, &stat, sizeof(stat));
+    if (status == 0) {
+        client->commands = be64toh(stat.commands);
+    }
+    return status;
+}
+
+static int op_seekto(struct client *client) {
+    uint64_t window = client->commands < SEEKTO_WINDOW ? client->commands : SEEKTO_WINDOW;
+    if (window == 0) {
+        return op_append(client);
+    }
+    uint32_t fields[2] = {
+        htonl(client->commands - 1 - rand_r(&client->seed) % window),
+        htonl(0),
+    };
+    return request(client, AESD_OP_SEEKTO, fields, sizeof(fields), NULL, 0);
+}
+
+// Run one operation of the client's workload; returns its status
+static int client_step(struct client *client) {
+    int status;
+    switch (client->workload) {
+        case WORKLOAD_APPEND:
+            return op_append(client);
+        case WORKLOAD_STAT:
+            return op_stat(client);
+        case WORKLOAD_SEEKTO:
+            if (client->ops % 64 == 0 && (status = op_stat(client)) != 0) {
+                return status;
+            }
+            return client->ops % 8 == 0 ? op_append(client) : op_seekto(client);
+        default:
+            if ((status = op_append(client)) != 0) {
+                return status;
+            }
+            return request(client, AESD_OP_ECHO, NULL, 0, NULL, 0);
+    }
+}
+
+// Connect to the Unix socket at config.local_path
+static int client_connect_local(struct client *client) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t path_len = strlen(config.local_path);
+    memcpy(addr.sun_path, config.local_path, path_len);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    } else {
+        addr_len++;
+    }
+    client->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->sock != -1 && connect(client->sock, (struct sockaddr *)&addr, addr_len) != 0) {
+        close(client->sock);
+        client->sock = -1;
+    }
+    if (client->sock == -1) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", config.local_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int client_connect_tcp(struct client *client) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *result;
+    int error = getaddrinfo(config.host, config.port, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", config.host, gai_strerror(error));
+        return -1;
+    }
+    client->sock = -1;
+    for (struct addrinfo *addr = result; addr && client->sock == -1; addr = addr->ai_next) {
+        client->sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (client->sock != -1 && connect(client->sock, addr->ai_addr, addr->ai_addrlen) != 0) {
+            close(client->sock);
+            client->sock = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (client->sock == -1) {
+        fprintf(stderr, "Failed to connect to %s:%s: %s\n", config.host, config.port, strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(client->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+static int client_connect(struct client *client) {
+    int status = config.local_path ? client_connect_local(client) : client_connect_tcp(client);
+    if (status != 0) {
+        return status;
+    }
+    // Wake up now and then to notice the end of the benchmark
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char magic[AESD_BINARY_MAGIC_LEN];
+    if (send_all(client, AESD_BINARY_MAGIC, AESD_BINARY_MAGIC_LEN) != 0 ||
+        recv_all(client, magic, sizeof(magic)) != 0 ||
+        memcmp(magic, AESD_BINARY_MAGIC, AESD_BINARY_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Server did not accept the binary protocol\n");
+        close(client->sock);
+        return -1;
+    }
+    return 0;
+}
+
+// Thread function: run the client's workload until the benchmark ends
+static void *client_func(void *arg) {
+    struct client *client = arg;
+
+    if (client_connect(client) != 0) {
+        client->errors++;
+        return NULL;
+    }
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        uint64_t start = now_ns();
+        int status = client_step(client);
+        if (status < 0) {
+            if (atomic_load_explicit(&stopping, memory_order_relaxed)) {
+                client->abandoned++;
+            } else {
+                client->errors++;
+            }
+            break;
+        }
+        if (status > 0) {
+            client->errors++;
+        }
+        latency_record(&client->latency, now_ns() - start);
+        client->ops++;
+    }
+    close(client->sock);
+    return NULL;
+}
+
+// Print the results of the clients running workload, or of all of them
+// when workload is WORKLOAD_MIXED
+static void report(struct client *clients, enum workload workload, const char *label, double elapsed) {
+    static struct latency latency;
+    uint64_t ops = 0, abandoned = 0, bytes_in = 0, bytes_out = 0, errors = 0;
+    int connections = 0, stalled = 0;
+
+    memset(&latency, 0, sizeof(latency));
+    for (int i = 0; i < config.connections; i++) {
+        struct client *client = &clients[i];
+        if (workload != WORKLOAD_MIXED && client->workload != workload) {
+            continue;
+        }
+        latency_merge(&latency, &client->latency);
+        ops += client->ops;
+        abandoned += client->abandoned;
+        stalled += client->ops == 0;
+        bytes_in += client->bytes_in;
+        bytes_out += client->bytes_out;
+        errors += client->errors;
+        connections++;
+    }
+    if (connections == 0) {
+        return;
+    }
+    printf("workload=%s connections=%d duration_s=%.3f ops=%llu ops_per_s=%.1f "
+           "mb_out_per_s=%.3f mb_in_per_s=%.3f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f errors=%llu "
+           "stalled=%d abandoned=%llu\n",
+           label, connections, elapsed, (unsigned long long)ops, ops / elapsed,
+           bytes_out / elapsed / 1e6, bytes_in / elapsed / 1e6,
+           latency_quantile(&latency, 0.5) / 1e3, latency_quantile(&latency, 0.99) / 1e3,
+           latency_quantile(&latency, 0.999) / 1e3, latency.max / 1e3, (unsigned long long)errors,
+           stalled, (unsigned long long)abandoned);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-U unix_socket|@name] [-c connections] [-d seconds] [-s record_size] "
+            "[-w append|echo|seekto|slow|mixed|stat]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "h:p:U:c:d:s:w:")) != -1) {
+        switch (c) {
+            case 'h':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.port = optarg;
+                break;
+            case 'U':
+                if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+                    usage(argv[0]);
+                }
+                config.local_path = optarg;
+                break;
+            case 'c':
+                config.connections = atoi(optarg);
+                if (config.connections < 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                if (config.duration <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                config.record_size = strtoul(optarg, NULL, 0);
+                if (config.record_size < 1 || config.record_size > AESD_FRAME_MAX) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'w': {
+                int workload = 0;
+                while (workload <= WORKLOAD_STAT && strcmp(optarg, workload_names[workload]) != 0) {
+                    workload++;
+                }
+                if (workload > WORKLOAD_STAT) {
+                    usage(argv[0]);
+                }
+                config.workload = workload;
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    struct client *clients = calloc(config.connections, sizeof(*clients));
+    char *record = malloc(config.record_size);
+    if (!clients || !record) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    memset(record, 'a', config.record_size - 1);
+    record[config.record_size - 1] = '\n';
+
+    uint64_t start = now_ns();
+    int started = 0;
+    for (; started < config.connections; started++) {
+        struct client *client = &clients[started];
+        client->workload = config.workload == WORKLOAD_MIXED ? (enum workload)(started % WORKLOAD_COUNT) : config.workload;
+        client->record = record;
+        client->seed = started + 1;
+        if (pthread_create(&client->thread, NULL, client_func, client) != 0) {
+            fprintf(stderr, "Failed to create client thread\n");
+            break;
+        }
+    }
+
+    struct timespec duration = {
+        .tv_sec = (time_t)config.duration,
+        .tv_nsec = (long)((config.duration - (time_t)config.duration) * 1e9),
+    };
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+    }
+    atomic_store(&stopping, true);
+    for (int i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    config.connections = started;
+
+    if (config.workload == WORKLOAD_MIXED) {
+        for (int workload = 0; workload < WORKLOAD_COUNT; workload++) {
+            report(clients, workload, workload_names[workload], elapsed);
+        }
+        report(clients, WORKLOAD_MIXED, "all", elapsed);
+    } else {
+        report(clients, WORKLOAD_MIXED, workload_names[config.workload], elapsed);
+    }
+
+    uint64_t errors = 0;
+    int stalled = 0;
+    for (int i = 0; i < started; i++) {
+        errors += clients[i].errors;
+        stalled += clients[i].ops == 0;
+    }
+    free(record);
+    free(clients);
+    return errors == 0 && stalled == 0 && started > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,272 @@
+/*
+ * aesdsocket-log.c
+ *
+ * Asynchronous logger (see aesdsocket-log.h). Producers claim ring slots
+ * with a compare-and-swap on the tail and publish them through a per-slot
+ * sequence number (a bounded MPSC queue), so logging never takes a lock or
+ * makes a system call on the caller's thread. Until log_open() starts the
+ * drain thread, and after log_close() stops it, messages go to syslog
+ * directly.
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdarg.h>     // For variable arguments
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <unistd.h>     // For POSIX API functions
+#include <fcntl.h>      // For file control options
+#include <pthread.h>    // For POSIX threads
+#include <signal.h>     // For sigset_t
+#include <stdbool.h>    // For boolean data type
+#include <stdint.h>     // For intptr_t
+#include <time.h>       // For time functions
+
+#include "aesdsocket-log.h"
+
+struct log_slot {
+    _Atomic size_t seq;     // Equals the slot position when free, position + 1 when filled
+    int level;
+    struct timespec time;
+    char text[LOG_MESSAGE_MAX];
+};
+
+_Atomic int log_level = LOG_INFO;
+
+static struct log_slot ring[LOG_RING_SIZE];
+static _Atomic size_t ring_tail;            // Next position producers claim
+static size_t ring_head;                    // Next position to drain, drain thread only
+static _Atomic unsigned long dropped;       // Messages lost to a full ring
+static _Atomic bool ring_active;            // Drain thread running
+static _Atomic bool drain_sleeping;         // Drain thread waiting for drain_cond
+
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping;                       // Protected by drain_mutex
+static pthread_t drain_thread;
+static int log_fd = -1;                     // Log file, -1 for syslog
+
+static const char *level_names[] = {
+    [LOG_EMERG] = "emerg",
+    [LOG_ALERT] = "alert",
+    [LOG_CRIT] = "crit",
+    [LOG_ERR] = "err",
+    [LOG_WARNING] = "warning",
+    [LOG_NOTICE] = "notice",
+    [LOG_INFO] = "info",
+    [LOG_DEBUG] = "debug",
+};
+
+// Level for a name given on the command line, or -1 if unknown
+int log_parse_level(const char *name) {
+    for (int level = LOG_EMERG; level <= LOG_DEBUG; level++) {
+        if (strcmp(name, level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// Queue a message for the drain thread; drops it if the ring is full
+void log_write(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (!atomic_load_explicit(&ring_active, memory_order_acquire)) {
+        vsyslog(level, format, args);
+        va_end(args);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    struct log_slot *slot;
+    while (1) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        } else {
+            pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    atomic_store(&slot->seq, pos + 1);
+
+    // Wake the drain thread only if it went to sleep on an empty ring
+    if (atomic_load(&drain_sleeping)) {
+        pthread_mutex_lock(&drain_mutex);
+        pthread_cond_signal(&drain_cond);
+        pthread_mutex_unlock(&drain_mutex);
+    }
+}
+
+static bool log_pending(void) {
+    struct log_slot *slot = &ring[ring_head & (LOG_RING_SIZE - 1)];
+    return atomic_load(&slot->seq) == ring_head + 1;
+}
+
+static void log_flush_batch(char *batch, size_t *len) {
+    if (*len > 0 && write(log_fd, batch, *len) < 0) {
+        syslog(LOG_ERR, "Failed to write log file: %s", strerror(errno));
+    }
+    *len = 0;
+}
+
+// Format one message as a log file line at the end of batch
+static void log_format_line(char *batch, size_t *len, int level, const struct timespec *time, const char *text) {
+    struct tm tm_info;
+    char stamp[32];
+    localtime_r(&time->tv_sec, &tm_info);
+    strftime(stamp, sizeof(stamp), "%b %d %H:%M:%S", &tm_info);
+    int written = snprintf(batch + *len, LOG_BATCH_MAX - *len, "%s.%06ld aesdsocket[%d]: %s: %s\n",
+                           stamp, time->tv_nsec / 1000, (int)getpid(), level_names[level & LOG_PRIMASK], text);
+    if (written > 0) {
+        *len += (size_t)written < LOG_BATCH_MAX - *len ? (size_t)written : LOG_BATCH_MAX - *len - 1;
+    }
+}
+
+// Write out every published message; returns how many there were
+static size_t log_drain(void) {
+    static char batch[LOG_BATCH_MAX];
+    size_t len = 0;
+    size_t drained = 0;
+
+    while (log_pending()) {
+        struct log_slot *slot = &ring[ring_head & (LOG_RING_SIZE - 1)];
+        if (log_fd == -1) {
+            syslog(slot->level, "%s", slot->text);
+        } else {
+            if (LOG_BATCH_MAX - len < LOG_MESSAGE_MAX + 64) {
+                log_flush_batch(batch, &len);
+            }
+            log_format_line(batch, &len, slot->level, &slot->time, slot->text);
+        }
+        atomic_store_explicit(&slot->seq, ring_head + LOG_RING_SIZE, memory_order_release);
+        ring_head++;
+        drained++;
+    }
+    unsigned long lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if (lost > 0) {
+        char text[64];
+        snprintf(text, sizeof(text), "Log ring full, %lu messages dropped", lost);
+        if (log_fd == -1) {
+            syslog(LOG_WARNING, "%s", text);
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            log_format_line(batch, &len, LOG_WARNING, &now, text);
+        }
+    }
+    if (log_fd != -1) {
+        log_flush_batch(batch, &len);
+    }
+    return drained;
+}
+
+// Thread function: write out queued messages until log_close()
+static void *log_drain_func(void *arg) {
+    (void)arg;
+    while (1) {
+        if (log_drain() > 0) {
+            continue;
+        }
+        pthread_mutex_lock(&drain_mutex);
+        atomic_store(&drain_sleeping, true);
+        if (!stopping && !log_pending()) {
+            // The timeout only bounds the cost of a missed wakeup
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&drain_cond, &drain_mutex, &deadline);
+        }
+        atomic_store(&drain_sleeping, false);
+        bool stop = stopping;
+        pthread_mutex_unlock(&drain_mutex);
+        if (stop) {
+            log_drain();
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Start the drain thread, writing to the file at path or to syslog if NULL
+int log_open(const char *path) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_store(&ring_tail, 0);
+    ring_head = 0;
+    stopping = false;
+    if (path) {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd == -1) {
+            syslog(LOG_ERR, "Failed to open log file %s: %s", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Leave shutdown signals to the server threads
+    sigset_t block_mask, old_mask;
+    sigfillset(&block_mask);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+    int result = pthread_create(&drain_thread, NULL, log_drain_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (result != 0) {
+        syslog(LOG_ERR, "Failed to create log thread: %s", strerror(result));
+        if (log_fd != -1) {
+            close(log_fd);
+            log_fd = -1;
+        }
+        return -1;
+    }
+    atomic_store_explicit(&ring_active, true, memory_order_release);
+    return 0;
+}
+
+// Reopen the log file, e.g. after it was rotated, at path. Replacing the
+// descriptor in place lets the drain thread carry on without a lock.
+// Returns -1 if that would switch between syslog and a file.
+int log_reopen(const char *path) {
+    if ((path == NULL) != (log_fd == -1)) {
+        return -1;
+    }
+    if (!path) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        log_message(LOG_ERR, "Failed to reopen log file %s: %s", path, strerror(errno));
+        return 0;
+    }
+    dup2(fd, log_fd);
+    close(fd);
+    return 0;
+}
+
+// Write out everything queued and stop the drain thread
+void log_close(void) {
+    if (!atomic_load(&ring_active)) {
+        return;
+    }
+    // New messages go straight to syslog; the final drain picks up the rest
+    atomic_store_explicit(&ring_active, false, memory_order_release);
+    pthread_mutex_lock(&drain_mutex);
+    stopping = true;
+    pthread_cond_signal(&drain_cond);
+    pthread_mutex_unlock(&drain_mutex);
+    pthread_join(drain_thread, NULL);
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
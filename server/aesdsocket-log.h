@@ -0,0 +1,46 @@
+/*
+ * aesdsocket-log.h
+ *
+ * Asynchronous logging. log_message() formats into a slot of a lock-free
+ * multi-producer ring and returns; a background thread drains the ring in
+ * batches to syslog or to a log file. Messages above LOG_COMPILE_LEVEL are
+ * compiled out, and messages above the runtime level (-l) cost one relaxed
+ * atomic load. A full ring drops messages instead of stalling the caller.
+ *
+ * Levels are the syslog priorities, LOG_ERR through LOG_DEBUG.
+ */
+
+#ifndef AESDSOCKET_LOG_H
+#define AESDSOCKET_LOG_H
+
+#include <syslog.h>     // For the LOG_ priorities
+#include <stdatomic.h>  // For the runtime level
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG // Build with -DLOG_COMPILE_LEVEL=LOG_INFO to drop debug logging
+#endif
+
+#define LOG_RING_SIZE 4096   // Queued messages, a power of two
+#define LOG_MESSAGE_MAX 240  // Longer messages are truncated
+#define LOG_BATCH_MAX (64 * 1024) // Bytes gathered per write() to a log file
+
+extern _Atomic int log_level;
+
+#define log_enabled(level) \
+    ((level) <= LOG_COMPILE_LEVEL && \
+     (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define log_message(level, ...) \
+    do { \
+        if (log_enabled(level)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+int log_open(const char *path);
+int log_reopen(const char *path);
+void log_close(void);
+int log_parse_level(const char *name);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* AESDSOCKET_LOG_H */
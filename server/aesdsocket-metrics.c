@@ -0,0 +1,423 @@
+/*
+ * aesdsocket-metrics.c
+ *
+ * Counters and latency histograms. Every value is a relaxed atomic updated
+ * by the thread doing the work; a snapshot reads them without stopping
+ * anyone, so it may be skewed by in-flight updates but never stalls the
+ * data path. The only lock is the connection registry mutex, taken when a
+ * connection opens or closes and while listing connections.
+ *
+ * Histograms are log-linear in the style of HdrHistogram: each power of two
+ * is split into 2^HISTOGRAM_SUB_BITS buckets, bounding the relative error
+ * of a reported percentile by 1/2^HISTOGRAM_SUB_BITS.
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <unistd.h>     // For POSIX API functions
+#include <time.h>       // For clock_gettime
+#include <sys/socket.h> // For socket API
+#include <sys/un.h>     // For struct sockaddr_un
+
+#include "aesdsocket.h"
+
+struct histogram {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+static struct {
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t accepted_local;       // ... of them on the Unix socket (-U)
+    _Atomic uint64_t active;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t packets_in;
+    _Atomic uint64_t echoes;
+    _Atomic uint64_t echo_bytes;
+    struct histogram ack_latency;   // Data received until the reply it caused is fully sent
+    _Atomic uint64_t commit_batches;
+    _Atomic uint64_t commit_records;
+    _Atomic uint64_t commit_syncs;
+    struct histogram append_wait;   // Queued until the committer took the batch
+    struct histogram append_commit; // Batch taken until released durable
+    _Atomic uint64_t snapshot_refreshes;
+    _Atomic uint64_t snapshot_bytes;
+    _Atomic uint64_t limit_rejected;       // Connections refused by the per-address limit
+    _Atomic uint64_t limit_bytes_paused;   // Reads paused by the byte rate limit
+    _Atomic uint64_t limit_records_paused; // Reads paused by the record rate limit
+    _Atomic uint64_t rx_same_cpu;          // Bytes read on the CPU the stack received them on
+    _Atomic uint64_t rx_same_node;         // ... on another CPU of the same NUMA node
+    _Atomic uint64_t rx_cross_node;        // ... on a CPU of another node
+    _Atomic uint64_t rx_unplaced;          // ... with no incoming CPU known
+} metrics;
+
+static uint64_t start_ns;
+
+// Connections currently open, for per-connection reports
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(connection_registry, connection) registry = LIST_HEAD_INITIALIZER(registry);
+
+static int stats_socket = -1;
+static pthread_t stats_thread;
+static struct sockaddr_un stats_addr;
+static _Atomic bool stats_stopping;
+
+// Monotonic clock in nanoseconds
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Add to a counter only ever written by one thread, without a locked instruction
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+static inline void global_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static unsigned int histogram_index(uint64_t value) {
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Largest value that lands in bucket index
+static uint64_t histogram_value(unsigned int index) {
+    if (index < (1u << HISTOGRAM_SUB_BITS)) {
+        return index;
+    }
+    unsigned int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = (1u << HISTOGRAM_SUB_BITS) | (index & ((1u << HISTOGRAM_SUB_BITS) - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram *histogram, uint64_t value) {
+    global_add(&histogram->buckets[histogram_index(value)], 1);
+    global_add(&histogram->sum, value);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Print count, mean, percentiles and max of a histogram on one line
+static void histogram_print(FILE *out, const char *name, struct histogram *histogram) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *labels[] = { "p50", "p90", "p99", "p999" };
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    fprintf(out, "%s count=%llu mean=%llu", name, (unsigned long long)total,
+            (unsigned long long)(total ? sum / total : 0));
+    unsigned int bucket = 0;
+    uint64_t seen = 0;
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        uint64_t rank = (uint64_t)(quantiles[q] * total + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        }
+        while (bucket < HISTOGRAM_BUCKETS && seen + counts[bucket] < rank) {
+            seen += counts[bucket++];
+        }
+        uint64_t value = total && bucket < HISTOGRAM_BUCKETS ? histogram_value(bucket) : 0;
+        fprintf(out, " %s=%llu", labels[q], (unsigned long long)(value < max ? value : max));
+    }
+    fprintf(out, " max=%llu\n", (unsigned long long)max);
+}
+
+static uint64_t load(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void connection_print(FILE *out, struct connection *conn) {
+    fprintf(out, "connection %s:%d bytes_in=%llu bytes_out=%llu packets_in=%llu echoes=%llu echo_bytes=%llu rate_limited=%llu incoming_cpu=%d",
+            conn->client_ip, conn->client_port,
+            (unsigned long long)load(&conn->metrics.bytes_in),
+            (unsigned long long)load(&conn->metrics.bytes_out),
+            (unsigned long long)load(&conn->metrics.packets_in),
+            (unsigned long long)load(&conn->metrics.echoes),
+            (unsigned long long)load(&conn->metrics.echo_bytes),
+            (unsigned long long)load(&conn->metrics.rate_limited), conn->incoming_cpu);
+    if (conn->local) {
+        fprintf(out, " peer_pid=%d peer_uid=%u peer_gid=%u", (int)conn->peer_pid,
+                (unsigned int)conn->peer_uid, (unsigned int)conn->peer_gid);
+    }
+    fputc('\n', out);
+}
+
+// Format a snapshot as "name value" lines into a malloc()ed buffer, followed
+// by one line for conn, or for every open connection when conn is NULL.
+// Returns the text length, or -1 if no memory is available.
+ssize_t metrics_format(struct connection *conn, char **text) {
+    size_t len;
+    FILE *out = open_memstream(text, &len);
+    if (!out) {
+        return -1;
+    }
+    uint64_t uptime_ns = metrics_now() - start_ns;
+    uint64_t accepted = load(&metrics.accepted);
+    fprintf(out, "uptime_ms %llu\n", (unsigned long long)(uptime_ns / 1000000));
+    fprintf(out, "connections_active %llu\n", (unsigned long long)load(&metrics.active));
+    fprintf(out, "connections_accepted %llu\n", (unsigned long long)accepted);
+    fprintf(out, "connections_accepted_local %llu\n", (unsigned long long)load(&metrics.accepted_local));
+    fprintf(out, "accept_rate %.2f\n", uptime_ns ? accepted * 1e9 / uptime_ns : 0.0);
+    fprintf(out, "bytes_in %llu\n", (unsigned long long)load(&metrics.bytes_in));
+    fprintf(out, "bytes_out %llu\n", (unsigned long long)load(&metrics.bytes_out));
+    fprintf(out, "packets_in %llu\n", (unsigned long long)load(&metrics.packets_in));
+    fprintf(out, "echoes %llu\n", (unsigned long long)load(&metrics.echoes));
+    fprintf(out, "echo_bytes %llu\n", (unsigned long long)load(&metrics.echo_bytes));
+    histogram_print(out, "ack_latency_ns", &metrics.ack_latency);
+    fprintf(out, "commit_batches %llu\n", (unsigned long long)load(&metrics.commit_batches));
+    fprintf(out, "commit_records %llu\n", (unsigned long long)load(&metrics.commit_records));
+    fprintf(out, "commit_syncs %llu\n", (unsigned long long)load(&metrics.commit_syncs));
+    histogram_print(out, "append_wait_ns", &metrics.append_wait);
+    histogram_print(out, "append_commit_ns", &metrics.append_commit);
+    fprintf(out, "snapshot_refreshes %llu\n", (unsigned long long)load(&metrics.snapshot_refreshes));
+    fprintf(out, "snapshot_bytes %llu\n", (unsigned long long)load(&metrics.snapshot_bytes));
+    fprintf(out, "limit_rejected %llu\n", (unsigned long long)load(&metrics.limit_rejected));
+    fprintf(out, "limit_bytes_paused %llu\n", (unsigned long long)load(&metrics.limit_bytes_paused));
+    fprintf(out, "limit_records_paused %llu\n", (unsigned long long)load(&metrics.limit_records_paused));
+    fprintf(out, "numa_nodes %d\n", cpu_node_count());
+    fprintf(out, "rx_bytes_same_cpu %llu\n", (unsigned long long)load(&metrics.rx_same_cpu));
+    fprintf(out, "rx_bytes_same_node %llu\n", (unsigned long long)load(&metrics.rx_same_node));
+    fprintf(out, "rx_bytes_cross_node %llu\n", (unsigned long long)load(&metrics.rx_cross_node));
+    fprintf(out, "rx_bytes_unplaced %llu\n", (unsigned long long)load(&metrics.rx_unplaced));
+    slab_report(out);
+    if (conn) {
+        connection_print(out, conn);
+    } else {
+        pthread_mutex_lock(&registry_mutex);
+        struct connection *entry;
+        LIST_FOREACH(entry, &registry, metrics_entries) {
+            connection_print(out, entry);
+        }
+        pthread_mutex_unlock(&registry_mutex);
+    }
+    if (fclose(out) != 0) {
+        free(*text);
+        return -1;
+    }
+    return len;
+}
+
+void metrics_connection_opened(struct connection *conn) {
+    memset(&conn->metrics, 0, sizeof(conn->metrics));
+    global_add(&metrics.accepted, 1);
+    if (conn->local) {
+        global_add(&metrics.accepted_local, 1);
+    }
+    global_add(&metrics.active, 1);
+    pthread_mutex_lock(&registry_mutex);
+    LIST_INSERT_HEAD(&registry, conn, metrics_entries);
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void metrics_connection_closed(struct connection *conn) {
+    pthread_mutex_lock(&registry_mutex);
+    LIST_REMOVE(conn, metrics_entries);
+    pthread_mutex_unlock(&registry_mutex);
+    atomic_fetch_sub_explicit(&metrics.active, 1, memory_order_relaxed);
+}
+
+// A connection was refused by the per-address connection limit
+void metrics_limit_rejected(void) {
+    global_add(&metrics.limit_rejected, 1);
+}
+
+// Reading from conn was paused by its byte or record rate limit
+void metrics_rate_limited(struct connection *conn, bool by_records) {
+    counter_add(&conn->metrics.rate_limited, 1);
+    global_add(by_records ? &metrics.limit_records_paused : &metrics.limit_bytes_paused, 1);
+}
+
+uint64_t metrics_connections_active(void) {
+    return load(&metrics.active);
+}
+
+// Shut down the socket of every open connection, so whatever serves it sees
+// the end of input; used when the shutdown drain deadline passes
+void metrics_connections_shutdown(void) {
+    pthread_mutex_lock(&registry_mutex);
+    struct connection *entry;
+    LIST_FOREACH(entry, &registry, metrics_entries) {
+        shutdown(entry->client_socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+// Received bytes are also classified by where the reading thread runs
+// relative to the connection's incoming CPU
+void metrics_received(struct connection *conn, size_t len) {
+    counter_add(&conn->metrics.bytes_in, len);
+    counter_add(&conn->metrics.packets_in, 1);
+    global_add(&metrics.bytes_in, len);
+    global_add(&metrics.packets_in, 1);
+    int cpu = cpu_current();
+    if (conn->incoming_cpu < 0 || cpu < 0) {
+        global_add(&metrics.rx_unplaced, len);
+    } else if (cpu == conn->incoming_cpu) {
+        global_add(&metrics.rx_same_cpu, len);
+    } else if (cpu_node(cpu) == cpu_node(conn->incoming_cpu)) {
+        global_add(&metrics.rx_same_node, len);
+    } else {
+        global_add(&metrics.rx_cross_node, len);
+    }
+}
+
+void metrics_sent(struct connection *conn, size_t len) {
+    counter_add(&conn->metrics.bytes_out, len);
+    global_add(&metrics.bytes_out, len);
+}
+
+void metrics_queued(struct connection *conn, size_t len) {
+    counter_add(&conn->metrics.echoes, 1);
+    counter_add(&conn->metrics.echo_bytes, len);
+    global_add(&metrics.echoes, 1);
+    global_add(&metrics.echo_bytes, len);
+}
+
+// A reply queued at queued_ns has been sent in full
+void metrics_acked(uint64_t queued_ns) {
+    histogram_record(&metrics.ack_latency, metrics_now() - queued_ns);
+}
+
+// One store append was queued at requested_ns, its batch taken by the
+// committer at started_ns, and its caller released at released_ns
+void metrics_append(uint64_t requested_ns, uint64_t started_ns, uint64_t released_ns) {
+    histogram_record(&metrics.append_wait, started_ns - requested_ns);
+    histogram_record(&metrics.append_commit, released_ns - started_ns);
+}
+
+// The committer wrote a batch of records (none for a standalone sync) and
+// synced the data file if synced is set
+void metrics_commit(size_t records, bool synced) {
+    if (records > 0) {
+        counter_add(&metrics.commit_batches, 1);
+        counter_add(&metrics.commit_records, records);
+    }
+    if (synced) {
+        counter_add(&metrics.commit_syncs, 1);
+    }
+}
+
+// The echo snapshot was brought up to a new generation by reading
+// bytes_read bytes of data; called under the snapshot lock
+void metrics_echo_snapshot(size_t bytes_read) {
+    counter_add(&metrics.snapshot_refreshes, 1);
+    counter_add(&metrics.snapshot_bytes, bytes_read);
+}
+
+// Thread function: answer every connection to the stats socket with a snapshot
+static void *stats_thread_func(void *arg) {
+    (void)arg;
+    while (1) {
+        int client = accept(stats_socket, NULL, NULL);
+        if (atomic_load(&stats_stopping)) {
+            if (client >= 0) {
+                close(client);
+            }
+            break;
+        }
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            log_message(LOG_ERR, "Failed to accept stats connection: %s", strerror(errno));
+            break;
+        }
+        char *text;
+        ssize_t len = metrics_format(NULL, &text);
+        for (ssize_t sent = 0, result; len > 0 && sent < len; sent += result) {
+            result = send(client, text + sent, len - sent, MSG_NOSIGNAL);
+            if (result <= 0) {
+                break;
+            }
+        }
+        if (len >= 0) {
+            free(text);
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+// Start the clock, and serve snapshots on a Unix socket at path unless it is
+// NULL. A server that is still using path keeps it, unless it is the
+// predecessor that just handed over (takeover), which gives it up anyway.
+int metrics_start(const char *path, bool takeover) {
+    start_ns = metrics_now();
+    if (!path) {
+        return 0;
+    }
+    stats_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(stats_addr.sun_path)) {
+        log_message(LOG_ERR, "Stats socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(stats_addr.sun_path, path);
+    if (takeover) {
+        unlink(path);
+    } else if (config_socket_reclaim(path) != 0) {
+        return -1;
+    }
+    stats_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stats_socket < 0) {
+        log_message(LOG_ERR, "Failed to create stats socket: %s", strerror(errno));
+        return -1;
+    }
+    if (bind(stats_socket, (struct sockaddr *)&stats_addr, sizeof(stats_addr)) != 0 || listen(stats_socket, BACKLOG) != 0) {
+        log_message(LOG_ERR, "Failed to listen on stats socket %s: %s", path, strerror(errno));
+        close(stats_socket);
+        stats_socket = -1;
+        return -1;
+    }
+
+    // Leave shutdown signals to the server threads
+    sigset_t block_mask, old_mask;
+    sigfillset(&block_mask);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+    int result = pthread_create(&stats_thread, NULL, stats_thread_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (result != 0) {
+        log_message(LOG_ERR, "Failed to create stats thread: %s", strerror(result));
+        close(stats_socket);
+        stats_socket = -1;
+        unlink(path);
+        return -1;
+    }
+    log_message(LOG_INFO, "Serving stats on %s", path);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (stats_socket == -1) {
+        return;
+    }
+    // Wake the thread blocked in accept() with a connection of our own
+    atomic_store(&stats_stopping, true);
+    int wake = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (wake >= 0) {
+        connect(wake, (struct sockaddr *)&stats_addr, sizeof(stats_addr));
+        close(wake);
+    }
+    pthread_join(stats_thread, NULL);
+    close(stats_socket);
+    stats_socket = -1;
+    unlink(stats_addr.sun_path);
+}
@@ -0,0 +1,341 @@
+/*
+ * aesdsocket-pool.c
+ *
+ * Worker pool server mode: a fixed set of pre-spawned workers serve
+ * connections handed over by the accept loop through bounded per-worker
+ * queues. A worker holds a connection until the client closes it, so at
+ * most -t clients are served at once and the rest wait in the queue; the
+ * default worker count is sized from the queue capacity for that reason
+ * (see server_thread_count()). Idle workers steal queued connections from
+ * busy ones, and a configurable overload policy decides what happens when
+ * the queue is full.
+ * With pinned workers (-C) a connection is queued on a worker running on its
+ * incoming CPU when there is one.
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <unistd.h>     // For POSIX API functions
+#include <stdint.h>     // For uint64_t
+#include <syslog.h>     // For system logging
+#include <sys/socket.h> // For socket API
+#include <sys/eventfd.h> // For eventfd
+
+#include "aesdsocket.h"
+
+// A queued connection and its position in accept order
+struct pool_slot {
+    struct connection *conn;
+    uint64_t seq;
+};
+
+// Per-worker FIFO ring of connections waiting to be served
+struct pool_worker {
+    pthread_t thread_id;
+    int index;
+    int cpu;                       // CPU the worker is pinned to, -1 if not pinned
+    struct worker_pool *pool;
+    pthread_mutex_t lock;          // Protects the ring, taken by owner, stealers and acceptor
+    struct pool_slot *ring;
+    size_t head;
+    size_t count;
+};
+
+struct worker_pool {
+    struct pool_worker *workers;
+    int num_workers;
+    size_t capacity;               // Limit on connections queued across all workers
+    enum overload_policy overload;
+    pthread_mutex_t lock;          // Protects the fields below; taken before any worker lock
+    pthread_cond_t work_cond;      // Signalled when a connection is queued
+    int space_fd;                  // eventfd, written when a full queue gets a free slot
+    size_t queued;
+    uint64_t next_seq;
+    int next_worker;
+    bool stopping;
+    unsigned long rejected;
+    unsigned long shed;
+};
+
+// Remove the oldest connection from a worker ring; caller holds worker->lock
+static struct connection *pool_ring_pop(struct pool_worker *worker) {
+    if (worker->count == 0) {
+        return NULL;
+    }
+    struct connection *conn = worker->ring[worker->head].conn;
+    worker->head = (worker->head + 1) % worker->pool->capacity;
+    worker->count--;
+    return conn;
+}
+
+// Take a connection from our own ring, or steal the oldest one from another worker
+static struct connection *pool_take(struct pool_worker *self) {
+    struct worker_pool *pool = self->pool;
+    struct connection *conn = NULL;
+
+    for (int i = 0; i < pool->num_workers && !conn; i++) {
+        struct pool_worker *victim = &pool->workers[(self->index + i) % pool->num_workers];
+        pthread_mutex_lock(&victim->lock);
+        conn = pool_ring_pop(victim);
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (conn) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->queued-- == pool->capacity) {
+            uint64_t one = 1;
+            if (write(pool->space_fd, &one, sizeof(one)) == -1) {
+                // Already readable when the counter is saturated
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return conn;
+}
+
+static bool pool_full(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    bool full = pool->queued >= pool->capacity;
+    pthread_mutex_unlock(&pool->lock);
+    return full;
+}
+
+// Queue policy: while every slot is taken, accept nothing and leave new
+// clients in the listen backlog, still appending timestamps. Returns false
+// once shutdown is requested.
+static bool pool_wait_space(struct worker_pool *pool, int timer_fd) {
+    while (pool_full(pool)) {
+        if (!server_wait_readable(pool->space_fd, timer_fd)) {
+            return false;
+        }
+        uint64_t count;
+        if (read(pool->space_fd, &count, sizeof(count)) == -1) {
+            // Raced with another wakeup; the queue is checked again
+        }
+    }
+    return true;
+}
+
+// Close the oldest queued connection across all workers; caller holds pool->lock
+static void pool_shed_oldest(struct worker_pool *pool) {
+    struct pool_worker *oldest = NULL;
+    uint64_t oldest_seq = UINT64_MAX;
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        struct pool_worker *worker = &pool->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        if (worker->count > 0 && worker->ring[worker->head].seq < oldest_seq) {
+            oldest_seq = worker->ring[worker->head].seq;
+            oldest = worker;
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    if (!oldest) {
+        return;
+    }
+    pthread_mutex_lock(&oldest->lock);
+    struct connection *conn = pool_ring_pop(oldest);
+    pthread_mutex_unlock(&oldest->lock);
+    if (conn) {
+        pool->queued--;
+        pool->shed++;
+        log_message(LOG_WARNING, "Worker queue full, shedding oldest connection from %s", conn->client_ip);
+        connection_close(conn);
+        slab_free(&connection_cache, conn);
+    }
+}
+
+// Hand an accepted connection to a worker, applying the overload policy;
+// under the queue policy the accept loop has already waited for a free
+// slot. Returns false if the connection was rejected and closed.
+static bool pool_submit(struct worker_pool *pool, struct connection *conn) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued >= pool->capacity && !pool->stopping) {
+        if (pool->overload == OVERLOAD_SHED) {
+            pool_shed_oldest(pool);
+            continue;
+        }
+        pool->rejected++;
+        pthread_mutex_unlock(&pool->lock);
+        log_message(LOG_WARNING, "Worker queue full, rejecting connection from %s", conn->client_ip);
+        connection_close(conn);
+        slab_free(&connection_cache, conn);
+        return false;
+    }
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        connection_close(conn);
+        slab_free(&connection_cache, conn);
+        return false;
+    }
+
+    // Round-robin placement, preferring the next worker on the connection's
+    // incoming CPU; queued is raised under pool->lock together with the push
+    // so a worker that sees queued > 0 will find the connection
+    int chosen = pool->next_worker;
+    for (int i = 0; conn->incoming_cpu >= 0 && i < pool->num_workers; i++) {
+        int candidate = (pool->next_worker + i) % pool->num_workers;
+        if (pool->workers[candidate].cpu == conn->incoming_cpu) {
+            chosen = candidate;
+            break;
+        }
+    }
+    struct pool_worker *worker = &pool->workers[chosen];
+    pool->next_worker = (chosen + 1) % pool->num_workers;
+    pthread_mutex_lock(&worker->lock);
+    size_t tail = (worker->head + worker->count) % pool->capacity;
+    worker->ring[tail].conn = conn;
+    worker->ring[tail].seq = pool->next_seq++;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+// Thread function: serve queued connections until the pool stops
+static void *pool_worker_func(void *arg) {
+    struct pool_worker *self = arg;
+    struct worker_pool *pool = self->pool;
+
+    while (1) {
+        struct connection *conn = pool_take(self);
+        if (conn) {
+            connection_serve(conn);
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        bool stop = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Run the worker pool server until accept() is interrupted by a shutdown
+// signal; the accept loop also appends the timestamps
+int pool_server_run(int server_socket, const struct server_options *options) {
+    struct worker_pool pool = {
+        .num_workers = server_thread_count(options),
+        .capacity = options->queue_capacity,
+        .overload = options->overload,
+    };
+    pool.space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool.space_fd == -1) {
+        log_message(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+    pool.workers = calloc(pool.num_workers, sizeof(*pool.workers));
+    if (!pool.workers) {
+        log_message(LOG_ERR, "Memory allocation failed");
+        close(pool.space_fd);
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_cond, NULL);
+
+    // Keep shutdown signals on the accept loop so accept() returns EINTR
+    sigset_t block_mask, old_mask;
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+
+    // Set up every queue before any worker can try to steal from it
+    int initialized = 0;
+    for (; initialized < pool.num_workers; initialized++) {
+        struct pool_worker *worker = &pool.workers[initialized];
+        worker->index = initialized;
+        worker->cpu = cpu_workers_pinned() ? cpu_worker(initialized) : -1;
+        worker->pool = &pool;
+        worker->ring = calloc(pool.capacity, sizeof(*worker->ring));
+        if (!worker->ring) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            break;
+        }
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    int started = 0;
+    if (initialized == pool.num_workers) {
+        for (; started < pool.num_workers; started++) {
+            struct pool_worker *worker = &pool.workers[started];
+            if (pthread_create(&worker->thread_id, NULL, pool_worker_func, worker) != 0) {
+                log_message(LOG_ERR, "Failed to create pool worker thread");
+                break;
+            }
+            cpu_place_worker(worker->thread_id, started);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    log_message(LOG_INFO, "Started %d pool worker(s), queue capacity %zu", started, pool.capacity);
+
+    while (started == pool.num_workers && running_signal) {
+        if (pool.overload == OVERLOAD_QUEUE && !pool_wait_space(&pool, options->timestamp_fd)) {
+            break;
+        }
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = server_accept(server_socket, options->local_socket, options->timestamp_fd,
+                                          (struct sockaddr *)&client_addr, &client_addr_len);
+        if (client_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            continue;
+        }
+        struct connection *conn = slab_alloc(&connection_cache);
+        if (!conn) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            close(client_socket);
+            continue;
+        }
+        if (connection_open(conn, client_socket, (struct sockaddr *)&client_addr) != 0) {
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
+            continue;
+        }
+        pool_submit(&pool, conn);
+    }
+
+    // Workers finish what they are serving and what is queued, up to the
+    // drain deadline
+    if (started == pool.num_workers) {
+        server_drain(options);
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool.workers[i].thread_id, NULL);
+    }
+    for (int i = 0; i < initialized; i++) {
+        struct pool_worker *worker = &pool.workers[i];
+        // Connections still waiting in the queue are never served
+        struct connection *conn;
+        while ((conn = pool_ring_pop(worker)) != NULL) {
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
+        }
+        free(worker->ring);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    log_message(LOG_INFO, "Worker pool stopped: %lu rejected, %lu shed", pool.rejected, pool.shed);
+    free(pool.workers);
+    pthread_cond_destroy(&pool.work_cond);
+    pthread_mutex_destroy(&pool.lock);
+    close(pool.space_fd);
+    return started == pool.num_workers ? 0 : -1;
+}
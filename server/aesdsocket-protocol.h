@@ -0,0 +1,47 @@
+/*
+ * aesdsocket-protocol.h
+ *
+ * Length-prefixed binary protocol spoken on the aesdsocket port as an
+ * alternative to the newline text protocol. A client selects it by sending
+ * AESD_BINARY_MAGIC as the very first bytes of the connection; the server
+ * answers with the same magic and from then on both sides exchange frames.
+ *
+ * Every frame starts with struct aesd_frame_header followed by length bytes
+ * of payload. All integers are in network byte order. Requests may be
+ * pipelined; responses come back in request order, one per request, with
+ * the request opcode and a status of 0 or an errno value. Data responses
+ * are limited to UINT32_MAX bytes; use AESD_OP_READ_RANGE for more.
+ */
+
+#ifndef AESDSOCKET_PROTOCOL_H
+#define AESDSOCKET_PROTOCOL_H
+
+#include <stdint.h>
+
+#define AESD_BINARY_MAGIC "\0AB\1"
+#define AESD_BINARY_MAGIC_LEN 4
+#define AESD_FRAME_MAX (16 * 1024 * 1024) // Largest request payload accepted
+
+enum aesd_opcode {
+    AESD_OP_APPEND = 1,     // Payload: data. Response: uint64 data length after the append
+    AESD_OP_ECHO = 2,       // No payload. Response: the whole data file
+    AESD_OP_SEEKTO = 3,     // Payload: uint32 write_cmd, uint32 write_cmd_offset.
+                            // Response: data from that position to the end
+    AESD_OP_READ_RANGE = 4, // Payload: uint64 offset, uint64 length. Response: that data
+    AESD_OP_STAT = 5,       // No payload. Response: struct aesd_stat_payload
+    AESD_OP_METRICS = 6,    // No payload. Response: server metrics as text, as for AESDCHAR_STATS
+};
+
+struct aesd_frame_header {
+    uint8_t opcode;
+    uint8_t status;         // Responses only, 0 on success
+    uint16_t reserved;
+    uint32_t length;        // Payload bytes following the header
+} __attribute__((packed));
+
+struct aesd_stat_payload {
+    uint64_t data_length;   // Bytes in the data store
+    uint64_t commands;      // Complete newline-terminated commands stored
+} __attribute__((packed));
+
+#endif /* AESDSOCKET_PROTOCOL_H */
@@ -0,0 +1,211 @@
+/*
+ * aesdsocket-slab.c
+ *
+ * Object caches for the blocks allocated per connection and per record:
+ * connection state, receive segments and I/O buffers. Each thread keeps a
+ * magazine of free blocks per cache and allocates and frees from it without
+ * locking; a full magazine spills half its blocks to the cache's shared
+ * depot, and an empty one refills from there, so blocks freed by one thread
+ * (a finished client thread, a pool worker) are reused by another (the
+ * accepting thread). Only an empty depot or one past its limit touches the
+ * heap, and heap_allocs/heap_frees count exactly those calls: once the
+ * caches are warm they stay flat however many connections come and go.
+ *
+ * The depot is split per NUMA node: blocks go back to the depot of the node
+ * the freeing thread runs on and are handed out there first, so threads
+ * pinned to a node keep reusing memory they first touched locally. Another
+ * node's blocks are taken only before falling back to the heap, and
+ * remote_refills counts them.
+ */
+
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <unistd.h>     // For sysconf
+
+#include "aesdsocket.h"
+
+#define SLAB_CACHES_MAX 16   // Caches a process may register
+#define SLAB_MAGAZINE_SIZE 32 // Free blocks a thread keeps per cache before spilling half
+
+// A thread's free blocks of one cache, linked through their first word
+struct slab_magazine {
+    void *blocks;
+    size_t count;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_cache *registry[SLAB_CACHES_MAX]; // Protected by registry_mutex
+static _Atomic int registry_count;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t magazine_key;     // Set in threads holding magazines, to flush them at exit
+
+static __thread struct slab_magazine magazines[SLAB_CACHES_MAX];
+static __thread bool magazines_used;
+
+// Page-aligned rx_segment_size buffers for receiving and framing input; the
+// size is set by config_load() before the first one is allocated
+struct slab_cache io_buffer_cache = SLAB_CACHE("io_buffer", RX_SEGMENT_SIZE, 0, SLAB_CACHED_MAX);
+
+static void slab_flush(struct slab_cache *cache, struct slab_magazine *magazine, size_t count);
+
+// Thread exit: hand every block the thread still holds to the depots
+static void slab_thread_exit(void *arg) {
+    (void)arg;
+    int count = atomic_load(&registry_count);
+    for (int i = 0; i < count; i++) {
+        slab_flush(registry[i], &magazines[i], magazines[i].count);
+    }
+}
+
+static void slab_key_create(void) {
+    pthread_key_create(&magazine_key, slab_thread_exit);
+}
+
+// Give cache its magazine slot and final block size on first use
+static void slab_register(struct slab_cache *cache) {
+    pthread_mutex_lock(&registry_mutex);
+    if (!atomic_load(&cache->registered)) {
+        int count = atomic_load(&registry_count);
+        cache->index = -1;
+        if (count < SLAB_CACHES_MAX) {
+            cache->index = count;
+            registry[count] = cache;
+            atomic_store(&registry_count, count + 1);
+        } else {
+            log_message(LOG_WARNING, "Too many object caches, %s blocks come from the heap", cache->name);
+        }
+        if (cache->align == 0) {
+            cache->align = sysconf(_SC_PAGESIZE);
+        }
+        if (cache->size < sizeof(void *)) {
+            cache->size = sizeof(void *);
+        }
+        cache->size = (cache->size + cache->align - 1) / cache->align * cache->align;
+        atomic_store(&cache->registered, true);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+static struct slab_magazine *slab_magazine(struct slab_cache *cache) {
+    if (!atomic_load_explicit(&cache->registered, memory_order_acquire)) {
+        slab_register(cache);
+    }
+    if (cache->index < 0) {
+        return NULL;
+    }
+    if (!magazines_used) {
+        pthread_once(&magazine_key_once, slab_key_create);
+        pthread_setspecific(magazine_key, magazines);
+        magazines_used = true;
+    }
+    return &magazines[cache->index];
+}
+
+// Move count blocks from magazine to the local node's depot, freeing those
+// past its limit
+static void slab_flush(struct slab_cache *cache, struct slab_magazine *magazine, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    struct slab_depot *depot = &cache->depots[cpu_current_node() % SLAB_NODES_MAX];
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; i++) {
+        void *block = magazine->blocks;
+        magazine->blocks = *(void **)block;
+        magazine->count--;
+        if (depot->count < cache->max_cached) {
+            *(void **)block = depot->blocks;
+            depot->blocks = block;
+            depot->count++;
+        } else {
+            free(block);
+            atomic_fetch_add_explicit(&cache->heap_frees, 1, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Take up to half a magazine of blocks from the local node's depot, then
+// from the other nodes'
+static void slab_refill(struct slab_cache *cache, struct slab_magazine *magazine) {
+    int local = cpu_current_node() % SLAB_NODES_MAX;
+    int nodes = cpu_node_count() < SLAB_NODES_MAX ? cpu_node_count() : SLAB_NODES_MAX;
+    size_t remote = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < nodes && magazine->count < SLAB_MAGAZINE_SIZE / 2; i++) {
+        struct slab_depot *depot = &cache->depots[(local + i) % nodes];
+        while (depot->blocks && magazine->count < SLAB_MAGAZINE_SIZE / 2) {
+            void *block = depot->blocks;
+            depot->blocks = *(void **)block;
+            depot->count--;
+            *(void **)block = magazine->blocks;
+            magazine->blocks = block;
+            magazine->count++;
+            remote += i > 0;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (remote > 0) {
+        atomic_fetch_add_explicit(&cache->remote_refills, remote, memory_order_relaxed);
+    }
+}
+
+// A block of cache->size bytes with the cache's alignment, uninitialized.
+// Returns NULL if no memory is available.
+void *slab_alloc(struct slab_cache *cache) {
+    struct slab_magazine *magazine = slab_magazine(cache);
+    if (magazine && magazine->count == 0) {
+        slab_refill(cache, magazine);
+    }
+    if (magazine && magazine->count > 0) {
+        void *block = magazine->blocks;
+        magazine->blocks = *(void **)block;
+        magazine->count--;
+        return block;
+    }
+    void *block = aligned_alloc(cache->align, cache->size);
+    if (block) {
+        atomic_fetch_add_explicit(&cache->heap_allocs, 1, memory_order_relaxed);
+    }
+    return block;
+}
+
+// Return a block from slab_alloc() to its cache; NULL is ignored
+void slab_free(struct slab_cache *cache, void *block) {
+    if (!block) {
+        return;
+    }
+    struct slab_magazine *magazine = slab_magazine(cache);
+    if (!magazine) {
+        free(block);
+        atomic_fetch_add_explicit(&cache->heap_frees, 1, memory_order_relaxed);
+        return;
+    }
+    *(void **)block = magazine->blocks;
+    magazine->blocks = block;
+    magazine->count++;
+    if (magazine->count > SLAB_MAGAZINE_SIZE) {
+        slab_flush(cache, magazine, SLAB_MAGAZINE_SIZE / 2);
+    }
+}
+
+// One line per cache for the stats snapshot
+void slab_report(FILE *out) {
+    int count = atomic_load(&registry_count);
+    for (int i = 0; i < count; i++) {
+        struct slab_cache *cache = registry[i];
+        size_t depot = 0;
+        pthread_mutex_lock(&cache->lock);
+        for (int node = 0; node < SLAB_NODES_MAX; node++) {
+            depot += cache->depots[node].count;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        uint64_t heap_allocs = atomic_load_explicit(&cache->heap_allocs, memory_order_relaxed);
+        uint64_t heap_frees = atomic_load_explicit(&cache->heap_frees, memory_order_relaxed);
+        uint64_t remote = atomic_load_explicit(&cache->remote_refills, memory_order_relaxed);
+        fprintf(out, "slab_%s size=%zu heap_allocs=%llu heap_frees=%llu depot=%zu remote_refills=%llu\n",
+                cache->name, cache->size, (unsigned long long)heap_allocs, (unsigned long long)heap_frees,
+                depot, (unsigned long long)remote);
+    }
+}
@@ -0,0 +1,1651 @@
+/*
+ * aesdsocket-store.c
+ *
+ * Data store shared by all connections. Appends are group committed:
+ * callers queue their records and wait, and a single committer thread takes
+ * everything queued since its last pass, writes it with one writev() (or
+ * pwritev2() with RWF_DSYNC), syncs according to the fsync policy (-f), and
+ * then publishes the new data length and releases the callers. Event loops
+ * do not wait: their requests are released onto a completion queue and the
+ * loop is woken through an eventfd, so clients sharing a loop are batched
+ * together. In file mode readers never take a lock on the data path, they
+ * load the published length and read [start, length), which stays valid
+ * because the data is append-only.
+ *
+ * The char device is not: it keeps the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * commands, so every append may drop the oldest one and move all the data
+ * after it. There the committer holds device_lock for writing from its write
+ * until the new length is published, and the device is only read under the
+ * read lock, into a snapshot of its whole contents that echoes are sent from
+ * once the lock is released.
+ *
+ * In file mode the data lives in segment files. By default there is one,
+ * the data file itself, growing without bound. With a segment size (-g) the
+ * data is split into files of that size named after the offset of their
+ * first byte and listed in its manifest, and retention by size (-k) or age
+ * (-a) deletes whole old segments instead of rewriting anything. Offsets
+ * are positions in the stream of everything ever appended: retention and
+ * the last-N-writes cap (-n, the driver's AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * behaviour) only move the store start forward. Readers pin the segment
+ * they read from, so a deleted segment's descriptor stays valid until the
+ * last reader is done with it.
+ *
+ * In file mode the store also keeps an index of command boundaries (the
+ * offset just past each newline) so AESDCHAR_IOCSEEKTO can be answered
+ * without scanning. With a single data file the index can be persisted next
+ * to it; it is validated against the data on startup and rebuilt from the
+ * data file where it is missing, stale or torn. Its header records where
+ * the retained commands start, and once the commands retention (-n) dropped
+ * outnumber the retained ones the file is rewritten without them, so it
+ * stays proportional to the data served. Segmented stores rebuild it from
+ * the retained segments.
+ *
+ * With -M every segment is also mapped read-only in extents of
+ * STORE_MAP_EXTENT bytes, each preallocated with fallocate() before the
+ * committer writes into it, and echoes send() straight out of the mapping.
+ * Mappings never move once made, so a reader holding a pinned segment can
+ * use its pointer without further locking.
+ *
+ * Otherwise echoes are served from a shared snapshot of the data (-e): the
+ * first echo after an append brings it up to date, reading only the new
+ * bytes, and every echo of that generation sends from the same
+ * reference-counted buffer instead of reading the file. Char device echoes
+ * always go through snapshots, whatever -e says: one is taken right after
+ * each batch with an echo in it and shared by everything queued until the
+ * next append.
+ */
+
+#define _GNU_SOURCE     // For pwritev2, fallocate
+#include <stdio.h>      // For standard I/O functions
+#include <stdlib.h>     // For standard library functions
+#include <string.h>     // For string manipulation functions
+#include <errno.h>      // For error number definitions
+#include <unistd.h>     // For POSIX API functions
+#include <fcntl.h>      // For file control options
+#include <limits.h>     // For PATH_MAX
+#include <syslog.h>     // For system logging
+#include <stdint.h>     // For uint64_t
+#include <stdatomic.h>  // For the published length
+#include <sys/stat.h>   // For fstat
+#include <sys/file.h>   // For flock
+#include <sys/ioctl.h>  // For ioctl
+#include <sys/mman.h>   // For mmap
+#include <sys/uio.h>    // For writev, pwritev2
+#include <time.h>       // For clock_gettime
+#include "../aesd-char-driver/aesd-circular-buffer.h" // For AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+#include "aesdsocket.h"
+
+#define INDEX_SCAN_SIZE (64 * 1024) // Read size when rebuilding the index
+#define STORE_WRITEV_MAX 1024       // Most iovecs one writev() accepts (UIO_MAXIOV)
+#define MANIFEST_MAGIC "aesdsocket-manifest 1"
+#define INDEX_MAGIC "aesdidx1"      // Leads the persisted command index header
+#define INDEX_COMPACT_MIN 4096      // Dropped commands before the persisted index is rewritten
+#define STORE_MAP_EXTENT (64 * 1024 * 1024) // Mapping and preallocation unit with -M
+#define SNAPSHOT_MIN_CAPACITY (64 * 1024)   // Smallest echo snapshot allocation
+
+static const char *data_path = DATA_FILE; // Device, or the data file and prefix of its segments
+#if !USE_AESD_CHAR_DEVICE
+static char manifest_path[PATH_MAX];
+static int lock_fd = -1;               // Locked data_path.lock, held while the store is open
+#endif
+static int append_fd = -1;             // Device, or the active segment; written by the committer only
+static _Atomic off_t published_length; // Data length covering every completed append
+
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;  // Committer: requests queued, or stopping
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER; // Appenders: requests released
+static struct store_append *commit_queue;                    // Protected by commit_mutex
+static struct store_append **commit_queue_tail = &commit_queue;
+static bool committer_stopping;                                // Protected by commit_mutex
+static bool committer_running;
+static pthread_t committer_thread;
+static enum fsync_policy fsync_policy = FSYNC_NONE;
+static int fsync_interval_ms;
+static bool dsync_writes = true;       // pwritev2(RWF_DSYNC) works, else writev() + fdatasync()
+static _Atomic uint64_t store_generation; // Bumped each time appends are published
+#if USE_AESD_CHAR_DEVICE
+static pthread_rwlock_t device_lock = PTHREAD_RWLOCK_INITIALIZER; // Written by the committer, see above
+#endif
+
+// Copy of the served data [base, end) as of a generation, shared by every
+// echo sent from it. Bytes below end never change; only the latest
+// snapshot may be extended past end, under snapshot_mutex.
+struct echo_snapshot {
+    _Atomic int refs;                  // The cache's reference plus pinned extents
+    uint64_t generation;
+    off_t base;
+    off_t end;
+    size_t capacity;
+    char data[];
+};
+
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct echo_snapshot *snapshot; // Latest snapshot, protected by snapshot_mutex
+static size_t snapshot_limit;          // -e: largest data to snapshot, 0 = never; file mode only
+#if USE_AESD_CHAR_DEVICE
+static int snapshot_fd = -1;           // Device descriptor the snapshots are read through
+#endif
+
+static void snapshot_put(struct echo_snapshot *cached) {
+    if (atomic_fetch_sub_explicit(&cached->refs, 1, memory_order_acq_rel) == 1) {
+        free(cached);
+    }
+}
+
+static void *store_commit_func(void *arg);
+#if USE_AESD_CHAR_DEVICE
+static void snapshot_batch(struct store_append *batch, off_t length);
+#endif
+
+#if !USE_AESD_CHAR_DEVICE
+// One data file holding the stream bytes [base, base of the next segment)
+struct store_segment {
+    off_t base;
+    int fd;
+    time_t sealed;                     // When writing moved on to the next segment, 0 while active
+    _Atomic int refs;                  // The segment table's reference plus pinned extents
+    char **maps;                       // With -M: extent i maps file bytes [i * map_extent, (i + 1) * map_extent)
+    size_t map_count;                  // Grown by the committer, updated under segments_lock
+};
+
+// Segments in stream order, the last one active. Changed by the committer
+// (and store_open()) under segments_lock; readers look up and pin a segment
+// under the read lock.
+static pthread_rwlock_t segments_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct store_segment **segments;
+static size_t segment_count;
+static size_t segment_capacity;
+static off_t segment_size;             // 0: the data file is the only segment
+static off_t retain_bytes;             // Delete old segments beyond this many bytes, 0 = no limit
+static time_t retain_age;              // Delete segments sealed this many seconds ago, 0 = no limit
+static uint32_t retain_commands;       // Serve only the last N commands, 0 = all
+static _Atomic off_t published_start;  // First byte still served
+static _Atomic bool map_segments;      // -M, cleared by the committer if mapping fails
+static size_t map_extent;              // Bytes per mapping, a multiple of the page size
+
+// Command index: retained command i spans [command_ends[i - 1], command_ends[i]),
+// the first one starting at commands_start. Appended by the committer under
+// index_lock; commands before the store start are dropped from the front.
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t *command_ends;
+static size_t command_count;
+static size_t command_capacity;
+static uint64_t commands_start;
+static int index_fd = -1; // Persisted copy of command_ends, -1 when not persisting
+static size_t index_stale; // Commands still in the persisted copy but dropped from command_ends
+
+// Persisted index layout: this header, then the command ends from start on
+struct index_header {
+    char magic[8];
+    uint64_t start;
+};
+
+static void segment_path(off_t base, char *path, size_t size) {
+    if (segment_size == 0) {
+        snprintf(path, size, "%s", data_path);
+    } else {
+        snprintf(path, size, "%s.%020lld", data_path, (long long)base);
+    }
+}
+
+static struct store_segment *segment_open(off_t base, int flags) {
+    char path[PATH_MAX];
+    segment_path(base, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC | flags, 0644);
+    if (fd == -1) {
+        log_message(LOG_ERR, "Failed to open data file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    struct store_segment *segment = calloc(1, sizeof(*segment));
+    if (!segment) {
+        log_message(LOG_ERR, "Memory allocation failed for segment");
+        close(fd);
+        return NULL;
+    }
+    segment->base = base;
+    segment->fd = fd;
+    atomic_init(&segment->refs, 1);
+    return segment;
+}
+
+// Drop a reference; the descriptor is closed with the last one
+static void segment_put(struct store_segment *segment) {
+    if (atomic_fetch_sub_explicit(&segment->refs, 1, memory_order_acq_rel) == 1) {
+        for (size_t i = 0; i < segment->map_count; i++) {
+            munmap(segment->maps[i], map_extent);
+        }
+        free(segment->maps);
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+// Preallocate and map the extents of segment up to file offset end, so the
+// data written there can be read through the mapping once published.
+// Committer or startup only. Mapping is switched off if it fails.
+static void segment_reserve(struct store_segment *segment, off_t end) {
+    size_t needed = (end + map_extent - 1) / map_extent;
+    if (!atomic_load_explicit(&map_segments, memory_order_relaxed) || needed <= segment->map_count) {
+        return;
+    }
+    // Only the committer grows the table, so the new extents are allocated
+    // and mapped without the lock; readers wait only for the table update
+    size_t first = segment->map_count;
+    char **added = malloc((needed - first) * sizeof(*added));
+    size_t mapped = 0;
+    while (added && first + mapped < needed) {
+        off_t offset = (off_t)(first + mapped) * map_extent;
+        // Blocks are allocated now rather than on each append; the file size
+        // still tracks the data
+        if (fallocate(segment->fd, FALLOC_FL_KEEP_SIZE, offset, map_extent) != 0 &&
+            errno != EOPNOTSUPP) {
+            log_message(LOG_WARNING, "Failed to preallocate data file: %s", strerror(errno));
+        }
+        void *map = mmap(NULL, map_extent, PROT_READ, MAP_SHARED, segment->fd, offset);
+        if (map == MAP_FAILED) {
+            break;
+        }
+        added[mapped++] = map;
+    }
+    int error = errno;
+    if (mapped > 0) {
+        pthread_rwlock_wrlock(&segments_lock);
+        char **maps = realloc(segment->maps, (first + mapped) * sizeof(*maps));
+        if (maps) {
+            memcpy(maps + first, added, mapped * sizeof(*maps));
+            segment->maps = maps;
+            segment->map_count = first + mapped;
+        }
+        pthread_rwlock_unlock(&segments_lock);
+        if (!maps) {
+            error = ENOMEM;
+            for (size_t i = 0; i < mapped; i++) {
+                munmap(added[i], map_extent);
+            }
+        }
+    }
+    free(added);
+    if (segment->map_count < needed) {
+        log_message(LOG_ERR, "Failed to map data file, reading it with system calls: %s", strerror(error));
+        atomic_store_explicit(&map_segments, false, memory_order_relaxed);
+    }
+}
+
+// Make segment the active one at the end of the table
+static int segment_push(struct store_segment *segment) {
+    pthread_rwlock_wrlock(&segments_lock);
+    if (segment_count == segment_capacity) {
+        size_t capacity = segment_capacity ? segment_capacity * 2 : 16;
+        struct store_segment **grown = realloc(segments, capacity * sizeof(*grown));
+        if (!grown) {
+            pthread_rwlock_unlock(&segments_lock);
+            log_message(LOG_ERR, "Memory allocation failed for segment table");
+            return -1;
+        }
+        segments = grown;
+        segment_capacity = capacity;
+    }
+    segments[segment_count++] = segment;
+    pthread_rwlock_unlock(&segments_lock);
+    append_fd = segment->fd;
+    return 0;
+}
+
+// Index of the segment holding offset; caller holds segments_lock
+static size_t segment_find(off_t offset) {
+    size_t low = 0, high = segment_count;
+    while (high - low > 1) {
+        size_t mid = (low + high) / 2;
+        if (segments[mid]->base <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Replace the manifest with the current segment list; committer or startup only
+static int manifest_write(off_t start) {
+    if (segment_size == 0) {
+        return 0;
+    }
+    char temp_path[PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", manifest_path);
+    FILE *out = fopen(temp_path, "w");
+    if (!out) {
+        log_message(LOG_ERR, "Failed to write manifest: %s", strerror(errno));
+        return -1;
+    }
+    fprintf(out, "%s\nstart %lld\n", MANIFEST_MAGIC, (long long)start);
+    for (size_t i = 0; i < segment_count; i++) {
+        fprintf(out, "segment %lld\n", (long long)segments[i]->base);
+    }
+    bool failed = fflush(out) != 0 || fsync(fileno(out)) != 0;
+    failed |= fclose(out) != 0;
+    if (failed || rename(temp_path, manifest_path) != 0) {
+        log_message(LOG_ERR, "Failed to write manifest: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Open the segments listed in the manifest, keeping those that continue
+// the stream without a gap. A store without a manifest starts one; a single
+// data file written before segmenting becomes its first segment.
+static int segments_load(off_t *start) {
+    *start = 0;
+    FILE *in = fopen(manifest_path, "r");
+    if (!in) {
+        if (errno != ENOENT) {
+            log_message(LOG_ERR, "Failed to open manifest: %s", strerror(errno));
+            return -1;
+        }
+        char path[PATH_MAX];
+        segment_path(0, path, sizeof(path));
+        if (rename(data_path, path) == 0) {
+            log_message(LOG_INFO, "Moved %s into segment %s", data_path, path);
+        }
+        struct store_segment *segment = segment_open(0, O_CREAT);
+        if (!segment || segment_push(segment) != 0) {
+            return -1;
+        }
+        return manifest_write(0);
+    }
+
+    char line[128];
+    long long value;
+    if (!fgets(line, sizeof(line), in) || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+        log_message(LOG_ERR, "%s is not a manifest", manifest_path);
+        fclose(in);
+        return -1;
+    }
+    off_t expected = -1;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "start %lld", &value) == 1) {
+            *start = value;
+        } else if (sscanf(line, "segment %lld", &value) == 1) {
+            if (expected >= 0 && value != expected) {
+                log_message(LOG_WARNING, "Segment %lld does not continue the stream at %lld, dropping the rest",
+                            value, (long long)expected);
+                break;
+            }
+            struct store_segment *segment = segment_open(value, 0);
+            struct stat st;
+            if (!segment || fstat(segment->fd, &st) != 0) {
+                break;
+            }
+            if (segment_count > 0) {
+                segments[segment_count - 1]->sealed = st.st_mtime;
+            }
+            if (segment_push(segment) != 0) {
+                segment_put(segment);
+                break;
+            }
+            expected = value + st.st_size;
+        }
+    }
+    fclose(in);
+    if (segment_count == 0) {
+        struct store_segment *segment = segment_open(*start, O_CREAT | O_TRUNC);
+        if (!segment || segment_push(segment) != 0) {
+            return -1;
+        }
+        return manifest_write(*start);
+    }
+    if (*start < segments[0]->base) {
+        *start = segments[0]->base;
+    }
+    return 0;
+}
+
+// Seal the active segment and continue the stream in a new one at base
+static int segment_rotate(off_t base) {
+    struct store_segment *active = segments[segment_count - 1];
+    if (fsync_policy != FSYNC_NONE && fdatasync(active->fd) != 0) {
+        log_message(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+    }
+    struct store_segment *segment = segment_open(base, O_CREAT | O_TRUNC);
+    if (!segment) {
+        return -1;
+    }
+    if (segment_push(segment) != 0) {
+        segment_put(segment);
+        errno = ENOMEM;
+        return -1;
+    }
+    active->sealed = time(NULL);
+    manifest_write(atomic_load_explicit(&published_start, memory_order_relaxed));
+    return 0;
+}
+
+// Read stream bytes at offset, up to the end of the segment holding them;
+// committer or startup only
+static ssize_t store_pread(void *buffer, size_t len, off_t offset) {
+    size_t i = segment_find(offset);
+    if (offset < segments[i]->base) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (i + 1 < segment_count && (off_t)len > segments[i + 1]->base - offset) {
+        len = segments[i + 1]->base - offset;
+    }
+    return pread(segments[i]->fd, buffer, len, offset - segments[i]->base);
+}
+
+// Record the end of one more command; caller holds index_lock for writing
+static int index_push(uint64_t end) {
+    if (command_count == command_capacity) {
+        size_t capacity = command_capacity ? command_capacity * 2 : 1024;
+        uint64_t *ends = realloc(command_ends, capacity * sizeof(*ends));
+        if (!ends) {
+            log_message(LOG_ERR, "Memory allocation failed for command index");
+            return -1;
+        }
+        command_ends = ends;
+        command_capacity = capacity;
+    }
+    command_ends[command_count++] = end;
+    return 0;
+}
+
+// Index every newline in data, which was appended at offset base.
+// Caller holds index_lock for writing.
+static void index_record(const char *data, size_t len, off_t base) {
+    size_t first = command_count;
+    const char *pos = data;
+    const char *end = data + len;
+    while ((pos = memchr(pos, '\n', end - pos)) != NULL) {
+        pos++;
+        if (index_push(base + (pos - data)) != 0) {
+            break;
+        }
+    }
+    if (index_fd != -1 && command_count > first) {
+        size_t bytes = (command_count - first) * sizeof(*command_ends);
+        if (write(index_fd, &command_ends[first], bytes) != (ssize_t)bytes) {
+            log_message(LOG_ERR, "Failed to persist command index: %s", strerror(errno));
+        }
+    }
+}
+
+// First command boundary at or after offset, or offset itself when only a
+// partial command follows it; caller holds index_lock
+static uint64_t index_boundary(uint64_t offset) {
+    if (commands_start >= offset) {
+        return commands_start;
+    }
+    size_t low = 0, high = command_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (command_ends[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < command_count ? command_ends[low] : offset;
+}
+
+// Commands that end within the published data; caller holds index_lock.
+// The committer indexes a batch before releasing it, so under the interval
+// fsync policy the index runs ahead of store_length() until the next sync.
+static size_t index_published(void) {
+    uint64_t length = store_length();
+    size_t low = 0, high = command_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (command_ends[mid] <= length) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Forget the commands that end at or before start; caller holds index_lock
+// for writing. The persisted copy keeps them until index_compact().
+static void index_drop(uint64_t start) {
+    size_t dropped = 0;
+    while (dropped < command_count && command_ends[dropped] <= start) {
+        dropped++;
+    }
+    memmove(command_ends, command_ends + dropped, (command_count - dropped) * sizeof(*command_ends));
+    command_count -= dropped;
+    commands_start = start;
+    if (index_fd != -1) {
+        index_stale += dropped;
+    }
+}
+
+// Write the header and the retained command ends to a new index file
+static int index_write(int fd) {
+    struct index_header header = { .start = commands_start };
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    size_t bytes = command_count * sizeof(*command_ends);
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        (bytes > 0 && write(fd, command_ends, bytes) != (ssize_t)bytes)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Replace the persisted index with one holding only the retained commands
+// once the dropped ones outnumber them, so each rewrite is paid for by as
+// many drops. Committer (or startup) only: it is the only writer of
+// command_ends, so no lock is needed to read them.
+static void index_compact(void) {
+    if (index_fd == -1 || index_stale < INDEX_COMPACT_MIN || index_stale < command_count) {
+        return;
+    }
+    char index_path[PATH_MAX], temp_path[PATH_MAX + 4];
+    snprintf(index_path, sizeof(index_path), "%s%s", data_path, INDEX_SUFFIX);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", index_path);
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || index_write(fd) != 0 || rename(temp_path, index_path) != 0) {
+        log_message(LOG_ERR, "Failed to compact command index: %s", strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(temp_path);
+        }
+        // Retried after as many drops again
+        index_stale = 0;
+        return;
+    }
+    close(index_fd);
+    index_fd = fd;
+    log_message(LOG_DEBUG, "Compacted command index: %zu dropped, %zu kept", index_stale, command_count);
+    index_stale = 0;
+}
+
+// Scan the data from offset from to length and index the commands found
+static int index_scan(off_t from, off_t length) {
+    char *buffer = malloc(INDEX_SCAN_SIZE);
+    if (!buffer) {
+        log_message(LOG_ERR, "Memory allocation failed for index scan");
+        return -1;
+    }
+    int saved_fd = index_fd;
+    index_fd = -1; // Persisted separately once the scan is complete
+    while (from < length) {
+        size_t want = length - from < INDEX_SCAN_SIZE ? length - from : INDEX_SCAN_SIZE;
+        ssize_t bytes_read = store_pread(buffer, want, from);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            log_message(LOG_ERR, "Failed to read data file for index: %s", strerror(errno));
+            break;
+        }
+        index_record(buffer, bytes_read, from);
+        from += bytes_read;
+    }
+    index_fd = saved_fd;
+    free(buffer);
+    return from < length ? -1 : 0;
+}
+
+// Load the persisted index, keep the longest prefix that is consistent with
+// the data file, and return the data offset from which scanning must resume.
+// Commands retention dropped before the index was last compacted stay
+// dropped: commands_start moves to the start recorded in the header.
+static off_t index_load(off_t length) {
+    uint64_t base = commands_start;
+    struct stat st;
+    if (fstat(index_fd, &st) != 0) {
+        return base;
+    }
+    struct index_header header;
+    bool matches = st.st_size >= (off_t)sizeof(header) &&
+        pread(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.start >= base && header.start <= (uint64_t)length;
+    // A torn final record from a crash is dropped
+    size_t stored = matches ? (st.st_size - sizeof(header)) / sizeof(*command_ends) : 0;
+    size_t valid = 0;
+    command_ends = malloc((stored ? stored : 1) * sizeof(*command_ends));
+    if (!command_ends) {
+        return base;
+    }
+    command_capacity = stored ? stored : 1;
+    if (stored > 0 && pread(index_fd, command_ends, stored * sizeof(*command_ends), sizeof(header))
+            != (ssize_t)(stored * sizeof(*command_ends))) {
+        stored = 0;
+    }
+    uint64_t previous = matches ? header.start : base;
+    // Ends must increase and stay within the data the file actually holds
+    while (valid < stored && command_ends[valid] > previous && command_ends[valid] <= (uint64_t)length) {
+        previous = command_ends[valid++];
+    }
+    // The start and the last kept end must sit just past a newline, otherwise
+    // the index describes different data and is rebuilt from scratch
+    char first = '\n', last = '\n';
+    if ((matches && header.start > base && (store_pread(&first, 1, header.start - 1) != 1 || first != '\n')) ||
+        (valid > 0 && (store_pread(&last, 1, previous - 1) != 1 || last != '\n'))) {
+        matches = false;
+        valid = 0;
+        previous = base;
+    }
+    if (!matches && st.st_size > 0) {
+        log_message(LOG_WARNING, "Command index does not match %s, rebuilding", data_path);
+    }
+    command_count = valid;
+    commands_start = matches ? header.start : base;
+    // Keeping the records is enough when the header is sound, otherwise the
+    // file starts over with a fresh one
+    if (ftruncate(index_fd, matches ? (off_t)(sizeof(header) + valid * sizeof(*command_ends)) : 0) != 0 ||
+        (!matches && index_write(index_fd) != 0) ||
+        lseek(index_fd, 0, SEEK_END) < 0) {
+        log_message(LOG_ERR, "Failed to reset command index file: %s", strerror(errno));
+    }
+    return previous;
+}
+
+// Build the command index for the data in [start, length), optionally
+// persisted next to the data file, whose header may move commands_start on
+static int index_open(bool persist, off_t start, off_t length) {
+    off_t resume = start;
+    commands_start = start;
+    if (persist && segment_size > 0) {
+        log_message(LOG_INFO, "Segmented store, rebuilding the command index instead of persisting it");
+        persist = false;
+    }
+    if (persist) {
+        char index_path[PATH_MAX];
+        snprintf(index_path, sizeof(index_path), "%s%s", data_path, INDEX_SUFFIX);
+        index_fd = open(index_path, O_RDWR | O_CREAT, 0644);
+        if (index_fd == -1) {
+            log_message(LOG_ERR, "Failed to open command index: %s", strerror(errno));
+            return -1;
+        }
+        resume = index_load(length);
+    }
+    size_t loaded = command_count;
+    if (index_scan(resume, length) != 0) {
+        return -1;
+    }
+    if (index_fd != -1 && command_count > loaded) {
+        size_t bytes = (command_count - loaded) * sizeof(*command_ends);
+        if (write(index_fd, &command_ends[loaded], bytes) != (ssize_t)bytes) {
+            log_message(LOG_ERR, "Failed to persist command index: %s", strerror(errno));
+        }
+    }
+    log_message(LOG_INFO, "Command index ready: %zu commands (%zu loaded, %lld bytes scanned)",
+           command_count, loaded, (long long)(length - resume));
+    return 0;
+}
+
+// Apply the retention limits after the store grew to length: move the start
+// past commands beyond the last-N cap, and delete old segments that are
+// past the size or age limit or hold nothing served any more. Committer
+// (or startup) only.
+static void store_retain(off_t length) {
+    off_t start = atomic_load_explicit(&published_start, memory_order_relaxed);
+    size_t drop = 0;
+    pthread_rwlock_wrlock(&index_lock);
+    if (retain_commands > 0 && command_count > retain_commands) {
+        off_t cap_start = command_ends[command_count - retain_commands - 1];
+        start = cap_start > start ? cap_start : start;
+    }
+    if (segment_size > 0) {
+        time_t now = time(NULL);
+        while (drop + 1 < segment_count) {
+            struct store_segment *segment = segments[drop];
+            bool unused = segments[drop + 1]->base <= start;
+            bool oversize = retain_bytes > 0 && length - segment->base > retain_bytes;
+            bool expired = retain_age > 0 && now - segment->sealed >= retain_age;
+            if (!unused && !oversize && !expired) {
+                break;
+            }
+            drop++;
+        }
+        if (drop > 0 && segments[drop]->base > start) {
+            start = index_boundary(segments[drop]->base);
+        }
+    }
+    if (start != (off_t)commands_start) {
+        index_drop(start);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    index_compact();
+    atomic_store_explicit(&published_start, start, memory_order_release);
+    if (drop == 0) {
+        return;
+    }
+
+    // Readers still holding a dropped segment keep its descriptor until done
+    struct store_segment *dropped[drop];
+    pthread_rwlock_wrlock(&segments_lock);
+    memcpy(dropped, segments, drop * sizeof(*segments));
+    memmove(segments, segments + drop, (segment_count - drop) * sizeof(*segments));
+    segment_count -= drop;
+    pthread_rwlock_unlock(&segments_lock);
+    manifest_write(start);
+    for (size_t i = 0; i < drop; i++) {
+        char path[PATH_MAX];
+        segment_path(dropped[i]->base, path, sizeof(path));
+        if (unlink(path) != 0) {
+            log_message(LOG_ERR, "Failed to delete segment %s: %s", path, strerror(errno));
+        }
+        segment_put(dropped[i]);
+    }
+    log_message(LOG_INFO, "Retention deleted %zu segment(s), store starts at %lld", drop, (long long)start);
+}
+#endif
+
+// Take an exclusive lock on fd so no two servers append to the store at
+// once. A successor that took over with -H waits for its predecessor to
+// close the store, however long its drain takes; anyone else fails at once.
+static int store_lock(int fd, bool wait) {
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        return 0;
+    }
+    if (errno == EWOULDBLOCK && wait) {
+        log_message(LOG_INFO, "Waiting for the previous server to close %s", data_path);
+        if (flock(fd, LOCK_EX) == 0) {
+            return 0;
+        }
+    }
+    if (errno == EWOULDBLOCK) {
+        log_message(LOG_ERR, "%s is in use by another server", data_path);
+    } else {
+        log_message(LOG_ERR, "Failed to lock %s: %s", data_path, strerror(errno));
+    }
+    return -1;
+}
+
+// Open the data file/device descriptor used for appends and publish its
+// current length, holding the store's lock until store_close()
+int store_open(const struct server_options *options) {
+    data_path = options->data_file;
+#if USE_AESD_CHAR_DEVICE
+    append_fd = open(data_path, O_RDWR | O_APPEND, 0644);
+    if (append_fd == -1) {
+        log_message(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        return -1;
+    }
+    if (store_lock(append_fd, options->handoff_wait) != 0) {
+        store_close();
+        return -1;
+    }
+    off_t length = lseek(append_fd, 0, SEEK_END);
+    if (length < 0) {
+        log_message(LOG_ERR, "Failed to get data file length: %s", strerror(errno));
+        close(append_fd);
+        append_fd = -1;
+        return -1;
+    }
+    atomic_store_explicit(&published_length, length, memory_order_release);
+    snapshot_fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (snapshot_fd == -1) {
+        log_message(LOG_ERR, "Failed to open data file for echo snapshots: %s", strerror(errno));
+        store_close();
+        return -1;
+    }
+#else
+    snprintf(manifest_path, sizeof(manifest_path), "%s%s", data_path, MANIFEST_SUFFIX);
+    char lock_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s%s", data_path, LOCK_SUFFIX);
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1) {
+        log_message(LOG_ERR, "Failed to open lock file %s: %s", lock_path, strerror(errno));
+        return -1;
+    }
+    if (store_lock(lock_fd, options->handoff_wait) != 0) {
+        store_close();
+        return -1;
+    }
+    segment_size = options->segment_size;
+    retain_bytes = options->retain_bytes;
+    retain_age = options->retain_age;
+    retain_commands = options->retain_commands;
+    atomic_store_explicit(&map_segments, options->map_store, memory_order_relaxed);
+    long page = sysconf(_SC_PAGESIZE);
+    map_extent = STORE_MAP_EXTENT;
+    if (segment_size > 0 && segment_size < STORE_MAP_EXTENT) {
+        map_extent = (segment_size + page - 1) / page * page;
+    }
+    off_t start = 0;
+    if (segment_size > 0) {
+        if (segments_load(&start) != 0) {
+            store_close();
+            return -1;
+        }
+    } else {
+        struct store_segment *segment = segment_open(0, O_CREAT);
+        if (!segment) {
+            return -1;
+        }
+        if (segment_push(segment) != 0) {
+            segment_put(segment);
+            return -1;
+        }
+    }
+    struct store_segment *active = segments[segment_count - 1];
+    struct stat st;
+    if (fstat(active->fd, &st) != 0) {
+        log_message(LOG_ERR, "Failed to get data file length: %s", strerror(errno));
+        store_close();
+        return -1;
+    }
+    off_t length = active->base + st.st_size;
+    for (size_t i = 0; i < segment_count; i++) {
+        off_t size = i + 1 < segment_count ? segments[i + 1]->base - segments[i]->base : st.st_size;
+        segment_reserve(segments[i], size);
+    }
+    if (index_open(options->persist_index, start, length) != 0) {
+        store_close();
+        return -1;
+    }
+    start = commands_start;
+    atomic_store_explicit(&published_length, length, memory_order_release);
+    atomic_store_explicit(&published_start, start, memory_order_release);
+    store_retain(length);
+    if (segment_size > 0) {
+        log_message(LOG_INFO, "Segmented store: %zu segment(s) of %lld bytes, serving [%lld, %lld)",
+                    segment_count, (long long)segment_size, (long long)store_start(), (long long)length);
+    }
+#endif
+
+    fsync_policy = options->fsync_policy;
+    fsync_interval_ms = options->fsync_interval_ms;
+    snapshot_limit = options->echo_cache_size;
+#if USE_AESD_CHAR_DEVICE
+    if (fsync_policy != FSYNC_NONE) {
+        log_message(LOG_INFO, "%s keeps data in memory, fsync policy ignored", data_path);
+        fsync_policy = FSYNC_NONE;
+    }
+    if (options->map_store) {
+        log_message(LOG_INFO, "%s cannot be mapped, reading it with system calls", data_path);
+    }
+#endif
+    committer_stopping = false;
+    // Leave shutdown signals to the server threads
+    sigset_t block_mask, old_mask;
+    sigfillset(&block_mask);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+    int result = pthread_create(&committer_thread, NULL, store_commit_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (result != 0) {
+        log_message(LOG_ERR, "Failed to create commit thread: %s", strerror(result));
+        store_close();
+        return -1;
+    }
+    committer_running = true;
+    return 0;
+}
+
+// Commit whatever is still queued, stop the committer and close the store
+void store_close(void) {
+    if (committer_running) {
+        pthread_mutex_lock(&commit_mutex);
+        committer_stopping = true;
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&commit_mutex);
+        pthread_join(committer_thread, NULL);
+        committer_running = false;
+    }
+    if (snapshot) {
+        snapshot_put(snapshot);
+        snapshot = NULL;
+    }
+#if USE_AESD_CHAR_DEVICE
+    if (append_fd != -1) {
+        close(append_fd);
+    }
+    if (snapshot_fd != -1) {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+    }
+#else
+    for (size_t i = 0; i < segment_count; i++) {
+        segment_put(segments[i]);
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = 0;
+    segment_capacity = 0;
+    if (index_fd != -1) {
+        close(index_fd);
+        index_fd = -1;
+    }
+    index_stale = 0;
+    free(command_ends);
+    command_ends = NULL;
+    command_count = 0;
+    command_capacity = 0;
+    if (lock_fd != -1) {
+        close(lock_fd); // Lets a successor in
+        lock_fd = -1;
+    }
+#endif
+    append_fd = -1;
+}
+
+// Queue the records in iov[0, iovcnt) for the committer without waiting;
+// iov and the data must stay valid until request is done. With completions
+// set the released request is put on that queue and its eventfd is
+// signalled, otherwise the caller waits in store_append_wait(). With
+// snapshot set in char device mode the released request holds the device
+// contents as of its write in request->snapshot, for the caller to echo and
+// then release with store_snapshot_put().
+void store_append_submit(struct store_append *request, const struct iovec *iov, int iovcnt,
+                         bool snapshot, struct store_completions *completions) {
+    *request = (struct store_append){
+        .iov = iov,
+        .iovcnt = iovcnt,
+        .snapshot_wanted = snapshot,
+        .requested_ns = metrics_now(),
+        .completions = completions,
+    };
+    pthread_mutex_lock(&commit_mutex);
+    *commit_queue_tail = request;
+    commit_queue_tail = &request->next;
+    pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&commit_mutex);
+}
+
+// Wait until request is released. One bound for a completion queue is taken
+// off it, so it is not reported again.
+void store_append_wait(struct store_append *request) {
+    pthread_mutex_lock(&commit_mutex);
+    while (!request->done) {
+        pthread_cond_wait(&durable_cond, &commit_mutex);
+    }
+    if (request->completions) {
+        struct store_completions *completions = request->completions;
+        struct store_append **link = &completions->done;
+        while (*link && *link != request) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = request->next;
+            if (completions->done_tail == &request->next) {
+                completions->done_tail = link;
+            }
+        }
+        request->completions = NULL;
+    }
+    pthread_mutex_unlock(&commit_mutex);
+}
+
+void store_completions_init(struct store_completions *completions, int event_fd) {
+    completions->done = NULL;
+    completions->done_tail = &completions->done;
+    completions->event_fd = event_fd;
+}
+
+// Take the requests released to completions since the last call, in the
+// order they were queued; the caller has read the eventfd first
+struct store_append *store_completions_take(struct store_completions *completions) {
+    pthread_mutex_lock(&commit_mutex);
+    struct store_append *list = completions->done;
+    completions->done = NULL;
+    completions->done_tail = &completions->done;
+    pthread_mutex_unlock(&commit_mutex);
+    return list;
+}
+
+// Append a record and publish the resulting data length. When length is not
+// NULL it receives the length that includes this record, so the caller can
+// echo exactly the data up to and including its own write.
+int store_append(const char *data, size_t len, off_t *length) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return store_appendv(&iov, 1, length);
+}
+
+// Append the records gathered in iov as one write; same contract as
+// store_append(). The records are queued for the committer thread, stay
+// contiguous in the store, and the call returns once they are durable under
+// the fsync policy.
+int store_appendv(const struct iovec *iov, int iovcnt, off_t *length) {
+    struct store_append request;
+    store_append_submit(&request, iov, iovcnt, false, NULL);
+    store_append_wait(&request);
+
+    if (length) {
+        *length = request.end;
+    }
+    if (request.error != 0) {
+        errno = request.error;
+        return -1;
+    }
+    return 0;
+}
+
+// Write iov[0, iovcnt) at the end of the store, which is length bytes long,
+// synchronously when durable is set. A segmented store moves on to a new
+// segment whenever the active one reaches the segment size, splitting an
+// iovec if needed. iov is consumed. Returns the bytes written; stops at the
+// first error, leaving errno set.
+static size_t store_write(struct iovec *iov, int iovcnt, off_t length, bool durable) {
+    size_t written = 0;
+    int first = 0;
+    while (first < iovcnt) {
+        if (iov[first].iov_len == 0) {
+            first++;
+            continue;
+        }
+        size_t room = SIZE_MAX;
+#if !USE_AESD_CHAR_DEVICE
+        if (segment_size > 0) {
+            off_t filled = length + written - segments[segment_count - 1]->base;
+            if (filled >= segment_size && segment_rotate(length + written) != 0) {
+                log_message(LOG_ERR, "Failed to start a new segment: %s", strerror(errno));
+                return written;
+            }
+            room = segment_size - (length + written - segments[segment_count - 1]->base);
+        }
+#endif
+        int count = 0;
+        size_t expected = 0;
+        while (first + count < iovcnt && count < STORE_WRITEV_MAX && expected < room) {
+            expected += iov[first + count].iov_len;
+            count++;
+        }
+        size_t held = expected > room ? expected - room : 0; // Left for the next segment
+        iov[first + count - 1].iov_len -= held;
+        expected -= held;
+#if !USE_AESD_CHAR_DEVICE
+        struct store_segment *active = segments[segment_count - 1];
+        segment_reserve(active, length + written + expected - active->base);
+#endif
+
+        ssize_t result;
+        if (durable && dsync_writes) {
+            result = pwritev2(append_fd, iov + first, count, -1, RWF_DSYNC);
+        } else {
+            result = writev(append_fd, iov + first, count);
+        }
+        iov[first + count - 1].iov_len += held;
+        if (result == -1 && durable && dsync_writes &&
+            (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)) {
+            log_message(LOG_INFO, "pwritev2(RWF_DSYNC) not supported, syncing with fdatasync()");
+            dsync_writes = false;
+            continue;
+        }
+        if (result == -1) {
+            log_message(LOG_ERR, "Failed to write to data file: %s", strerror(errno));
+            return written;
+        }
+        written += result;
+        size_t consumed = result;
+        while (consumed > 0 && consumed >= iov[first].iov_len) {
+            consumed -= iov[first].iov_len;
+            first++;
+        }
+        if (consumed > 0) {
+            iov[first].iov_base = (char *)iov[first].iov_base + consumed;
+            iov[first].iov_len -= consumed;
+        }
+        if ((size_t)result < expected) {
+            log_message(LOG_ERR, "Short write to data file: %zd of %zu bytes", result, expected);
+            errno = ENOSPC;
+            return written;
+        }
+    }
+    if (durable && !dsync_writes && fdatasync(append_fd) != 0) {
+        log_message(LOG_ERR, "Failed to sync data file: %s", strerror(errno));
+    }
+    return written;
+}
+
+// Write a batch of queued requests with as few system calls as the iovec
+// limit and segment boundaries allow, index the commands in it, and set each
+// request's end and error. Returns the store length after the batch.
+static off_t store_commit_batch(struct store_append *batch, off_t length) {
+    static struct iovec *iov;
+    static int iov_capacity;
+    int iovcnt = 0;
+    size_t records = 0;
+    uint64_t started = metrics_now();
+    for (struct store_append *request = batch; request; request = request->next) {
+        iovcnt += request->iovcnt;
+        request->started_ns = started;
+        records++;
+    }
+    if (iovcnt > iov_capacity) {
+        struct iovec *grown = realloc(iov, iovcnt * sizeof(*iov));
+        if (!grown) {
+            log_message(LOG_ERR, "Memory allocation failed for commit batch");
+            for (struct store_append *request = batch; request; request = request->next) {
+                request->end = length;
+                request->error = ENOMEM;
+            }
+            return length;
+        }
+        iov = grown;
+        iov_capacity = iovcnt;
+    }
+    int count = 0;
+    for (struct store_append *request = batch; request; request = request->next) {
+        memcpy(iov + count, request->iov, request->iovcnt * sizeof(*iov));
+        count += request->iovcnt;
+    }
+
+    size_t written = store_write(iov, iovcnt, length, fsync_policy == FSYNC_BATCH);
+    int error = errno;
+    metrics_commit(records, fsync_policy == FSYNC_BATCH);
+#if USE_AESD_CHAR_DEVICE
+    // The device only exposes complete commands and drops the oldest ones,
+    // so ask it for the length rather than counting bytes
+    off_t new_length = lseek(append_fd, 0, SEEK_END);
+    if (new_length < 0) {
+        new_length = length;
+    }
+    snapshot_batch(batch, new_length);
+#else
+    off_t new_length = length + written;
+    if (written > 0) {
+        pthread_rwlock_wrlock(&index_lock);
+        size_t remaining = written;
+        for (struct store_append *request = batch; request && remaining > 0; request = request->next) {
+            for (int i = 0; i < request->iovcnt && remaining > 0; i++) {
+                size_t len = request->iov[i].iov_len < remaining ? request->iov[i].iov_len : remaining;
+                index_record(request->iov[i].iov_base, len, new_length - remaining);
+                remaining -= len;
+            }
+        }
+        pthread_rwlock_unlock(&index_lock);
+    }
+#endif
+
+    // Requests past the point where writing stopped failed
+    size_t offset = 0;
+    for (struct store_append *request = batch; request; request = request->next) {
+        for (int i = 0; i < request->iovcnt; i++) {
+            offset += request->iov[i].iov_len;
+        }
+        request->error = offset > written ? error : 0;
+#if USE_AESD_CHAR_DEVICE
+        request->end = new_length;
+#else
+        request->end = length + (offset < written ? offset : written);
+#endif
+    }
+    return new_length;
+}
+
+// Publish length and release every request in list: waiting callers are
+// woken, the rest go to their event loop's completion queue
+static void store_release(struct store_append *list, off_t length) {
+    atomic_store_explicit(&published_length, length, memory_order_release);
+    atomic_fetch_add_explicit(&store_generation, 1, memory_order_release);
+    uint64_t released = metrics_now();
+    while (list) {
+        struct store_append *next = list->next; // list is gone once done is seen
+        metrics_append(list->requested_ns, list->started_ns, released);
+        list->done = true;
+        struct store_completions *completions = list->completions;
+        if (completions) {
+            bool signal = !completions->done;
+            list->next = NULL;
+            *completions->done_tail = list;
+            completions->done_tail = &list->next;
+            uint64_t one = 1;
+            if (signal && write(completions->event_fd, &one, sizeof(one)) == -1) {
+                // Already readable when the counter is saturated
+            }
+        }
+        list = next;
+    }
+    pthread_cond_broadcast(&durable_cond);
+}
+
+// Thread function: commit queued appends in batches until store_close().
+// Under the interval policy written batches wait for the next fdatasync()
+// before their callers are released.
+static void *store_commit_func(void *arg) {
+    (void)arg;
+    struct store_append *unsynced = NULL;
+    struct store_append **unsynced_tail = &unsynced;
+    off_t length = atomic_load_explicit(&published_length, memory_order_relaxed);
+    struct timespec next_sync;
+    clock_gettime(CLOCK_REALTIME, &next_sync);
+
+    pthread_mutex_lock(&commit_mutex);
+    while (1) {
+        while (!commit_queue && !committer_stopping) {
+            if (!unsynced) {
+                pthread_cond_wait(&commit_cond, &commit_mutex);
+            } else if (pthread_cond_timedwait(&commit_cond, &commit_mutex, &next_sync) == ETIMEDOUT) {
+                break;
+            }
+        }
+        struct store_append *batch = commit_queue;
+        commit_queue = NULL;
+        commit_queue_tail = &commit_queue;
+        bool stopping = committer_stopping;
+        pthread_mutex_unlock(&commit_mutex);
+
+        struct store_append *release = NULL;
+        if (batch) {
+#if USE_AESD_CHAR_DEVICE
+            pthread_rwlock_wrlock(&device_lock); // Until the new length is published
+#endif
+            length = store_commit_batch(batch, length);
+#if !USE_AESD_CHAR_DEVICE
+            store_retain(length);
+#endif
+        }
+        if (fsync_policy != FSYNC_INTERVAL) {
+            release = batch;
+        } else {
+            if (batch) {
+                if (!unsynced) {
+                    clock_gettime(CLOCK_REALTIME, &next_sync);
+                    next_sync.tv_nsec += (long)fsync_interval_ms * 1000000;
+                    next_sync.tv_sec += next_sync.tv_nsec / 1000000000;
+                    next_sync.tv_nsec %= 1000000000;
+                }
+                *unsynced_tail = batch;
+                while (*unsynced_tail) {
+                    unsynced_tail = &(*unsynced_tail)->next;
+                }
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            bool due = now.tv_sec > next_sync.tv_sec ||
+                       (now.tv_sec == next_sync.tv_sec && now.tv_nsec >= next_sync.tv_nsec);
+            if (unsynced && (due || stopping)) {
+                if (fdatasync(append_fd) != 0) {
+                    log_message(LOG_ERR, "Failed to sync data file: %s", strerror(errno));
+                }
+                metrics_commit(0, true);
+                release = unsynced;
+                unsynced = NULL;
+                unsynced_tail = &unsynced;
+            }
+        }
+
+        pthread_mutex_lock(&commit_mutex);
+        if (release) {
+            store_release(release, length);
+        }
+#if USE_AESD_CHAR_DEVICE
+        if (batch) {
+            pthread_rwlock_unlock(&device_lock);
+        }
+#endif
+        if (stopping && !commit_queue && !unsynced) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&commit_mutex);
+    return NULL;
+}
+
+// Device or data file path, for opening and for messages
+const char *store_data_path(void) {
+    return data_path;
+}
+
+// Length of the data covered by every completed append; lock-free
+off_t store_length(void) {
+    return atomic_load_explicit(&published_length, memory_order_acquire);
+}
+
+// First offset still served: 0 unless retention or the last-N cap dropped
+// older data; lock-free
+off_t store_start(void) {
+#if USE_AESD_CHAR_DEVICE
+    return 0;
+#else
+    off_t start = atomic_load_explicit(&published_start, memory_order_acquire);
+    off_t length = store_length();
+    return start < length ? start : length;
+#endif
+}
+
+#if !USE_AESD_CHAR_DEVICE
+// Pin the segment holding offset and describe the bytes it holds from there
+// up to end, or up to the end of the mapping when it is mapped
+static void segment_extent(off_t offset, off_t end, struct store_extent *extent) {
+    pthread_rwlock_rdlock(&segments_lock);
+    size_t i = segment_find(offset);
+    struct store_segment *segment = segments[i];
+    if (offset >= segment->base) {
+        off_t limit = i + 1 < segment_count && segments[i + 1]->base < end ? segments[i + 1]->base : end;
+        atomic_fetch_add_explicit(&segment->refs, 1, memory_order_relaxed);
+        extent->segment = segment;
+        extent->fd = segment->fd;
+        extent->file_offset = offset - segment->base;
+        extent->len = limit - offset;
+        size_t map = extent->file_offset / map_extent;
+        if (map < segment->map_count) {
+            // Stop at the end of the mapping
+            off_t map_offset = extent->file_offset % map_extent;
+            extent->data = segment->maps[map] + map_offset;
+            if (extent->len > (off_t)map_extent - map_offset) {
+                extent->len = map_extent - map_offset;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&segments_lock);
+}
+#endif
+
+// Read the stream bytes [from, to) into buffer. Returns the bytes read,
+// fewer if the data ended early, or -1 on error.
+static ssize_t snapshot_read(char *buffer, off_t from, off_t to) {
+    off_t done = 0;
+    while (from + done < to) {
+#if USE_AESD_CHAR_DEVICE
+        ssize_t bytes_read = pread(snapshot_fd, buffer + done, to - from - done, from + done);
+#else
+        struct store_extent extent = { .fd = -1, .segment = NULL, .data = NULL, .len = 0 };
+        segment_extent(from + done, to, &extent);
+        ssize_t bytes_read = 0;
+        if (extent.data) {
+            memcpy(buffer + done, extent.data, extent.len);
+            bytes_read = extent.len;
+        } else if (extent.len > 0) {
+            bytes_read = pread(extent.fd, buffer + done, extent.len, extent.file_offset);
+        }
+        store_extent_put(&extent);
+#endif
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            log_message(LOG_ERR, "Failed to read data for echo snapshot: %s", strerror(errno));
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        done += bytes_read;
+    }
+    return done;
+}
+
+// Read the stream bytes [start, end) into a new snapshot of generation with
+// room for capacity bytes. Returns NULL on failure.
+static struct echo_snapshot *snapshot_new(off_t start, off_t end, size_t capacity, uint64_t generation) {
+    struct echo_snapshot *fresh = malloc(sizeof(*fresh) + capacity);
+    if (!fresh) {
+        log_message(LOG_ERR, "Memory allocation failed for echo snapshot");
+        return NULL;
+    }
+    atomic_init(&fresh->refs, 1);
+    fresh->generation = generation;
+    fresh->base = start;
+    fresh->capacity = capacity;
+    ssize_t bytes_read = snapshot_read(fresh->data, start, end);
+    metrics_echo_snapshot(bytes_read > 0 ? bytes_read : 0);
+    if (bytes_read < 0) {
+        free(fresh);
+        return NULL;
+    }
+    fresh->end = start + bytes_read;
+    return fresh;
+}
+
+// Make fresh, possibly NULL, the latest snapshot; caller holds snapshot_mutex
+static void snapshot_replace(struct echo_snapshot *fresh) {
+    if (snapshot) {
+        snapshot_put(snapshot);
+    }
+    snapshot = fresh;
+}
+
+// Bring the snapshot up to date with generation; caller holds snapshot_mutex.
+// In file mode the data only grows, so the current snapshot is extended in
+// place when it has room: readers never look past the end they pinned. The
+// device drops old entries, so there every generation is read afresh, in
+// full and under device_lock.
+static void snapshot_refresh(uint64_t generation) {
+    off_t start = store_start();
+    off_t end = store_length();
+#if USE_AESD_CHAR_DEVICE
+    snapshot_replace(snapshot_new(start, end, end - start, generation));
+#else
+    if (end - start > (off_t)snapshot_limit) {
+        snapshot_replace(NULL);
+        return;
+    }
+    if (snapshot && snapshot->base <= start && snapshot->end >= start &&
+        end - snapshot->base <= (off_t)snapshot->capacity) {
+        ssize_t bytes_read = snapshot_read(snapshot->data + (snapshot->end - snapshot->base),
+                                           snapshot->end, end);
+        if (bytes_read >= 0) {
+            metrics_echo_snapshot(bytes_read);
+            snapshot->end += bytes_read;
+            snapshot->generation = generation;
+            return;
+        }
+    }
+    size_t capacity = 2 * (end - start);
+    capacity = capacity < SNAPSHOT_MIN_CAPACITY ? SNAPSHOT_MIN_CAPACITY : capacity;
+    capacity = capacity > snapshot_limit ? snapshot_limit : capacity;
+    snapshot_replace(snapshot_new(start, end, capacity, generation));
+#endif
+}
+
+#if USE_AESD_CHAR_DEVICE
+// Committer, holding device_lock: read the device, length bytes long now
+// that batch is written, into the snapshot of the generation store_release()
+// is about to publish, and pin it for each request of batch that wants it
+static void snapshot_batch(struct store_append *batch, off_t length) {
+    struct store_append *request = batch;
+    while (request && !request->snapshot_wanted) {
+        request = request->next;
+    }
+    if (!request) {
+        return;
+    }
+    uint64_t generation = atomic_load_explicit(&store_generation, memory_order_relaxed) + 1;
+    struct echo_snapshot *fresh = snapshot_new(0, length, length, generation);
+    if (!fresh) {
+        return;
+    }
+    for (; request; request = request->next) {
+        if (request->snapshot_wanted) {
+            atomic_fetch_add_explicit(&fresh->refs, 1, memory_order_relaxed);
+            request->snapshot = fresh;
+        }
+    }
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_replace(fresh);
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+#else
+// Describe [offset, end) from the snapshot of the current generation,
+// pinning it. Returns false when the snapshot does not hold offset.
+static bool snapshot_extent(off_t offset, off_t end, struct store_extent *extent) {
+    pthread_mutex_lock(&snapshot_mutex);
+    uint64_t generation = atomic_load_explicit(&store_generation, memory_order_acquire);
+    if (!snapshot || snapshot->generation != generation) {
+        snapshot_refresh(generation);
+    }
+    bool hit = snapshot && offset >= snapshot->base && offset < snapshot->end;
+    if (hit) {
+        atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+        extent->snapshot = snapshot;
+        extent->data = snapshot->data + (offset - snapshot->base);
+        extent->len = (end < snapshot->end ? end : snapshot->end) - offset;
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    return hit;
+}
+#endif
+
+// Hold appends off while a reader works out offsets and lengths and pins the
+// data they refer to, which the char device would otherwise move under it
+// (the published length can even shrink there). Takes device_lock in char
+// device mode and does nothing in file mode, where offsets stay valid.
+// Never append while holding it: the committer could not publish.
+void store_read_lock(void) {
+#if USE_AESD_CHAR_DEVICE
+    pthread_rwlock_rdlock(&device_lock);
+#endif
+}
+
+void store_read_unlock(void) {
+#if USE_AESD_CHAR_DEVICE
+    pthread_rwlock_unlock(&device_lock);
+#endif
+}
+
+// Pin a snapshot of the data as it is now, for a range queued to be sent
+// later. Only char device mode needs one, since appending to the device
+// moves the data, and the caller holds store_read_lock() so the snapshot
+// matches the offsets of the range. Returns NULL in file mode, or if the
+// device cannot be read. Release it with store_snapshot_put().
+struct echo_snapshot *store_snapshot_get(void) {
+#if USE_AESD_CHAR_DEVICE
+    pthread_mutex_lock(&snapshot_mutex);
+    uint64_t generation = atomic_load_explicit(&store_generation, memory_order_acquire);
+    if (!snapshot || snapshot->generation != generation) {
+        snapshot_refresh(generation);
+    }
+    struct echo_snapshot *pinned = snapshot;
+    if (pinned) {
+        atomic_fetch_add_explicit(&pinned->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    return pinned;
+#else
+    return NULL;
+#endif
+}
+
+void store_snapshot_put(struct echo_snapshot *pinned) {
+    if (pinned) {
+        snapshot_put(pinned);
+    }
+}
+
+// Find where the stream bytes [offset, end) can be read: the descriptor, the
+// offset within it, and how many of the bytes it holds from there, plus
+// their address when they are in memory. In file mode echoes of the same
+// generation share one snapshot of the data (-e) unless the store is
+// mapped; in char device mode the bytes come from copy, the snapshot the
+// range was queued with. Whatever holds the bytes is pinned until
+// store_extent_put(). A zero length means the data at offset is no longer
+// served.
+int store_extent_get(struct echo_snapshot *copy, off_t offset, off_t end, struct store_extent *extent) {
+    extent->segment = NULL;
+    extent->snapshot = NULL;
+    extent->data = NULL;
+    extent->fd = -1;
+    extent->file_offset = 0;
+    extent->len = 0;
+#if USE_AESD_CHAR_DEVICE
+    if (copy && offset < end && offset >= copy->base && offset < copy->end) {
+        atomic_fetch_add_explicit(&copy->refs, 1, memory_order_relaxed);
+        extent->snapshot = copy;
+        extent->data = copy->data + (offset - copy->base);
+        extent->len = (end < copy->end ? end : copy->end) - offset;
+    }
+#else
+    (void)copy;
+    if (offset >= end || offset < store_start()) {
+        return 0;
+    }
+    if (atomic_load_explicit(&map_segments, memory_order_relaxed) || snapshot_limit == 0 ||
+        !snapshot_extent(offset, end, extent)) {
+        segment_extent(offset, end, extent);
+    }
+#endif
+    return 0;
+}
+
+void store_extent_put(struct store_extent *extent) {
+#if !USE_AESD_CHAR_DEVICE
+    if (extent->segment) {
+        segment_put(extent->segment);
+    }
+#endif
+    if (extent->snapshot) {
+        snapshot_put(extent->snapshot);
+    }
+    extent->segment = NULL;
+    extent->snapshot = NULL;
+}
+
+// Find byte write_cmd_offset of command write_cmd, the same way the driver's
+// AESDCHAR_IOCSEEKTO does, and store its stream offset in position. In char
+// device mode fd is left positioned there. Returns 0, or -1 with errno set.
+int store_seekto(int fd, const struct aesd_seekto *seekto, off_t *position) {
+#if USE_AESD_CHAR_DEVICE
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, seekto) != 0) {
+        return -1;
+    }
+    *position = lseek(fd, 0, SEEK_CUR);
+    return *position < 0 ? -1 : 0;
+#else
+    (void)fd;
+    *position = -1;
+    pthread_rwlock_rdlock(&index_lock);
+    if (seekto->write_cmd < index_published()) {
+        uint64_t start = seekto->write_cmd ? command_ends[seekto->write_cmd - 1] : commands_start;
+        if (seekto->write_cmd_offset < command_ends[seekto->write_cmd] - start) {
+            *position = start + seekto->write_cmd_offset;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    if (*position < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+// Number of complete commands currently served
+uint32_t store_command_count(int fd) {
+#if USE_AESD_CHAR_DEVICE
+    // The device keeps at most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED commands;
+    // count the ones it will seek to
+    struct aesd_seekto seekto = { .write_cmd = 0, .write_cmd_offset = 0 };
+    off_t position;
+    while (seekto.write_cmd < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED && store_seekto(fd, &seekto, &position) == 0) {
+        seekto.write_cmd++;
+    }
+    return seekto.write_cmd;
+#else
+    (void)fd;
+    pthread_rwlock_rdlock(&index_lock);
+    uint32_t count = index_published();
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+#endif
+}
+
+// Byte range [start, end) holding up to count commands from command first.
+// Returns 0, or -1 with errno EINVAL if command first does not exist.
+int store_command_range(int fd, uint32_t first, uint32_t count, off_t *start, off_t *end) {
+#if USE_AESD_CHAR_DEVICE
+    struct aesd_seekto seekto = { .write_cmd = first, .write_cmd_offset = 0 };
+    if (store_seekto(fd, &seekto, start) != 0) {
+        return -1;
+    }
+    // The range ends where the command after it starts, or at the end of the data
+    *end = store_length();
+    seekto.write_cmd = first + count;
+    off_t next;
+    if (seekto.write_cmd > first && store_seekto(fd, &seekto, &next) == 0) {
+        *end = next;
+    }
+    return *end < 0 ? -1 : 0;
+#else
+    (void)fd;
+    int result = -1;
+    pthread_rwlock_rdlock(&index_lock);
+    size_t published = index_published();
+    if (first < published) {
+        size_t last = count < published - first ? first + count : published;
+        *start = first ? command_ends[first - 1] : commands_start;
+        *end = last > first ? (off_t)command_ends[last - 1] : *start;
+        result = 0;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    if (result != 0) {
+        errno = EINVAL;
+    }
+    return result;
+#endif
+}
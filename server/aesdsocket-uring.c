@@ -0,0 +1,1055 @@
+/*
+ * aesdsocket-uring.c
+ *
+ * io_uring server mode: each loop thread owns a submission/completion ring
+ * and drives the shared connection state machine from completions instead
+ * of readiness events. Clients arrive through a multishot accept, input
+ * arrives through a multishot recv into a ring of provided buffers, and each
+ * echo step reads the data file into a registered send buffer with a read
+ * linked to the send, so one submission moves a whole chunk without
+ * blocking the loop. Appends are handed to the committer without waiting:
+ * the client stops reading until they are released onto the loop's
+ * completion queue, whose eventfd the loop polls.
+ *
+ * The rings are set up with raw system calls. When the kernel lacks what
+ * this mode needs, the server falls back to epoll mode.
+ */
+
+#define _GNU_SOURCE      // For accept4 flags
+#include <stdio.h>       // For standard I/O functions
+#include <stdlib.h>      // For standard library functions
+#include <string.h>      // For string manipulation functions
+#include <errno.h>       // For error number definitions
+#include <unistd.h>      // For POSIX API functions
+#include <poll.h>        // For POLLIN
+#include <sys/mman.h>    // For mmap
+#include <sys/socket.h>  // For socket API
+#include <sys/un.h>      // For sockaddr_un
+#include <sys/syscall.h> // For the io_uring system call numbers
+#include <sys/eventfd.h> // For eventfd
+#include <stddef.h>      // For offsetof
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+
+#define URING_ENTRIES 256          // Submission queue entries per loop
+#define URING_CQ_ENTRIES 4096      // Completion queue entries per loop
+#define URING_RECV_BUFFERS 64      // Provided receive buffers per loop, a power of two
+#define URING_RECV_BUFFER_SIZE RX_SEGMENT_SIZE // Not rx_buffer_size: input is copied out at once
+#define URING_SEND_SLOTS 32        // Registered send buffers per loop
+#define URING_SEND_SLOT_SIZE (64 * 1024)
+#define URING_BUFFER_GROUP 0
+
+// Low bits of user_data say what completed; the rest is the client or loop
+enum uring_tag {
+    URING_TAG_RECV = 1,
+    URING_TAG_READ,
+    URING_TAG_SEND,
+    URING_TAG_ACCEPT,
+    URING_TAG_LOCAL_ACCEPT,
+    URING_TAG_WAKE,
+    URING_TAG_TIMER,
+    URING_TAG_DEADLINE,
+    URING_TAG_PACE,
+    URING_TAG_APPEND,
+};
+#define URING_TAG_MASK 15ULL // Clients and loops are 16-byte aligned
+
+struct uring_loop;
+
+// A connection and the requests in flight for it
+struct uring_client {
+    _Alignas(16) struct connection conn;
+    struct uring_loop *loop;
+    unsigned int inflight;             // Requests whose final completion is still due
+    bool recv_armed;                   // Multishot recv posted
+    bool recv_cancelling;              // Recv cancel submitted while throttled
+    bool pace_armed;                   // Timeout posted to resume reading after a rate limit pause
+    struct __kernel_timespec pace;     // Read by the kernel when the pace TIMEOUT is submitted
+    bool closing;                      // Freed once inflight reaches zero
+    bool waiting;                      // On the loop's wait list for a send slot
+    int slot;                          // Send buffer held, -1 if none
+    unsigned int step_pending;         // Completions due for the current send step
+    size_t slot_len;                   // Bytes staged in the slot
+    size_t slot_sent;                  // Bytes of the slot sent so far
+    bool send_more;                    // tcp_cork: more output follows the slot, send with MSG_MORE
+    size_t read_len;                   // Data bytes requested by the linked read
+    struct store_extent extent;        // Store data pinned for the linked read
+    int step_error;                    // First error of the send step, 0 if none
+    TAILQ_ENTRY(uring_client) wait_entries;
+};
+
+// Submission and completion rings shared with the kernel
+struct uring_ring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;             // Next entry to prepare
+    unsigned int unsubmitted;          // Prepared entries not yet taken by the kernel
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t sqes_len;
+};
+
+// One loop thread with its ring, buffers and clients
+struct uring_loop {
+    _Alignas(16) pthread_t thread_id;
+    struct uring_ring ring;
+    int server_socket;                 // Own SO_REUSEPORT listener, or the shared one
+    bool listener_owned;               // server_socket was opened for this loop
+    int local_socket;                  // Unix-domain listener (-U) shared by every loop, -1 if none
+    int wake_fd;
+    int timer_fd;                      // Timestamp timer, polled by the first loop only
+    struct store_completions completions; // Appends released by the committer
+    int drain_timeout_ms;
+    struct __kernel_timespec drain_timeout; // Read by the kernel when the TIMEOUT is submitted
+    bool stopping;
+    bool fixed_buffers;                // Send slots registered, reads use READ_FIXED
+    bool multishot;                    // Accept and recv are multishot, else rearmed per completion
+    bool multishot_seen;               // A multishot request has completed with more to come
+    struct io_uring_buf_ring *recv_ring;
+    size_t recv_ring_len;
+    char *recv_buffers;
+    char *send_buffers;
+    int free_slots[URING_SEND_SLOTS];
+    int free_count;
+    LIST_HEAD(uring_client_list, connection) connections;
+    TAILQ_HEAD(uring_wait_list, uring_client) slot_waiters;
+};
+
+static struct slab_cache client_cache = SLAB_CACHE("uring_client", sizeof(struct uring_client),
+                                                   _Alignof(struct uring_client), SLAB_CACHED_MAX);
+
+static void uring_send_next(struct uring_client *client);
+static void uring_client_progress(struct uring_client *client);
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *uring_tagged(void *ptr, enum uring_tag tag) {
+    return (void *)((uintptr_t)ptr | tag);
+}
+
+// Hand every prepared entry to the kernel, waiting for a completion if asked
+static int uring_submit(struct uring_ring *ring, bool wait) {
+    atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail, ring->sqe_tail, memory_order_release);
+    int submitted = uring_enter(ring->fd, ring->unsubmitted, wait ? 1 : 0,
+                                wait ? IORING_ENTER_GETEVENTS : 0);
+    if (submitted < 0) {
+        return -1;
+    }
+    ring->unsubmitted -= submitted;
+    return 0;
+}
+
+// Next free submission entry, cleared; submits first when the queue is full
+static struct io_uring_sqe *uring_get_sqe(struct uring_ring *ring) {
+    while (ring->sqe_tail - atomic_load_explicit((_Atomic unsigned int *)ring->sq_head,
+                                                 memory_order_acquire) >= ring->sq_entries) {
+        if (uring_submit(ring, false) != 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            log_message(LOG_ERR, "io_uring submit failed: %s", strerror(errno));
+        }
+    }
+    unsigned int index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->unsubmitted++;
+    return sqe;
+}
+
+static void uring_cancel(struct uring_ring *ring, void *user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)user_data;
+    sqe->user_data = 0; // Completion ignored
+}
+
+// Post the multishot accept for the TCP listener, or with
+// URING_TAG_LOCAL_ACCEPT for the Unix-domain one
+static void uring_arm_accept(struct uring_loop *loop, enum uring_tag tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = tag == URING_TAG_LOCAL_ACCEPT ? loop->local_socket : loop->server_socket;
+    sqe->ioprio = loop->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)uring_tagged(loop, tag);
+}
+
+static void uring_arm_recv(struct uring_client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&client->loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->conn.client_socket;
+    sqe->ioprio = client->loop->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)uring_tagged(client, URING_TAG_RECV);
+    client->recv_armed = true;
+    client->inflight++;
+}
+
+// Give a provided receive buffer back to the kernel
+static void uring_recycle_buffer(struct uring_loop *loop, unsigned int bid) {
+    struct io_uring_buf_ring *br = loop->recv_ring;
+    unsigned short tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(loop->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    atomic_store_explicit((_Atomic unsigned short *)&br->tail, tail + 1, memory_order_release);
+}
+
+// Wake up once a rate limit pause of pause_ms is over
+static void uring_arm_pace(struct uring_client *client, int pause_ms) {
+    client->pace.tv_sec = pause_ms / 1000;
+    client->pace.tv_nsec = (pause_ms % 1000) * 1000000L;
+    struct io_uring_sqe *sqe = uring_get_sqe(&client->loop->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&client->pace;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)uring_tagged(client, URING_TAG_PACE);
+    client->pace_armed = true;
+    client->inflight++;
+}
+
+// Stop reading while the output queue is full, an append is in flight or a
+// rate limit pauses the client, read again once it drains, the append is
+// done or the pause is over
+static void uring_update_recv(struct uring_client *client) {
+    if (client->closing || client->conn.input_ended) {
+        return;
+    }
+    int pause_ms = limit_pause_ms(&client->conn);
+    if (client->conn.output_throttled || client->conn.append_pending || pause_ms > 0) {
+        if (client->recv_armed && !client->recv_cancelling) {
+            uring_cancel(&client->loop->ring, uring_tagged(client, URING_TAG_RECV));
+            client->recv_cancelling = true;
+        }
+        if (pause_ms > 0 && !client->pace_armed) {
+            uring_arm_pace(client, pause_ms);
+        }
+    } else if (!client->recv_armed) {
+        uring_arm_recv(client);
+    }
+}
+
+// Shut the socket so every request in flight completes; the client is freed
+// by uring_reap_client() once they have
+static void uring_close_client(struct uring_client *client) {
+    if (client->closing) {
+        return;
+    }
+    client->closing = true;
+    shutdown(client->conn.client_socket, SHUT_RDWR);
+    if (client->recv_armed && !client->recv_cancelling) {
+        uring_cancel(&client->loop->ring, uring_tagged(client, URING_TAG_RECV));
+        client->recv_cancelling = true;
+    }
+    if (client->pace_armed) {
+        uring_cancel(&client->loop->ring, uring_tagged(client, URING_TAG_PACE));
+    }
+    if (client->waiting) {
+        TAILQ_REMOVE(&client->loop->slot_waiters, client, wait_entries);
+        client->waiting = false;
+    }
+}
+
+// Return a send slot to the loop, handing it straight to a waiting client
+static void uring_release_slot(struct uring_client *client) {
+    struct uring_loop *loop = client->loop;
+    loop->free_slots[loop->free_count++] = client->slot;
+    client->slot = -1;
+    struct uring_client *waiter = TAILQ_FIRST(&loop->slot_waiters);
+    if (waiter) {
+        TAILQ_REMOVE(&loop->slot_waiters, waiter, wait_entries);
+        waiter->waiting = false;
+        uring_send_next(waiter);
+    }
+}
+
+// Free a closing client once nothing is in flight for it, storing the rest
+// of its input first
+static bool uring_reap_client(struct uring_client *client) {
+    if (!client->closing || client->inflight > 0 || connection_flush_input(&client->conn)) {
+        return false;
+    }
+    if (client->slot >= 0) {
+        uring_release_slot(client);
+    }
+    LIST_REMOVE(&client->conn, entries);
+    connection_close(&client->conn);
+    slab_free(&client_cache, client);
+    return true;
+}
+
+static void uring_submit_send(struct uring_client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&client->loop->ring);
+    char *buf = client->loop->send_buffers + (size_t)client->slot * URING_SEND_SLOT_SIZE;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->conn.client_socket;
+    sqe->addr = (uintptr_t)(buf + client->slot_sent);
+    sqe->len = client->slot_len - client->slot_sent;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (client->send_more ? MSG_MORE : 0);
+    sqe->user_data = (uintptr_t)uring_tagged(client, URING_TAG_SEND);
+    client->step_pending++;
+    client->inflight++;
+}
+
+// Stage the next chunk of the output queue head in a send slot: the unsent
+// prefix is copied in, and data file contents are copied from the mapping
+// with -M or read in by a request linked to the send, which the kernel
+// cancels if the read comes up short
+static void uring_send_next(struct uring_client *client) {
+    struct connection *conn = &client->conn;
+    struct uring_loop *loop = client->loop;
+    if (client->slot >= 0 || client->waiting || client->closing) {
+        return;
+    }
+    while (conn->output_count > 0) {
+        struct output_range *range = &conn->output[conn->output_head];
+        size_t prefix_left = range->prefix_len - range->prefix_sent;
+        off_t data_left = range->end - range->offset;
+        if (prefix_left == 0 && data_left <= 0) {
+            connection_output_sent(conn, 0);
+            continue;
+        }
+        if (loop->free_count == 0) {
+            TAILQ_INSERT_TAIL(&loop->slot_waiters, client, wait_entries);
+            client->waiting = true;
+            return;
+        }
+        client->slot = loop->free_slots[--loop->free_count];
+        char *buf = loop->send_buffers + (size_t)client->slot * URING_SEND_SLOT_SIZE;
+        const char *prefix = range->prefix_heap ? range->prefix_heap : range->prefix;
+        size_t staged = prefix_left < URING_SEND_SLOT_SIZE ? prefix_left : URING_SEND_SLOT_SIZE;
+        memcpy(buf, prefix + range->prefix_sent, staged);
+        size_t read_len = URING_SEND_SLOT_SIZE - staged;
+        if ((off_t)read_len > data_left) {
+            read_len = data_left;
+        }
+        if (read_len > 0) {
+            // Stops at the end of the segment holding the data
+            store_extent_get(range->snapshot, range->offset, range->end, &client->extent);
+            if ((off_t)read_len > client->extent.len) {
+                read_len = client->extent.len;
+            }
+            if (read_len == 0) {
+                store_extent_put(&client->extent);
+            }
+        }
+        if (read_len > 0 && client->extent.data) {
+            // Mapped store: the data is already in memory, no read needed
+            memcpy(buf + staged, client->extent.data, read_len);
+            store_extent_put(&client->extent);
+            staged += read_len;
+            read_len = 0;
+        }
+        if (staged == 0 && read_len == 0) {
+            // The data was dropped by retention before it could be sent
+            uring_release_slot(client);
+            if (connection_output_truncated(conn) != CONN_OK) {
+                uring_close_client(client);
+                return;
+            }
+            continue;
+        }
+        client->slot_len = staged;
+        client->slot_sent = 0;
+        client->step_error = 0;
+        client->step_pending = 0;
+        client->read_len = read_len;
+        if (read_len > 0) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+            sqe->opcode = loop->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = client->extent.fd;
+            sqe->addr = (uintptr_t)(buf + staged);
+            sqe->len = read_len;
+            sqe->off = client->extent.file_offset;
+            sqe->buf_index = loop->fixed_buffers ? client->slot : 0;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = (uintptr_t)uring_tagged(client, URING_TAG_READ);
+            client->step_pending++;
+            client->inflight++;
+            client->slot_len += read_len; // Trimmed to what was read on completion
+        }
+        // Sends are corked with MSG_MORE here rather than TCP_CORK, which
+        // would cost two system calls per burst
+        client->send_more = atomic_load_explicit(&tunables.tcp_cork, memory_order_relaxed) &&
+                            conn->output_bytes > client->slot_len;
+        uring_submit_send(client);
+        return;
+    }
+}
+
+// Every completion of a send step is in: send the rest of the slot, or
+// release it and move on
+static void uring_send_step_done(struct uring_client *client) {
+    struct connection *conn = &client->conn;
+    if (client->closing) {
+        uring_release_slot(client);
+        return;
+    }
+    if (client->step_error != 0) {
+        log_message(LOG_ERR, "Failed to send data to client: %s", strerror(client->step_error));
+        uring_close_client(client);
+        return;
+    }
+    if (client->slot_sent < client->slot_len) {
+        uring_submit_send(client); // Short send, or the read was short and cut the link
+        return;
+    }
+    uring_release_slot(client);
+    if (client->slot_len == 0 && connection_output_truncated(conn) != CONN_OK) {
+        uring_close_client(client);
+        return;
+    }
+    uring_client_progress(client);
+}
+
+static void uring_handle_read(struct uring_client *client, const struct io_uring_cqe *cqe) {
+    client->inflight--;
+    client->step_pending--;
+    store_extent_put(&client->extent);
+    if (cqe->res < 0) {
+        if (client->step_error == 0) {
+            client->step_error = -cqe->res;
+        }
+        client->slot_len -= client->read_len;
+    } else {
+        client->slot_len -= client->read_len - cqe->res;
+    }
+}
+
+static void uring_handle_send(struct uring_client *client, const struct io_uring_cqe *cqe) {
+    client->inflight--;
+    client->step_pending--;
+    if (cqe->res > 0) {
+        client->slot_sent += cqe->res;
+        if (!client->closing) {
+            connection_output_sent(&client->conn, cqe->res);
+        }
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED && client->step_error == 0) {
+        client->step_error = -cqe->res;
+    }
+}
+
+// A multishot request failing with -EINVAL before any has completed with
+// more to come means the kernel does not take the flag, not that the client
+// or listener is at fault: the loop switches to single-shot requests.
+static bool uring_multishot_rejected(struct uring_loop *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        loop->multishot_seen = true;
+        return false;
+    }
+    if (cqe->res != -EINVAL || !loop->multishot || loop->multishot_seen) {
+        return false;
+    }
+    log_message(LOG_WARNING, "Multishot io_uring requests are not supported, rearming them per completion");
+    loop->multishot = false;
+    return true;
+}
+
+static void uring_handle_recv(struct uring_client *client, const struct io_uring_cqe *cqe) {
+    struct uring_loop *loop = client->loop;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        client->inflight--;
+        client->recv_armed = false;
+        client->recv_cancelling = false;
+    }
+    if (uring_multishot_rejected(loop, cqe)) {
+        uring_client_progress(client);
+        return;
+    }
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        log_message(LOG_DEBUG, "Received %d bytes of data", cqe->res);
+        int status = client->closing ? CONN_OK
+                     : connection_receive(&client->conn, loop->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE,
+                                          cqe->res);
+        uring_recycle_buffer(loop, bid);
+        if (status == CONN_ERROR) {
+            uring_close_client(client);
+            return;
+        }
+    } else if (cqe->res == 0) {
+        client->conn.input_ended = true; // Closed by uring_client_progress() once it is answered
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        log_message(LOG_ERR, "Failed to receive data: %s", strerror(-cqe->res));
+        uring_close_client(client);
+        return;
+    }
+    uring_client_progress(client);
+}
+
+// Carry on with held-back input, start sending, and adjust the recv to the
+// output queue
+static void uring_client_progress(struct uring_client *client) {
+    struct connection *conn = &client->conn;
+    if (client->closing) {
+        return;
+    }
+    if (connection_resume_input(conn) == CONN_ERROR) {
+        uring_close_client(client);
+        return;
+    }
+    if (conn->input_ended && !conn->append_pending && !connection_input_pending(conn)) {
+        connection_end_input(conn);
+        if (conn->output_count == 0 && client->slot < 0) {
+            uring_close_client(client);
+            return;
+        }
+    }
+    uring_send_next(client);
+    uring_update_recv(client);
+}
+
+static void uring_handle_accept(struct uring_loop *loop, const struct io_uring_cqe *cqe, enum uring_tag tag) {
+    bool rejected = uring_multishot_rejected(loop, cqe);
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->stopping && (cqe->res != -EINVAL || rejected)) {
+        uring_arm_accept(loop, tag);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED && !rejected) {
+            log_message(LOG_ERR, "Failed to accept connection: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+    // Accepts racing the cancel are served like any other in-flight client
+    int client_socket = cqe->res;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    if (getpeername(client_socket, (struct sockaddr *)&client_addr, &client_addr_len) == -1) {
+        memset(&client_addr, 0, sizeof(client_addr));
+    }
+    struct uring_client *client = slab_alloc(&client_cache);
+    if (!client) {
+        log_message(LOG_ERR, "Memory allocation failed");
+        close(client_socket);
+        return;
+    }
+    memset(client, 0, sizeof(*client));
+    client->loop = loop;
+    client->slot = -1;
+    if (connection_open(&client->conn, client_socket, (struct sockaddr *)&client_addr) != 0) {
+        connection_close(&client->conn);
+        slab_free(&client_cache, client);
+        return;
+    }
+    client->conn.completions = &loop->completions;
+    LIST_INSERT_HEAD(&loop->connections, &client->conn, entries);
+    uring_arm_recv(client);
+}
+
+// Poll the append eventfd once; rearmed after each wakeup is handled
+static void uring_arm_appends(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->completions.event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uintptr_t)uring_tagged(loop, URING_TAG_APPEND);
+}
+
+// Finish the appends the committer has released: carry on with their
+// clients, or free those that were closed meanwhile
+static void uring_complete_appends(struct uring_loop *loop) {
+    uint64_t count;
+    if (read(loop->completions.event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_message(LOG_ERR, "Failed to read append eventfd: %s", strerror(errno));
+    }
+    struct store_append *append = store_completions_take(&loop->completions);
+    while (append) {
+        struct store_append *next = append->next;
+        struct uring_client *client =
+            (struct uring_client *)((char *)append - offsetof(struct uring_client, conn.append));
+        if (connection_append_done(&client->conn) == CONN_ERROR) {
+            uring_close_client(client);
+        } else {
+            uring_client_progress(client);
+        }
+        uring_reap_client(client);
+        append = next;
+    }
+    uring_arm_appends(loop);
+}
+
+// Close every client; each is freed once its requests have completed
+static void uring_close_all(struct uring_loop *loop) {
+    struct connection *conn = LIST_FIRST(&loop->connections);
+    while (conn) {
+        struct connection *next = LIST_NEXT(conn, entries);
+        struct uring_client *client = (struct uring_client *)conn;
+        uring_close_client(client);
+        uring_reap_client(client);
+        conn = next;
+    }
+}
+
+// Shutdown requested: stop accepting, and close the clients still open when
+// the drain deadline passes
+static void uring_stop(struct uring_loop *loop) {
+    loop->stopping = true;
+    uring_cancel(&loop->ring, uring_tagged(loop, URING_TAG_ACCEPT));
+    if (loop->local_socket != -1) {
+        uring_cancel(&loop->ring, uring_tagged(loop, URING_TAG_LOCAL_ACCEPT));
+    }
+    if (loop->drain_timeout_ms == 0) {
+        uring_close_all(loop);
+        return;
+    }
+    loop->drain_timeout.tv_sec = loop->drain_timeout_ms / 1000;
+    loop->drain_timeout.tv_nsec = (loop->drain_timeout_ms % 1000) * 1000000L;
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->drain_timeout;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)uring_tagged(loop, URING_TAG_DEADLINE);
+}
+
+// Poll the timestamp timer once; rearmed after each expiry is handled
+static void uring_arm_timer(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->timer_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uintptr_t)uring_tagged(loop, URING_TAG_TIMER);
+}
+
+static void uring_dispatch(struct uring_loop *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->user_data == 0) {
+        return;
+    }
+    enum uring_tag tag = cqe->user_data & URING_TAG_MASK;
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+    if (tag == URING_TAG_ACCEPT || tag == URING_TAG_LOCAL_ACCEPT) {
+        uring_handle_accept(loop, cqe, tag);
+        return;
+    }
+    if (tag == URING_TAG_WAKE) {
+        uring_stop(loop);
+        return;
+    }
+    if (tag == URING_TAG_DEADLINE) {
+        if (!LIST_EMPTY(&loop->connections)) {
+            log_message(LOG_INFO, "Drain deadline passed, closing the remaining connections");
+        }
+        uring_close_all(loop);
+        return;
+    }
+    if (tag == URING_TAG_APPEND) {
+        uring_complete_appends(loop);
+        return;
+    }
+    if (tag == URING_TAG_TIMER) {
+        if (!loop->stopping) {
+            timestamp_timer_fire(loop->timer_fd);
+            uring_arm_timer(loop);
+        }
+        return;
+    }
+
+    struct uring_client *client = ptr;
+    switch (tag) {
+        case URING_TAG_RECV:
+            uring_handle_recv(client, cqe);
+            break;
+        case URING_TAG_READ:
+        case URING_TAG_SEND:
+            if (tag == URING_TAG_READ) {
+                uring_handle_read(client, cqe);
+            } else {
+                uring_handle_send(client, cqe);
+            }
+            if (client->step_pending == 0) {
+                uring_send_step_done(client);
+            }
+            break;
+        case URING_TAG_PACE:
+            client->inflight--;
+            client->pace_armed = false;
+            uring_client_progress(client);
+            break;
+        default:
+            break;
+    }
+    uring_reap_client(client);
+}
+
+// Thread function: reap completions until stopped and every client is gone
+static void *uring_loop_func(void *arg) {
+    struct uring_loop *loop = arg;
+    struct uring_ring *ring = &loop->ring;
+
+    uring_arm_accept(loop, URING_TAG_ACCEPT);
+    if (loop->local_socket != -1) {
+        uring_arm_accept(loop, URING_TAG_LOCAL_ACCEPT);
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uintptr_t)uring_tagged(loop, URING_TAG_WAKE);
+    if (loop->timer_fd != -1) {
+        uring_arm_timer(loop);
+    }
+    uring_arm_appends(loop);
+
+    while (!loop->stopping || !LIST_EMPTY(&loop->connections)) {
+        if (uring_submit(ring, true) != 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            log_message(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = atomic_load_explicit((_Atomic unsigned int *)ring->cq_tail, memory_order_acquire);
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            head++;
+            atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head, memory_order_release);
+            uring_dispatch(loop, &cqe);
+        }
+    }
+
+    // Only reached early on a ring failure: drop whatever is left
+    while (!LIST_EMPTY(&loop->connections)) {
+        struct connection *conn = LIST_FIRST(&loop->connections);
+        LIST_REMOVE(conn, entries);
+        connection_close(conn);
+        slab_free(&client_cache, conn);
+    }
+    return NULL;
+}
+
+// Map the rings of a new io_uring instance. Returns -1 if the kernel does
+// not support io_uring or lacks a feature this mode relies on.
+static int uring_ring_open(struct uring_ring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    // Sockets must be polled rather than punted to worker threads, and
+    // completions must not be dropped on overflow
+    unsigned int required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required) {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > ring->sq_map_len) {
+        ring->sq_map_len = cq_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_map = ring->sq_map; // One mapping holds both rings
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_len);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->unsubmitted = 0;
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_ring_close(struct uring_ring *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+// True if the kernel implements every operation this mode submits
+static bool uring_ops_supported(int ring_fd) {
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ,
+        IORING_OP_READ_FIXED, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT,
+    };
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (!probe) {
+        return false;
+    }
+    bool supported = uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+// Post a multishot recv and a multishot accept on throwaway sockets, then
+// cancel them. A kernel that has the opcodes but not the multishot flags
+// (recv needs 6.0, accept 5.19) fails them with -EINVAL instead.
+static bool uring_multishot_supported(struct uring_loop *loop) {
+    struct uring_ring *ring = &loop->ring;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+        return false;
+    }
+    struct sockaddr_un autobind = { .sun_family = AF_UNIX };
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool supported = listener != -1 &&
+                     bind(listener, (struct sockaddr *)&autobind, sizeof(sa_family_t)) == 0 &&
+                     listen(listener, 1) == 0;
+    if (supported) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pair[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = URING_TAG_RECV;
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = URING_TAG_ACCEPT;
+        uring_cancel(ring, (void *)URING_TAG_RECV);
+        uring_cancel(ring, (void *)URING_TAG_ACCEPT);
+    }
+    int pending = supported ? 2 : 0;
+    while (pending > 0) {
+        if (uring_submit(ring, true) != 0 && errno != EINTR) {
+            supported = false;
+            break;
+        }
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = atomic_load_explicit((_Atomic unsigned int *)ring->cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            if (cqe->user_data != 0 && !(cqe->flags & IORING_CQE_F_MORE)) {
+                pending--;
+                supported = supported && cqe->res != -EINVAL;
+            }
+        }
+        atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head, memory_order_release);
+    }
+    if (listener != -1) {
+        close(listener);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return supported;
+}
+
+static void uring_loop_free(struct uring_loop *loop) {
+    if (loop->recv_ring) {
+        munmap(loop->recv_ring, loop->recv_ring_len);
+    }
+    free(loop->recv_buffers);
+    free(loop->send_buffers);
+    if (loop->completions.event_fd != -1) {
+        close(loop->completions.event_fd);
+    }
+    uring_ring_close(&loop->ring);
+    if (loop->listener_owned) {
+        close(loop->server_socket);
+    }
+}
+
+// Set up a loop's ring with its provided receive buffers and send slots
+static int uring_loop_init(struct uring_loop *loop, int server_socket, int wake_fd) {
+    loop->server_socket = server_socket;
+    loop->local_socket = -1;
+    loop->wake_fd = wake_fd;
+    loop->timer_fd = -1;
+    loop->drain_timeout_ms = 0;
+    LIST_INIT(&loop->connections);
+    TAILQ_INIT(&loop->slot_waiters);
+    store_completions_init(&loop->completions, -1);
+    if (uring_ring_open(&loop->ring) != 0) {
+        return -1;
+    }
+    if (!uring_ops_supported(loop->ring.fd)) {
+        uring_ring_close(&loop->ring);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // Receive buffers are handed to the kernel through a buffer ring and
+    // picked per completion, so idle clients hold none
+    loop->recv_ring_len = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    loop->recv_ring = mmap(NULL, loop->recv_ring_len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    loop->recv_buffers = aligned_alloc(page_size, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    loop->send_buffers = aligned_alloc(page_size, (size_t)URING_SEND_SLOTS * URING_SEND_SLOT_SIZE);
+    if (loop->recv_ring == MAP_FAILED || !loop->recv_buffers || !loop->send_buffers) {
+        if (loop->recv_ring == MAP_FAILED) {
+            loop->recv_ring = NULL;
+        }
+        uring_loop_free(loop);
+        errno = ENOMEM;
+        return -1;
+    }
+    loop->completions.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->completions.event_fd == -1) {
+        int error = errno;
+        uring_loop_free(loop);
+        errno = error;
+        return -1;
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)loop->recv_ring,
+        .ring_entries = URING_RECV_BUFFERS,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        uring_loop_free(loop);
+        return -1;
+    }
+    for (unsigned int bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+        uring_recycle_buffer(loop, bid);
+    }
+    loop->multishot = true;
+    if (!uring_multishot_supported(loop)) {
+        uring_loop_free(loop);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // Registered send slots spare the kernel pinning pages on every read;
+    // without them (e.g. RLIMIT_MEMLOCK too low) reads use plain buffers
+    struct iovec slots[URING_SEND_SLOTS];
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        slots[i].iov_base = loop->send_buffers + (size_t)i * URING_SEND_SLOT_SIZE;
+        slots[i].iov_len = URING_SEND_SLOT_SIZE;
+        loop->free_slots[i] = URING_SEND_SLOTS - 1 - i;
+    }
+    loop->free_count = URING_SEND_SLOTS;
+    loop->fixed_buffers = uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, slots, URING_SEND_SLOTS) == 0;
+    if (!loop->fixed_buffers) {
+        log_message(LOG_INFO, "Could not register io_uring send buffers: %s", strerror(errno));
+    }
+    return 0;
+}
+
+// Run the io_uring server until SIGINT/SIGTERM. Every loop posts its own
+// multishot accept, on its own SO_REUSEPORT listener when listen_shards is
+// set or on the shared listening socket otherwise, plus one on the shared
+// Unix-domain listener with -U, and keeps the clients it accepts. Falls back to epoll_server_run() if io_uring is unavailable.
+int uring_server_run(int server_socket, const struct server_options *options) {
+    int num_threads = server_thread_count(options);
+    struct uring_loop *loops = calloc(num_threads, sizeof(*loops));
+    if (!loops) {
+        log_message(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    if (uring_loop_init(&loops[0], server_socket, -1) != 0) {
+        log_message(LOG_WARNING, "io_uring unavailable (%s), using epoll mode", strerror(errno));
+        free(loops);
+        return epoll_server_run(server_socket, options);
+    }
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        log_message(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        uring_loop_free(&loops[0]);
+        free(loops);
+        return -1;
+    }
+    loops[0].wake_fd = wake_fd;
+    loops[0].timer_fd = options->timestamp_fd;
+    loops[0].drain_timeout_ms = options->drain_timeout_ms;
+    loops[0].local_socket = options->local_socket;
+
+    // Signals are handled here, loop threads only wake through wake_fd
+    sigset_t block_mask, old_mask;
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+
+    int started = 0;
+    for (; started < num_threads; started++) {
+        struct uring_loop *loop = &loops[started];
+        if (started > 0) {
+            int listener = server_socket;
+            if (options->listen_shards > 1 && (listener = server_listen(options)) == -1) {
+                break;
+            }
+            if (uring_loop_init(loop, listener, wake_fd) != 0) {
+                log_message(LOG_ERR, "Failed to set up io_uring: %s", strerror(errno));
+                if (listener != server_socket) {
+                    close(listener);
+                }
+                break;
+            }
+            loop->listener_owned = listener != server_socket;
+            loop->drain_timeout_ms = options->drain_timeout_ms;
+            loop->local_socket = options->local_socket;
+        }
+        if (pthread_create(&loop->thread_id, NULL, uring_loop_func, loop) != 0) {
+            log_message(LOG_ERR, "Failed to create io_uring loop thread");
+            uring_loop_free(loop);
+            break;
+        }
+        server_pin_thread(loop->thread_id, started);
+        if (options->listen_shards > 1) {
+            cpu_steer_listener(loop->server_socket, started);
+        }
+    }
+    log_message(LOG_INFO, "Started %d io_uring loop thread(s)", started);
+
+    // Wait for shutdown, then wake every loop (wake_fd stays readable)
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (started > 0) {
+        server_wait_shutdown();
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        log_message(LOG_ERR, "Failed to wake io_uring loops: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread_id, NULL);
+        uring_loop_free(&loops[i]);
+    }
+    free(loops);
+    close(wake_fd);
+    return started == num_threads ? 0 : -1;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // For accept4, MSG_MORE and MSG_CMSG_CLOEXEC
 #include <signal.h>     // For signal handling
 #include <stdio.h>      // For standard I/O functions
 #include <stdlib.h>     // For standard library functions
@@ -7,6 +8,7 @@
 #include <sys/types.h>  // For data types used in system calls
 #include <sys/socket.h> // For socket API
 #include <netinet/in.h> // For Internet address family
+#include <netinet/tcp.h> // For TCP_CORK
 #include <arpa/inet.h>  // For definitions for internet operations
 #include <syslog.h>     // For system logging
 #include <fcntl.h>      // For file control options
@@ -15,29 +17,31 @@
 #include <time.h>       // For time functions
 #include <sys/queue.h>  // For queue functions
 #include <sys/time.h>   // For struct timeval
-#include <sys/ioctl.h> // For ioctl
-#include "../aesd-char-driver/aesd_ioctl.h" // For AESDCHAR_IOCSEEKTO
+#include <sys/sendfile.h> // For sendfile
+#include <sys/uio.h>    // For struct iovec
+#include <sys/timerfd.h> // For timerfd_create
+#include <poll.h>       // For poll
+#include <sys/eventfd.h> // For eventfd
+#include <sys/un.h>     // For struct sockaddr_un
+#include <stddef.h>     // For offsetof
 
-#define PORT 9000       // Port number to listen on
-#define BACKLOG 10      // Number of pending connections in the listen queue
-#ifndef USE_AESD_CHAR_DEVICE
-#define USE_AESD_CHAR_DEVICE 1
-#endif
+#include "aesdsocket-protocol.h"
 
-#if USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
-#else
-#define DATA_FILE "/var/tmp/aesdsocketdata" // File to store data
-#endif
-#define TIMESTAMP_INTERVAL 10
-#define BUFFER_SIZE 1024
+#include "aesdsocket.h"
 
 // Global variables
-volatile sig_atomic_t running_signal = 1; // Used only in signal handler
-bool running = true; // Used in threads, protected by mutex
-pthread_mutex_t running_mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t running_signal = 1; // Cleared once shutdown is requested
+static int shutdown_fd = -1;               // eventfd, readable once shutdown is requested
+
+// Every listening socket of this process, handed to a successor on request
+static int listeners[LISTENERS_MAX];
+static int listener_count;
+static int inherited[LISTENERS_MAX];       // Taken over from a predecessor, used by server_listen()
+static int inherited_count;
+static int handoff_socket = -1;            // Waiting for a successor, see -H
+static int handoff_client = -1;            // Successor holding our listeners, closed once we are done
+static int inherited_local = -1;           // Unix-domain listener taken over from a predecessor
 
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex to protect file access
 #include <search.h> // For hsearch, hcreate, hdestroy
 
 pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -45,127 +49,1186 @@ pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
 // Thread entry structure for managing active threads
 struct thread_entry {
     pthread_t thread_id;
+    bool done;                         // Finished serving, ready to join; protected by list_mutex
     SLIST_ENTRY(thread_entry) entries;
 };
 SLIST_HEAD(thread_list, thread_entry) head = SLIST_HEAD_INITIALIZER(head);
 
+struct slab_cache connection_cache = SLAB_CACHE("connection", sizeof(struct connection),
+                                                _Alignof(struct connection), SLAB_CACHED_MAX);
+static struct slab_cache thread_entry_cache = SLAB_CACHE("thread_entry", sizeof(struct thread_entry),
+                                                         _Alignof(struct thread_entry), SLAB_CACHED_MAX);
+
+// Ask every server loop to stop accepting and drain; async-signal-safe
+void server_request_shutdown(void) {
+    int saved_errno = errno;
+    running_signal = 0;
+    uint64_t one = 1;
+    if (shutdown_fd != -1 && write(shutdown_fd, &one, sizeof(one)) == -1) {
+        // Already readable when the counter is saturated
+    }
+    errno = saved_errno;
+}
+
 // Signal handler to set shutdown flag for graceful termination
 void signal_handler(int signal) {
-    running_signal = 0;
+    server_request_shutdown();
 }
 
-// Thread function: handles a single client connection
-void *client_handler(void *arg) {
-    // Unpack client info from argument
-    struct {
-        int client_socket;
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len;
-    } *client_info = arg;
-    int client_socket = client_info->client_socket;
-    struct sockaddr_in client_addr = client_info->client_addr;
-    free(client_info);
-
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    syslog(LOG_INFO, "Accepted connection from: %s, port: %d", client_ip, ntohs(client_addr.sin_port));
-    int data_fd;
+// Record the client address for logs and stats; IPv4 clients of the
+// dual-stack listener are shown without their ::ffff: mapping
+static void connection_format_address(struct connection *conn, const struct sockaddr *client_addr) {
+    if (client_addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)client_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+            inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], conn->client_ip, sizeof(conn->client_ip));
+        } else {
+            inet_ntop(AF_INET6, &addr6->sin6_addr, conn->client_ip, sizeof(conn->client_ip));
+        }
+        conn->client_port = ntohs(addr6->sin6_port);
+    } else if (client_addr->sa_family == AF_INET) {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)client_addr;
+        inet_ntop(AF_INET, &addr4->sin_addr, conn->client_ip, sizeof(conn->client_ip));
+        conn->client_port = ntohs(addr4->sin_port);
+    } else {
+        snprintf(conn->client_ip, sizeof(conn->client_ip), "unknown");
+        conn->client_port = 0;
+    }
+}
 
-    // Main receive loop for this client
-    // Keep the file descriptor open for the entire session
-    data_fd = open(DATA_FILE, O_RDWR | O_APPEND
-#if !USE_AESD_CHAR_DEVICE
-        | O_CREAT
+// Identify a client of the Unix socket by the credentials its process had
+// when it connected. The uid stands in for the address, so the per-address
+// limit (-c) applies per user, and the pid for the port.
+static void connection_read_peer(struct connection *conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn->client_socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        log_message(LOG_WARNING, "Failed to read peer credentials: %s", strerror(errno));
+        cred.pid = 0;
+        cred.uid = (uid_t)-1;
+        cred.gid = (gid_t)-1;
+    }
+    conn->peer_pid = cred.pid;
+    conn->peer_uid = cred.uid;
+    conn->peer_gid = cred.gid;
+    snprintf(conn->client_ip, sizeof(conn->client_ip), "uid/%u", (unsigned int)cred.uid);
+    conn->client_port = cred.pid;
+}
+
+// Initialize connection state for an accepted client and open the data file/device
+int connection_open(struct connection *conn, int client_socket, const struct sockaddr *client_addr) {
+    conn->client_socket = client_socket;
+    conn->output_head = 0;
+    conn->output_count = 0;
+    conn->output_bytes = 0;
+    conn->output_throttled = false;
+    conn->echo_enabled = true;
+    conn->protocol = PROTOCOL_UNKNOWN;
+    memset(&conn->rx_chain, 0, sizeof(conn->rx_chain));
+    conn->rx_buffer = NULL;
+    conn->rx_len = 0;
+    conn->rx_capacity = 0;
+    conn->echo_total = 0;
+    conn->zero_copy = true;
+    conn->rx_time = 0;
+    conn->deferred = false;
+    conn->corked = false;
+    conn->completions = NULL;
+    conn->append_pending = false;
+    conn->append_buffer = NULL;
+    conn->append_capacity = 0;
+    conn->closing = false;
+    conn->input_ended = false;
+    conn->incoming_cpu = cpu_incoming(client_socket);
+    conn->local = client_addr->sa_family == AF_UNIX;
+    if (conn->local) {
+        connection_read_peer(conn);
+        log_message(LOG_INFO, "Accepted local connection from pid %d, uid %u, gid %u", (int)conn->peer_pid,
+                    (unsigned int)conn->peer_uid, (unsigned int)conn->peer_gid);
+    } else {
+        connection_format_address(conn, client_addr);
+        log_message(LOG_INFO, "Accepted connection from: %s, port: %d", conn->client_ip, conn->client_port);
+    }
+    config_socket_setup(client_socket, !conn->local);
+    metrics_connection_opened(conn);
+
+    // Keep a device descriptor open for the entire session, since seeks on
+    // it are per open file; appends go through the store, and in file mode
+    // reads go to the store's segment files
+    conn->data_fd = -1;
+    if (!limit_admit(conn)) {
+        return -1;
+    }
+#if USE_AESD_CHAR_DEVICE
+    conn->data_fd = open(store_data_path(), O_RDONLY);
+    if (conn->data_fd == -1) {
+        log_message(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        return -1;
+    }
 #endif
-        , 0644);
-    if (data_fd == -1) {
-        syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
-        return NULL;
-    }
-
-    while ((bytes_received = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
-        syslog(LOG_INFO, "Received %zd bytes of data", bytes_received);
-        // Lock file access to ensure thread safety
-        pthread_mutex_lock(&file_mutex);
-
-        // Check if this is a seek command
-        if (bytes_received > 16 && strncmp(buffer, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
-            // Parse X,Y values
-            unsigned int cmd_num, cmd_offset;
-            if (sscanf(buffer + 19, "%u,%u", &cmd_num, &cmd_offset) == 2) {
-                struct aesd_seekto seekto;
-                seekto.write_cmd = cmd_num;
-                seekto.write_cmd_offset = cmd_offset;
-                
-                // Perform the ioctl
-                if (ioctl(data_fd, AESDCHAR_IOCSEEKTO, &seekto) != 0) {
-                    syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
-                } else {
-                    syslog(LOG_INFO, "Successfully performed seek to command %u offset %u", 
-                           cmd_num, cmd_offset);
-                }
-                
-                // Read and send back the content from the current position (already set by IOCTL)
-                ssize_t bytes_read;
-                while ((bytes_read = read(data_fd, buffer, sizeof(buffer))) > 0) {
-                    ssize_t bytes_sent = send(client_socket, buffer, bytes_read, 0);
-                    if (bytes_sent < 0) {
-                        syslog(LOG_ERR, "Failed to send data: %s", strerror(errno));
-                        break;
-                    }
+    return 0;
+}
+
+static int connection_store_records(struct connection *conn, size_t len, bool complete);
+
+// Release an input buffer: an I/O buffer from the cache while it fits in
+// one, a heap block once a large frame has outgrown it
+static void connection_free_buffer(char *buffer, size_t capacity) {
+    if (capacity == rx_segment_size) {
+        slab_free(&io_buffer_cache, buffer);
+    } else {
+        free(buffer);
+    }
+}
+
+static void connection_free_input(struct connection *conn) {
+    connection_free_buffer(conn->rx_buffer, conn->rx_capacity);
+    conn->rx_buffer = NULL;
+    conn->rx_capacity = 0;
+}
+
+// Wait for an append still in flight, store any unterminated record, then
+// release the data file/device and client socket of a connection
+void connection_close(struct connection *conn) {
+    if (conn->append_pending) {
+        store_append_wait(&conn->append);
+        connection_append_done(conn);
+    }
+    conn->completions = NULL;
+    if (conn->rx_chain.length > 0) {
+        connection_store_records(conn, conn->rx_chain.length, false);
+    }
+    rx_chain_free(&conn->rx_chain);
+    for (unsigned int i = 0; i < conn->output_count; i++) {
+        struct output_range *range = &conn->output[(conn->output_head + i) % OUTPUT_QUEUE_LEN];
+        free(range->prefix_heap);
+        store_snapshot_put(range->snapshot);
+    }
+    conn->output_count = 0;
+    limit_release(conn);
+    metrics_connection_closed(conn);
+    if (conn->data_fd != -1) {
+        close(conn->data_fd);
+        conn->data_fd = -1;
+    }
+    connection_free_input(conn);
+    close(conn->client_socket);
+    log_message(LOG_INFO, "Closed connection from: %s", conn->client_ip);
+}
+
+// Recompute whether the client may send more input: throttle at the high
+// watermark (or a nearly full queue) and release only once below the low watermark
+static void connection_update_throttle(struct connection *conn) {
+    if (conn->output_count > OUTPUT_QUEUE_LEN - OUTPUT_QUEUE_RESERVE ||
+        conn->output_bytes >= atomic_load_explicit(&tunables.output_high_watermark, memory_order_relaxed)) {
+        conn->output_throttled = true;
+    } else if (conn->output_bytes <= atomic_load_explicit(&tunables.output_low_watermark, memory_order_relaxed)) {
+        conn->output_throttled = false;
+    }
+}
+
+// Queue prefix_len bytes followed by the data range [offset, end), read from
+// snapshot in char device mode. The entry takes over the snapshot reference.
+static int connection_queue_snapshot(struct connection *conn, const void *prefix, size_t prefix_len,
+                                     off_t offset, off_t end, struct echo_snapshot *snapshot) {
+    if (end < offset) {
+        end = offset;
+    }
+    if (prefix_len == 0 && end == offset) {
+        store_snapshot_put(snapshot);
+        return CONN_OK;
+    }
+    if (conn->output_count == OUTPUT_QUEUE_LEN) {
+        log_message(LOG_ERR, "Output queue overflow for %s", conn->client_ip);
+        store_snapshot_put(snapshot);
+        return CONN_ERROR;
+    }
+    unsigned int tail = (conn->output_head + conn->output_count) % OUTPUT_QUEUE_LEN;
+    struct output_range *range = &conn->output[tail];
+    range->prefix_heap = NULL;
+    if (prefix_len > OUTPUT_PREFIX_MAX) {
+        range->prefix_heap = malloc(prefix_len);
+        if (!range->prefix_heap) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            store_snapshot_put(snapshot);
+            return CONN_ERROR;
+        }
+    }
+    range->offset = offset;
+    range->end = end;
+    range->snapshot = snapshot;
+    range->framed = prefix_len > 0;
+    range->prefix_len = prefix_len;
+    range->prefix_sent = 0;
+    range->queued_ns = conn->rx_time;
+    if (prefix_len > 0) {
+        memcpy(range->prefix_heap ? range->prefix_heap : range->prefix, prefix, prefix_len);
+    }
+    conn->output_count++;
+    conn->output_bytes += prefix_len + (end - offset);
+    metrics_queued(conn, prefix_len + (end - offset));
+    connection_update_throttle(conn);
+    return CONN_OK;
+}
+
+// Queue prefix_len bytes followed by the data file range [offset, end), sent
+// as one unit that must complete (a binary protocol reply or a stats report).
+// The char device's data is copied now, since later appends move it: a
+// non-empty range must be queued under store_read_lock().
+int connection_queue_reply(struct connection *conn, const void *prefix, size_t prefix_len,
+                           off_t offset, off_t end) {
+    return connection_queue_snapshot(conn, prefix, prefix_len, offset, end,
+                                     end > offset ? store_snapshot_get() : NULL);
+}
+
+// Queue the data file range [offset, end) for sending to the client
+static void connection_queue_output(struct connection *conn, off_t offset, off_t end) {
+    connection_queue_reply(conn, NULL, 0, offset, end);
+}
+
+// Queue count commands starting at command first
+static void connection_queue_commands(struct connection *conn, uint32_t first, uint32_t count) {
+    off_t start, end;
+    if (store_command_range(conn->data_fd, first, count, &start, &end) != 0) {
+        log_message(LOG_ERR, "No commands in range %u,%u: %s", first, count, strerror(errno));
+        return;
+    }
+    connection_queue_output(conn, start, end);
+}
+
+// Execute a command at the start of buffer. Returns false if buffer does not
+// hold a well-formed command, in which case it is treated as data.
+static bool connection_run_command(struct connection *conn, const char *buffer, size_t len) {
+    unsigned int x, y;
+    unsigned long long offset, length;
+
+    // Check if this is a seek command
+    if (len > SEEKTO_COMMAND_LEN && strncmp(buffer, SEEKTO_COMMAND, SEEKTO_COMMAND_LEN) == 0) {
+        // Parse X,Y values
+        if (sscanf(buffer + SEEKTO_COMMAND_LEN, "%u,%u", &x, &y) != 2) {
+            return false;
+        }
+        struct aesd_seekto seekto;
+        seekto.write_cmd = x;
+        seekto.write_cmd_offset = y;
+
+        // Perform the ioctl, or the command index lookup in file mode
+        off_t position;
+        if (store_seekto(conn->data_fd, &seekto, &position) != 0) {
+            log_message(LOG_ERR, "AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+            position = store_start();
+        } else {
+            log_message(LOG_DEBUG, "Successfully performed seek to command %u offset %u", x, y);
+        }
+
+        // Send back the content from the sought position
+        connection_queue_output(conn, position, store_length());
+        return true;
+    }
+    if (len > COMMAND_LEN(READRANGE_COMMAND) &&
+        strncmp(buffer, READRANGE_COMMAND, COMMAND_LEN(READRANGE_COMMAND)) == 0) {
+        if (sscanf(buffer + COMMAND_LEN(READRANGE_COMMAND), "%llu,%llu", &offset, &length) != 2) {
+            return false;
+        }
+        off_t data_length = store_length();
+        off_t start = offset < (unsigned long long)data_length ? (off_t)offset : data_length;
+        if (start < store_start()) {
+            start = store_start();
+        }
+        off_t end = length < (unsigned long long)(data_length - start) ? start + (off_t)length : data_length;
+        connection_queue_output(conn, start, end);
+        return true;
+    }
+    if (len > COMMAND_LEN(READCMDS_COMMAND) &&
+        strncmp(buffer, READCMDS_COMMAND, COMMAND_LEN(READCMDS_COMMAND)) == 0) {
+        if (sscanf(buffer + COMMAND_LEN(READCMDS_COMMAND), "%u,%u", &x, &y) != 2) {
+            return false;
+        }
+        connection_queue_commands(conn, x, y);
+        return true;
+    }
+    if (len > COMMAND_LEN(TAIL_COMMAND) &&
+        strncmp(buffer, TAIL_COMMAND, COMMAND_LEN(TAIL_COMMAND)) == 0) {
+        if (sscanf(buffer + COMMAND_LEN(TAIL_COMMAND), "%u", &x) != 1) {
+            return false;
+        }
+        uint32_t count = store_command_count(conn->data_fd);
+        if (x > 0 && count > 0) {
+            connection_queue_commands(conn, count > x ? count - x : 0, x);
+        }
+        return true;
+    }
+    if (len >= COMMAND_LEN(STATS_COMMAND) &&
+        strncmp(buffer, STATS_COMMAND, COMMAND_LEN(STATS_COMMAND)) == 0 &&
+        strchr("\r\n", buffer[COMMAND_LEN(STATS_COMMAND)])) {
+        char *text;
+        ssize_t text_len = metrics_format(conn, &text);
+        if (text_len < 0) {
+            log_message(LOG_ERR, "Failed to format stats for %s", conn->client_ip);
+            return true;
+        }
+        connection_queue_reply(conn, text, text_len, 0, 0);
+        free(text);
+        return true;
+    }
+    if (len > COMMAND_LEN(ECHO_COMMAND) &&
+        strncmp(buffer, ECHO_COMMAND, COMMAND_LEN(ECHO_COMMAND)) == 0) {
+        if (sscanf(buffer + COMMAND_LEN(ECHO_COMMAND), "%u", &x) != 1) {
+            return false;
+        }
+        conn->echo_enabled = x != 0;
+        log_message(LOG_INFO, "Echo %s for %s", conn->echo_enabled ? "enabled" : "disabled", conn->client_ip);
+        return true;
+    }
+    return false;
+}
+
+// Run a command with appends held off, so the offsets it looks up and the
+// data it queues describe the same char device contents
+static bool connection_handle_command(struct connection *conn, const char *buffer, size_t len) {
+    store_read_lock();
+    bool handled = connection_run_command(conn, buffer, len);
+    store_read_unlock();
+    return handled;
+}
+
+// Make room for at least len more bytes of input in conn->rx_buffer
+static int connection_reserve_input(struct connection *conn, size_t len) {
+    if (conn->rx_len + len > conn->rx_capacity) {
+        size_t capacity = conn->rx_capacity ? conn->rx_capacity : rx_segment_size;
+        while (capacity < conn->rx_len + len) {
+            capacity *= 2;
+        }
+        char *rx_buffer = capacity == rx_segment_size ? slab_alloc(&io_buffer_cache) : malloc(capacity);
+        if (!rx_buffer) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            return CONN_ERROR;
+        }
+        if (conn->rx_len > 0) {
+            memcpy(rx_buffer, conn->rx_buffer, conn->rx_len);
+        }
+        connection_free_input(conn);
+        conn->rx_buffer = rx_buffer;
+        conn->rx_capacity = capacity;
+    }
+    return CONN_OK;
+}
+
+// Hold len bytes of input in conn->rx_buffer until they can be parsed
+int connection_buffer_input(struct connection *conn, const char *data, size_t len) {
+    if (connection_reserve_input(conn, len) != CONN_OK) {
+        return CONN_ERROR;
+    }
+    memcpy(conn->rx_buffer + conn->rx_len, data, len);
+    conn->rx_len += len;
+    return CONN_OK;
+}
+
+// Copy len bytes of text input into the rx chain
+static int connection_chain_input(struct connection *conn, const char *data, size_t len) {
+    while (len > 0) {
+        size_t space;
+        char *dst = rx_chain_space(&conn->rx_chain, &space);
+        if (!dst) {
+            return CONN_ERROR;
+        }
+        size_t chunk = len < space ? len : space;
+        memcpy(dst, data, chunk);
+        rx_chain_commit(&conn->rx_chain, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+    return CONN_OK;
+}
+
+// Where the next recv() should place its data, and how much fits there.
+// Text goes straight into the rx chain and binary frames into rx_buffer,
+// so neither is copied again before it is parsed.
+char *connection_rx_space(struct connection *conn, size_t *space) {
+    switch (conn->protocol) {
+        case PROTOCOL_TEXT:
+            return rx_chain_space(&conn->rx_chain, space);
+        case PROTOCOL_BINARY:
+            if (connection_reserve_input(conn, BUFFER_SIZE) != CONN_OK) {
+                return NULL;
+            }
+            *space = conn->rx_capacity - conn->rx_len;
+            return conn->rx_buffer + conn->rx_len;
+        default:
+            *space = BUFFER_SIZE;
+            return conn->buffer;
+    }
+}
+
+// Hand the records in iov[0, count) to the committer. Without a completion
+// queue this waits for them and finishes the append at once; on an event
+// loop the connection is parked instead, processing no input until the loop
+// calls connection_append_done(). iov and the data must stay valid until then.
+int connection_append(struct connection *conn, const struct iovec *iov, int count) {
+    conn->append_pending = true;
+    conn->append_rx_time = conn->rx_time;
+    bool echo = conn->protocol == PROTOCOL_TEXT && conn->append_echo && conn->echo_enabled;
+    store_append_submit(&conn->append, iov, count, echo, conn->completions);
+    if (conn->completions) {
+        return CONN_OK;
+    }
+    store_append_wait(&conn->append);
+    return connection_append_done(conn);
+}
+
+// Text records are stored: drop them from the chain and queue their echo
+static int connection_records_stored(struct connection *conn) {
+    if (conn->append.error != 0) {
+        log_message(LOG_ERR, "Failed to store data from %s: %s", conn->client_ip,
+                    strerror(conn->append.error));
+        return CONN_ERROR;
+    }
+    rx_chain_consume(&conn->rx_chain, conn->append_len);
+    // Echo file/device contents as of this write back to client
+    if (conn->append_echo && conn->echo_enabled) {
+        log_message(LOG_DEBUG, "CR char was found...");
+        connection_queue_snapshot(conn, NULL, 0, store_start(), conn->append.end, conn->append.snapshot);
+        conn->append.snapshot = NULL;
+    }
+    return CONN_OK;
+}
+
+// Finish the released append of conn: reply or echo as if it had completed
+// when its input was processed, and unpark the connection
+int connection_append_done(struct connection *conn) {
+    conn->append_pending = false;
+    if (conn->append.iov != conn->append_iov) {
+        free((void *)conn->append.iov);
+    }
+    uint64_t rx_time = conn->rx_time;
+    conn->rx_time = conn->append_rx_time;
+    int status;
+    if (conn->protocol == PROTOCOL_BINARY) {
+        connection_free_buffer(conn->append_buffer, conn->append_capacity);
+        conn->append_buffer = NULL;
+        conn->append_capacity = 0;
+        status = binary_append_done(conn);
+    } else {
+        status = connection_records_stored(conn);
+    }
+    store_snapshot_put(conn->append.snapshot); // Not echoed
+    conn->append.snapshot = NULL;
+    conn->rx_time = rx_time;
+    return status;
+}
+
+// Hand the input buffer, whose first pos bytes hold the frame being
+// appended, to the pending append and continue with a copy of the rest
+int connection_detach_input(struct connection *conn, size_t pos) {
+    char *buffer = conn->rx_buffer;
+    size_t len = conn->rx_len;
+    conn->append_buffer = buffer;
+    conn->append_capacity = conn->rx_capacity;
+    conn->rx_buffer = NULL;
+    conn->rx_capacity = 0;
+    conn->rx_len = 0;
+    if (len > pos) {
+        return connection_buffer_input(conn, buffer + pos, len - pos);
+    }
+    return CONN_OK;
+}
+
+// Store the first len bytes of the rx chain with a single writev(), echo
+// them when they end in a newline, and drop them from the chain once stored
+static int connection_store_records(struct connection *conn, size_t len, bool complete) {
+    if (len == 0) {
+        return CONN_OK;
+    }
+    struct iovec *iov = conn->append_iov;
+    int count = rx_chain_segments(&conn->rx_chain, len);
+    if (count > RX_IOV_INLINE) {
+        iov = malloc(count * sizeof(*iov));
+        if (!iov) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            return CONN_ERROR;
+        }
+    }
+    count = rx_chain_iovec(&conn->rx_chain, len, iov, count);
+    conn->append_len = len;
+    conn->append_echo = complete;
+    return connection_append(conn, iov, count);
+}
+
+// Start closing a connection on an event loop: the rest of its text is
+// stored without an echo. Returns true while an append is still in flight,
+// in which case the loop closes it once that append is done.
+bool connection_flush_input(struct connection *conn) {
+    conn->closing = true;
+    if (!conn->append_pending && conn->rx_chain.length > 0) {
+        connection_store_records(conn, conn->rx_chain.length, false);
+    }
+    return conn->append_pending;
+}
+
+// Copy the len bytes at from in the rx chain into conn->buffer if they start
+// like a command. Returns false for anything that can only be data.
+static bool connection_peek_command(struct connection *conn, size_t from, size_t len) {
+    char prefix[COMMAND_LEN(COMMAND_PREFIX)];
+    if (len <= sizeof(prefix) || len > BUFFER_SIZE ||
+        rx_chain_copy(&conn->rx_chain, from, sizeof(prefix), prefix) != sizeof(prefix) ||
+        memcmp(prefix, COMMAND_PREFIX, sizeof(prefix)) != 0) {
+        return false;
+    }
+    rx_chain_copy(&conn->rx_chain, from, len, conn->buffer);
+    conn->buffer[len] = '\0';
+    return true;
+}
+
+// Work through the complete lines buffered in the rx chain. Consecutive data
+// records are stored with one writev() and echoed once, up to FAIR_QUANTUM
+// bytes per append so other connections' appends are not held behind a
+// flood; command lines run in order between them. Stops while the output
+// queue is full or an append is in flight, leaving the rest in the chain for
+// connection_resume_input().
+static int connection_process_text(struct connection *conn) {
+    struct rx_chain *chain = &conn->rx_chain;
+    size_t run = 0; // Complete data records at the front of the chain
+    size_t lines = 0;
+    ssize_t newline;
+
+    while (!conn->output_throttled && !conn->append_pending &&
+           (newline = rx_chain_find_newline(chain)) >= 0) {
+        size_t line_len = newline + 1 - run;
+        chain->scanned = newline + 1;
+        lines++;
+        if (!connection_peek_command(conn, run, line_len)) {
+            run += line_len;
+            if (run >= FAIR_QUANTUM) {
+                if (connection_store_records(conn, run, true) != CONN_OK) {
+                    return CONN_ERROR;
                 }
-                pthread_mutex_unlock(&file_mutex);
-                continue; // Skip the normal write handling
+                run = 0;
+            }
+            continue;
+        }
+        // Data before the command is stored and echoed first
+        if (connection_store_records(conn, run, true) != CONN_OK) {
+            return CONN_ERROR;
+        }
+        if (conn->append_pending) {
+            // The command runs once the data is in the store
+            chain->scanned = run;
+            lines--;
+            run = 0;
+            break;
+        }
+        run = 0;
+        if (connection_handle_command(conn, conn->buffer, line_len)) {
+            rx_chain_consume(chain, line_len);
+        } else {
+            run = line_len;
+        }
+    }
+    if (connection_store_records(conn, run, true) != CONN_OK) {
+        return CONN_ERROR;
+    }
+    limit_charge(conn, 0, lines);
+    return CONN_OK;
+}
+
+// The client has sent all it will (EOF or SHUT_WR) and its input has been
+// processed. What is left after its last newline may be a command sent
+// without one, the way older clients do: it runs now, and the caller sends
+// the reply before closing. Until the end of input such a tail may still be
+// the start of a longer command, so it is only ever run here. Anything else
+// stays in the chain and is stored as data when the connection closes.
+void connection_end_input(struct connection *conn) {
+    struct rx_chain *chain = &conn->rx_chain;
+    conn->input_ended = true;
+    if (conn->protocol == PROTOCOL_TEXT && !conn->output_throttled && !conn->append_pending &&
+        chain->length > 0 && chain->scanned == chain->length &&
+        connection_peek_command(conn, 0, chain->length) &&
+        connection_handle_command(conn, conn->buffer, chain->length)) {
+        rx_chain_consume(chain, chain->length);
+        limit_charge(conn, 0, 1);
+    }
+}
+
+// Pick the protocol from the first bytes of the connection: a client that
+// opens with AESD_BINARY_MAGIC speaks binary frames, anyone else text.
+// Bytes matching a prefix of the magic are held in rx_buffer meanwhile.
+static int connection_negotiate(struct connection *conn, size_t len) {
+    size_t matched = conn->rx_len;
+    size_t i = 0;
+    while (matched + i < AESD_BINARY_MAGIC_LEN && i < len &&
+           conn->buffer[i] == AESD_BINARY_MAGIC[matched + i]) {
+        i++;
+    }
+    if (matched + i == AESD_BINARY_MAGIC_LEN) {
+        conn->protocol = PROTOCOL_BINARY;
+        conn->rx_len = 0;
+        log_message(LOG_INFO, "Binary protocol selected by %s", conn->client_ip);
+        if (connection_queue_reply(conn, AESD_BINARY_MAGIC, AESD_BINARY_MAGIC_LEN, 0, 0) != CONN_OK ||
+            connection_buffer_input(conn, conn->buffer + i, len - i) != CONN_OK) {
+            return CONN_ERROR;
+        }
+        return binary_process_frames(conn);
+    }
+    if (i == len) {
+        return connection_buffer_input(conn, conn->buffer, len); // Still undecided
+    }
+    // Text after all: the held bytes start the first record
+    conn->protocol = PROTOCOL_TEXT;
+    if (connection_chain_input(conn, conn->rx_buffer, matched) != CONN_OK ||
+        connection_chain_input(conn, conn->buffer, len) != CONN_OK) {
+        return CONN_ERROR;
+    }
+    conn->rx_len = 0;
+    return connection_process_text(conn);
+}
+
+// Account for len bytes received into the space from connection_rx_space()
+// without processing them; during negotiation they stay in conn->buffer
+static void connection_commit_input(struct connection *conn, size_t len) {
+    conn->rx_time = metrics_now();
+    metrics_received(conn, len);
+    limit_charge(conn, len, 0);
+    if (conn->protocol == PROTOCOL_TEXT) {
+        rx_chain_commit(&conn->rx_chain, len);
+    } else if (conn->protocol == PROTOCOL_BINARY) {
+        conn->rx_len += len;
+    }
+}
+
+// Process len bytes just received into the space from connection_rx_space():
+// text records and commands, or binary frames. Echoes are queued as snapshots
+// of the store length and sent later by connection_send_pending(). The
+// output queue must not be full (callers stop reading while output_throttled
+// is set).
+int connection_handle_data(struct connection *conn, size_t len) {
+    connection_commit_input(conn, len);
+    switch (conn->protocol) {
+        case PROTOCOL_TEXT:
+            return connection_process_text(conn);
+        case PROTOCOL_BINARY:
+            return binary_process_frames(conn);
+        default:
+            return connection_negotiate(conn, len);
+    }
+}
+
+// True when buffered input can be processed without receiving more
+bool connection_input_pending(struct connection *conn) {
+    switch (conn->protocol) {
+        case PROTOCOL_TEXT:
+            return conn->rx_chain.scanned < conn->rx_chain.length;
+        case PROTOCOL_BINARY:
+            return binary_frame_ready(conn);
+        default:
+            return false;
+    }
+}
+
+// Continue with buffered input once the output queue has room again or the
+// append the connection was parked on is done
+int connection_resume_input(struct connection *conn) {
+    if (conn->output_throttled || conn->append_pending || !connection_input_pending(conn)) {
+        return CONN_OK;
+    }
+    return conn->protocol == PROTOCOL_TEXT ? connection_process_text(conn)
+                                           : binary_process_frames(conn);
+}
+
+// Take len bytes the caller received into a buffer of its own (io_uring
+// provided buffers). They are processed at once unless the output queue is
+// full, in which case they wait in the connection for connection_resume_input().
+int connection_receive(struct connection *conn, const char *data, size_t len) {
+    while (len > 0) {
+        size_t space;
+        char *rx = connection_rx_space(conn, &space);
+        if (!rx) {
+            return CONN_ERROR;
+        }
+        size_t chunk = len < space ? len : space;
+        memcpy(rx, data, chunk);
+        if (conn->protocol == PROTOCOL_UNKNOWN || (!conn->output_throttled && !conn->append_pending)) {
+            if (connection_handle_data(conn, chunk) == CONN_ERROR) {
+                return CONN_ERROR;
+            }
+        } else {
+            connection_commit_input(conn, chunk);
+        }
+        data += chunk;
+        len -= chunk;
+    }
+    return CONN_OK;
+}
+
+// Move the next part of a store extent to the socket inside the kernel.
+// Returns bytes sent, 0 at end of data, or -1 with errno set.
+static ssize_t connection_sendfile(struct connection *conn, const struct store_extent *extent) {
+    off_t offset = extent->file_offset;
+    return sendfile(conn->client_socket, extent->fd, &offset,
+                    extent->len < SENDFILE_MAX ? extent->len : SENDFILE_MAX);
+}
+
+// Copy the next part of a store extent through conn->buffer; used when the
+// data file/device does not support splicing. Same return as connection_sendfile.
+static ssize_t connection_send_buffered(struct connection *conn, const struct store_extent *extent) {
+    ssize_t bytes_read = pread(extent->fd, conn->buffer,
+                               extent->len < BUFFER_SIZE ? extent->len : BUFFER_SIZE, extent->file_offset);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+    return send(conn->client_socket, conn->buffer, bytes_read, MSG_NOSIGNAL);
+}
+
+// Send the next part of a queued range, up to the end of the segment or
+// mapping holding it: straight from memory when the store has it mapped or
+// in a snapshot, otherwise with sendfile() or through conn->buffer. Same
+// return as connection_sendfile.
+static ssize_t connection_send_data(struct connection *conn, const struct output_range *range) {
+    struct store_extent extent;
+    store_extent_get(range->snapshot, range->offset, range->end, &extent);
+    if (extent.len == 0) {
+        return 0;
+    }
+    ssize_t bytes_sent;
+    if (extent.data) {
+        bytes_sent = send(conn->client_socket, extent.data,
+                          extent.len < SENDFILE_MAX ? extent.len : SENDFILE_MAX, MSG_NOSIGNAL);
+    } else if (conn->zero_copy) {
+        bytes_sent = connection_sendfile(conn, &extent);
+    } else {
+        bytes_sent = connection_send_buffered(conn, &extent);
+    }
+    store_extent_put(&extent);
+    return bytes_sent;
+}
+
+// Drop the range at the head of the output queue, along with any unsent remainder
+static void connection_pop_output(struct connection *conn) {
+    struct output_range *range = &conn->output[conn->output_head];
+    metrics_acked(range->queued_ns);
+    free(range->prefix_heap);
+    store_snapshot_put(range->snapshot);
+    conn->output_bytes -= (range->prefix_len - range->prefix_sent) + (range->end - range->offset);
+    conn->output_head = (conn->output_head + 1) % OUTPUT_QUEUE_LEN;
+    conn->output_count--;
+    if (conn->echo_total > 0) {
+        log_message(LOG_DEBUG, "Total sent to client: %zd bytes", conn->echo_total);
+    }
+    conn->echo_total = 0;
+}
+
+// Account for bytes of the entry at the head of the output queue that reached
+// the client, prefix first; the entry is dropped once it has been sent in full
+void connection_output_sent(struct connection *conn, size_t bytes) {
+    struct output_range *range = &conn->output[conn->output_head];
+    size_t prefix_bytes = range->prefix_len - range->prefix_sent;
+    if (prefix_bytes > bytes) {
+        prefix_bytes = bytes;
+    }
+    log_message(LOG_DEBUG, "Sent %zu bytes", bytes);
+    metrics_sent(conn, bytes);
+    range->prefix_sent += prefix_bytes;
+    range->offset += bytes - prefix_bytes;
+    conn->echo_total += bytes - prefix_bytes;
+    conn->output_bytes -= bytes;
+    if (range->prefix_sent == range->prefix_len && range->offset >= range->end) {
+        connection_pop_output(conn);
+    }
+    connection_update_throttle(conn);
+}
+
+// The data for the entry at the head of the output queue ended early (the
+// device dropped old entries): drop the entry, or fail if it was a reply
+// that must be sent in full
+int connection_output_truncated(struct connection *conn) {
+    if (conn->output[conn->output_head].framed) {
+        log_message(LOG_ERR, "Data ended before the reply to %s was complete", conn->client_ip);
+        return CONN_ERROR;
+    }
+    connection_pop_output(conn);
+    connection_update_throttle(conn);
+    return CONN_OK;
+}
+
+// With tcp_cork, hold partial frames back while a burst of echoes is sent
+// and push them out once the output queue is empty
+static void connection_cork(struct connection *conn, bool cork) {
+    int value = cork;
+    if (setsockopt(conn->client_socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) != 0) {
+        log_message(LOG_DEBUG, "Failed to set TCP_CORK: %s", strerror(errno));
+        return;
+    }
+    conn->corked = cork;
+}
+
+// Send queued echoes to the client, zero-copy where possible. Needs no lock:
+// each range ends at a published store length, file data is only ever
+// appended to and its segments are pinned while they are read, and char
+// device ranges hold a snapshot taken when they were queued. Blocking
+// sockets run to completion; non-blocking sockets return CONN_AGAIN and
+// resume from the queue on the next call.
+int connection_send_pending(struct connection *conn) {
+    if (conn->output_count > 0 && !conn->corked && !conn->local &&
+        atomic_load_explicit(&tunables.tcp_cork, memory_order_relaxed)) {
+        connection_cork(conn, true);
+    }
+    while (conn->output_count > 0) {
+        struct output_range *range = &conn->output[conn->output_head];
+        bool in_prefix = range->prefix_sent < range->prefix_len;
+        ssize_t bytes_sent;
+        if (in_prefix) {
+            // Cork the header with the data that follows it
+            const char *prefix = range->prefix_heap ? range->prefix_heap : range->prefix;
+            bytes_sent = send(conn->client_socket, prefix + range->prefix_sent,
+                              range->prefix_len - range->prefix_sent,
+                              MSG_NOSIGNAL | (range->end > range->offset ? MSG_MORE : 0));
+        } else if (range->offset >= range->end) {
+            connection_pop_output(conn);
+            connection_update_throttle(conn);
+            continue;
+        } else {
+            bytes_sent = connection_send_data(conn, range);
+        }
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return CONN_AGAIN;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!in_prefix && conn->zero_copy && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                log_message(LOG_INFO, "sendfile not supported for %s, using buffered echo", store_data_path());
+                conn->zero_copy = false;
+                continue;
+            }
+            log_message(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+            return CONN_ERROR;
+        }
+        if (bytes_sent == 0) {
+            if (connection_output_truncated(conn) != CONN_OK) {
+                return CONN_ERROR;
+            }
+            continue;
+        }
+        // Partial sends are picked up again from the new offset
+        connection_output_sent(conn, bytes_sent);
+    }
+    if (conn->corked) {
+        connection_cork(conn, false);
+    }
+    return CONN_OK;
+}
+
+// Blocking modes: sit out a rate limit pause before reading again. Ends
+// early if the socket is shut down (POLLHUP, e.g. at the drain deadline),
+// leaving recv() to see the end of input.
+static void connection_pace(struct connection *conn) {
+    int wait_ms;
+    while ((wait_ms = limit_pause_ms(conn)) > 0) {
+        struct pollfd pfd = { .fd = conn->client_socket, .events = 0 };
+        if (poll(&pfd, 1, wait_ms) > 0) {
+            return;
+        }
+    }
+}
+
+// Serve a blocking client socket until it disconnects
+void connection_serve(struct connection *conn) {
+    ssize_t bytes_received;
+    char *rx;
+    size_t space;
+
+    // Main receive loop for this client
+    while ((rx = connection_rx_space(conn, &space)) != NULL) {
+        connection_pace(conn);
+        if ((bytes_received = recv(conn->client_socket, rx, space, 0)) <= 0) {
+            if (bytes_received == 0) {
+                connection_end_input(conn);
+                connection_send_pending(conn);
+            }
+            break;
+        }
+        log_message(LOG_DEBUG, "Received %zd bytes of data", bytes_received);
+        int status = connection_handle_data(conn, bytes_received);
+        // Flush, then carry on with any input the full output queue held back
+        while (status == CONN_OK) {
+            status = connection_send_pending(conn);
+            if (status != CONN_OK || !connection_input_pending(conn)) {
+                break;
             }
-            // If sscanf failed, treat as normal input
+            status = connection_resume_input(conn);
         }
-        if (data_fd == -1) {
-            syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
-            pthread_mutex_unlock(&file_mutex);
+        if (status == CONN_ERROR) {
             break;
         }
-        // Write received data to file/device
-        if (write(data_fd, buffer, bytes_received) == -1) {
-            syslog(LOG_ERR, "Failed to write to data file: %s", strerror(errno));
-        }
-        // If a newline is found, echo file/device contents back to client
-        if (memchr(buffer, '\n', bytes_received)) {
-            syslog(LOG_INFO, "CR char was found...");
-            lseek(data_fd, 0, SEEK_SET);
-            ssize_t bytes_read;
-            ssize_t total_sent = 0;
-            // Read file/device and send to client in chunks
-            while ((bytes_read = read(data_fd, buffer, sizeof(buffer))) > 0) {
-                syslog(LOG_INFO, "Data read from the file...");
-                ssize_t bytes_sent = send(client_socket, buffer, bytes_read, 0);
-                if (bytes_sent < 0) {
-                    syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
-                    break;
+    }
+}
+
+// Number of event loops or pool workers to start. A pool worker is busy
+// with one connection for as long as the client keeps it open, so one per
+// CPU would leave most persistent clients queued on a small host: the pool
+// gets at least one worker per POOL_QUEUE_PER_WORKER queue slots instead.
+int server_thread_count(const struct server_options *options) {
+    if (options->num_threads > 0) {
+        return options->num_threads;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus > 0 ? (int)cpus : 1;
+    if (options->mode == SERVER_MODE_POOL) {
+        size_t workers = options->queue_capacity / POOL_QUEUE_PER_WORKER;
+        workers = workers < POOL_WORKERS_MAX ? workers : POOL_WORKERS_MAX;
+        count = (size_t)count < workers ? (int)workers : count;
+    }
+    return count;
+}
+
+// Remember a listening socket so it can be handed to a successor
+static void server_track_listener(int server_socket) {
+    if (listener_count < LISTENERS_MAX) {
+        listeners[listener_count++] = server_socket;
+    }
+}
+
+// Create a listening socket on the configured port: dual-stack IPv6 where the system has
+// it, IPv4 otherwise. Sharded modes open one per loop with SO_REUSEPORT,
+// letting the kernel spread incoming connections across their accept queues.
+// Listeners taken over from a previous server (-H) are used first.
+int server_listen(const struct server_options *options) {
+    if (inherited_count > 0) {
+        // A listener from the predecessor keeps its queue of waiting clients
+        int server_socket = inherited[--inherited_count];
+        int flags = fcntl(server_socket, F_GETFL, 0);
+        if (flags != -1) {
+            fcntl(server_socket, F_SETFL, flags & ~O_NONBLOCK);
+        }
+        if (listen(server_socket, options->backlog) == -1) {
+            log_message(LOG_WARNING, "Failed to set backlog of inherited listener: %s", strerror(errno));
+        }
+        server_track_listener(server_socket);
+        return server_socket;
+    }
+    int server_socket = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ipv6 = server_socket >= 0;
+    if (!ipv6) {
+        server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (server_socket < 0) {
+        log_message(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    int opt = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        log_message(LOG_ERR, "Failed to set SO_REUSEADDR: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+    if (options->listen_shards > 1 &&
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        log_message(LOG_ERR, "Failed to set SO_REUSEPORT: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+
+    // Accepted clients inherit the buffer sizes, and a receive buffer set
+    // before listen() also sets the window scale they negotiate
+    config_socket_setup(server_socket, true);
+
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len;
+    memset(&server_addr, 0, sizeof(server_addr));
+    if (ipv6) {
+        // Accept IPv4 clients too, as ::ffff:a.b.c.d
+        opt = 0;
+        if (setsockopt(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1) {
+            log_message(LOG_WARNING, "Failed to clear IPV6_V6ONLY: %s", strerror(errno));
+        }
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&server_addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(options->port);
+        server_addr_len = sizeof(*addr6);
+    } else {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)&server_addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4->sin_port = htons(options->port);
+        server_addr_len = sizeof(*addr4);
+    }
+    log_message(LOG_INFO, "Binding to address: %s, port: %d", ipv6 ? "[::]" : "0.0.0.0", options->port);
+    if (bind(server_socket, (struct sockaddr *)&server_addr, server_addr_len) == -1) {
+        log_message(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+    if (listen(server_socket, options->backlog) == -1) {
+        log_message(LOG_ERR, "Failed to listen on socket: %s", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+    log_message(LOG_INFO, "Socket successfully bound to address: %s, port: %d, backlog %d",
+                ipv6 ? "[::]" : "0.0.0.0", options->port, options->backlog);
+    server_track_listener(server_socket);
+    return server_socket;
+}
+
+// Listen on the Unix-domain socket at options->local_path as well, for
+// clients on this host: the same protocol without the TCP loopback path. A
+// path starting with '@' is bound in the abstract namespace, which needs no
+// file and disappears with the last socket. Returns -1 on failure.
+static int server_listen_local(const struct server_options *options) {
+    if (inherited_local != -1) {
+        int local_socket = inherited_local;
+        inherited_local = -1;
+        int flags = fcntl(local_socket, F_GETFL, 0);
+        if (flags != -1) {
+            fcntl(local_socket, F_SETFL, flags & ~O_NONBLOCK);
+        }
+        server_track_listener(local_socket);
+        return local_socket;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t path_len = strlen(options->local_path);
+    memcpy(addr.sun_path, options->local_path, path_len);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0'; // Abstract names are not NUL-terminated
+    } else {
+        addr_len++;
+        if (config_socket_reclaim(addr.sun_path) != 0) {
+            return -1;
+        }
+    }
+    int local_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (local_socket == -1) {
+        log_message(LOG_ERR, "Failed to create Unix socket: %s", strerror(errno));
+        return -1;
+    }
+    if (bind(local_socket, (struct sockaddr *)&addr, addr_len) == -1 ||
+        listen(local_socket, options->backlog) == -1) {
+        log_message(LOG_ERR, "Failed to listen on %s: %s", options->local_path, strerror(errno));
+        close(local_socket);
+        return -1;
+    }
+    log_message(LOG_INFO, "Listening on Unix socket %s, backlog %d", options->local_path, options->backlog);
+    server_track_listener(local_socket);
+    return local_socket;
+}
+
+// Close the Unix-domain listener, removing its path unless a successor
+// took it over
+static void server_close_local(const struct server_options *options) {
+    close(options->local_socket);
+    if (options->local_path[0] != '@' && handoff_client == -1) {
+        unlink(options->local_path);
+    }
+}
+
+// Take over the listening sockets of the server running with the same -H
+// path, if any, and give it time to drain and close its store. Returns true
+// when a server handed over; store_open() then waits for its store lock.
+static bool server_inherit(const struct server_options *options) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, options->handoff_path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (sock != -1) {
+            close(sock);
+        }
+        return false;
+    }
+    char buf[CMSG_SPACE(sizeof(inherited))];
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = sizeof(tag) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = buf,
+        .msg_controllen = sizeof(buf),
+    };
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        log_message(LOG_ERR, "No listening sockets received from %s", options->handoff_path);
+        close(sock);
+        return false;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fds[LISTENERS_MAX];
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+            // The Unix-domain listener is kept apart from the TCP shards
+            for (int i = 0; i < count; i++) {
+                struct sockaddr_storage addr;
+                socklen_t addr_len = sizeof(addr);
+                if (getsockname(fds[i], (struct sockaddr *)&addr, &addr_len) == 0 && addr.ss_family == AF_UNIX) {
+                    if (inherited_local != -1) {
+                        close(inherited_local);
+                    }
+                    inherited_local = fds[i];
                 } else {
-                    syslog(LOG_INFO, "Message sent to the client...");
-                    syslog(LOG_INFO, "Sent %zd bytes", bytes_sent);
-                    total_sent += bytes_sent;
+                    inherited[inherited_count++] = fds[i];
                 }
             }
-            if (total_sent > 0) {
-                syslog(LOG_INFO, "Total sent to client: %zd bytes", total_sent);
-            }
         }
-        close(data_fd);
-        pthread_mutex_unlock(&file_mutex);
     }
-    close(client_socket);
-    syslog(LOG_INFO, "Closed connection from: %s", client_ip);
+    log_message(LOG_INFO, "Took over %d listening socket(s), waiting for the previous server to drain",
+                inherited_count + (inherited_local != -1));
+
+    // The predecessor closes the connection once its store is closed;
+    // meanwhile new clients wait in the listen queues
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    int timeout = options->drain_timeout_ms + HANDOFF_GRACE_MS;
+    while (poll(&pfd, 1, timeout) > 0 && read(sock, &tag, sizeof(tag)) > 0) {
+    }
+    close(sock);
+    return true;
+}
+
+// Listen on the -H path for a successor asking for our listening sockets
+static int server_handoff_open(const struct server_options *options) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, options->handoff_path, sizeof(addr.sun_path) - 1);
+    handoff_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_socket == -1) {
+        log_message(LOG_ERR, "Failed to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    unlink(addr.sun_path);
+    if (bind(handoff_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(handoff_socket, 1) != 0) {
+        log_message(LOG_ERR, "Failed to listen for handoff on %s: %s", addr.sun_path, strerror(errno));
+        close(handoff_socket);
+        handoff_socket = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Done with the handoff socket: remove it unless a successor took over the
+// path, and release a successor waiting for us to finish
+static void server_handoff_close(const struct server_options *options) {
+    if (handoff_socket != -1) {
+        close(handoff_socket);
+        unlink(options->handoff_path);
+        handoff_socket = -1;
+    }
+    if (handoff_client != -1) {
+        close(handoff_client);
+        handoff_client = -1;
+    }
+}
+
+// Thread function: handles a single client connection
+void *client_handler(void *arg) {
+    struct connection *conn = arg;
 
-    // Remove this thread from the active thread list
+    connection_serve(conn);
+    connection_close(conn);
+    slab_free(&connection_cache, conn);
+
+    // Leave this thread's entry for the accept loop to join
     pthread_mutex_lock(&list_mutex);
     struct thread_entry *entry;
     SLIST_FOREACH(entry, &head, entries) {
         if (pthread_equal(entry->thread_id, pthread_self())) {
-            SLIST_REMOVE(&head, entry, thread_entry, entries);
-            free(entry);
+            entry->done = true;
             break;
         }
     }
@@ -177,14 +1240,14 @@ void *client_handler(void *arg) {
 void daemonize(void) {
     pid_t pid = fork();
     if (pid < 0) {
-        syslog(LOG_ERR, "Fork failed: %s", strerror(errno));
+        log_message(LOG_ERR, "Fork failed: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
     if (pid > 0) {
         exit(EXIT_SUCCESS);
     }
     if (setsid() < 0) {
-        syslog(LOG_ERR, "setsid failed: %s", strerror(errno));
+        log_message(LOG_ERR, "setsid failed: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
     if (chdir("/") < 0) {
@@ -196,7 +1259,7 @@ void daemonize(void) {
     close(STDERR_FILENO);
     int fd_null = open("/dev/null", O_RDWR);
     if (fd_null == -1) {
-        syslog(LOG_ERR, "Failed to open /dev/null: %s", strerror(errno));
+        log_message(LOG_ERR, "Failed to open /dev/null: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
     dup2(fd_null, STDIN_FILENO);
@@ -207,164 +1270,384 @@ void daemonize(void) {
     }
 }
 
-#if !USE_AESD_CHAR_DEVICE
-// Thread function: periodically writes timestamp to file
-void* timestamp_thread_func(void* arg) {
-    syslog(LOG_INFO, "Starting timestamp_thread_func...");
-    while (1) {
-        pthread_mutex_lock(&running_mutex);
-        bool local_running = running;
-        pthread_mutex_unlock(&running_mutex);
-        if (!local_running) break;
-        sleep(TIMESTAMP_INTERVAL);
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[64];
-        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
-        // Lock file for safe timestamp write
-        pthread_mutex_lock(&file_mutex);
-        int data_fd = open(DATA_FILE, O_CREAT | O_RDWR | O_APPEND, 0644);
-        if (data_fd != -1) {
-            write(data_fd, timestamp, strlen(timestamp));
-            close(data_fd);
-        }
-        pthread_mutex_unlock(&file_mutex);
+// Create the periodic timer that drives the timestamp records, watched by
+// the server loop of whichever mode runs. Returns -1 when timestamps are off.
+int timestamp_timer_open(const struct server_options *options) {
+    if (options->timestamp_interval_ns <= 0) {
+        return -1;
     }
-    return NULL;
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        log_message(LOG_ERR, "Failed to create timestamp timer: %s", strerror(errno));
+        return -1;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = options->timestamp_interval_ns / 1000000000;
+    spec.it_interval.tv_nsec = options->timestamp_interval_ns % 1000000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) != 0) {
+        log_message(LOG_ERR, "Failed to arm timestamp timer: %s", strerror(errno));
+        close(timer_fd);
+        return -1;
+    }
+    log_message(LOG_INFO, "Writing a timestamp every %lld ms", (long long)(options->timestamp_interval_ns / 1000000));
+    return timer_fd;
 }
-#endif
 
-int main(int argc, char *argv[]) {
-    bool daemon_mode = false;
-    openlog("aesdsocket", LOG_PID, LOG_USER);
+// The timestamp timer is readable: append one timestamp record, however
+// many intervals have passed. Only ever called by the thread watching the
+// timer, so the formatted text is cached for the current second unlocked.
+void timestamp_timer_fire(int timer_fd) {
+    static time_t cached_second = -1;
+    static char timestamp[64];
+    static size_t timestamp_len;
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (now != cached_second) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        timestamp_len = strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_info);
+        cached_second = now;
+    }
+    store_append(timestamp, timestamp_len, NULL);
+}
 
-    // Parse command-line arguments for daemon mode
-    int c;
-    while ((c = getopt(argc, argv, "d")) != -1) {
-        switch (c) {
-            case 'd':
-                daemon_mode = true;
-                break;
-            default:
-                fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
-                exit(EXIT_FAILURE);
+// Hand every listening socket to the successor connecting to the handoff
+// socket, then shut down: the successor accepts from the same queues while
+// this process drains its connections, so no client is refused.
+static void server_handoff(void) {
+    int client = accept4(handoff_socket, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+        return;
+    }
+    int fds[LISTENERS_MAX];
+    int count = 0;
+    for (int i = 0; i < listener_count; i++) {
+        if (fcntl(listeners[i], F_GETFD) != -1) {
+            fds[count++] = listeners[i];
         }
     }
-    if (daemon_mode) {
-        syslog(LOG_INFO, "Starting daemon mode...");
-        daemonize();
+    char buf[CMSG_SPACE(sizeof(fds))];
+    memset(buf, 0, sizeof(buf));
+    char tag = 'L';
+    struct iovec iov = { .iov_base = &tag, .iov_len = sizeof(tag) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = buf,
+        .msg_controllen = CMSG_SPACE(count * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    if (count == 0 || sendmsg(client, &msg, MSG_NOSIGNAL) != 1) {
+        log_message(LOG_ERR, "Failed to hand listening sockets over: %s", strerror(errno));
+        close(client);
+        return;
     }
+    log_message(LOG_INFO, "Handed %d listening socket(s) to a new server, draining", count);
+    // The successor now owns the handoff path; it waits on this connection
+    // until our store is closed
+    close(handoff_socket);
+    handoff_socket = -1;
+    handoff_client = client;
+    server_request_shutdown();
+}
 
-    // Set up signal handlers for clean shutdown
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
-
-#if !USE_AESD_CHAR_DEVICE
-    // Start timestamp thread if not using char device
-    syslog(LOG_INFO, "Creating timestamp thread...");
-    pthread_t timestamp_tid;
-    if (pthread_create(&timestamp_tid, NULL, timestamp_thread_func, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+// Wait until server_socket or local_socket (either may be -1) is readable,
+// appending timestamps when timer_fd fires and serving handoff requests.
+// Returns the readable listener, local clients first, or -1 once shutdown
+// is requested.
+static int server_poll(int server_socket, int local_socket, int timer_fd) {
+    struct pollfd fds[5] = {
+        { .fd = shutdown_fd, .events = POLLIN },
+        { .fd = handoff_socket, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },
+        { .fd = server_socket, .events = POLLIN },
+        { .fd = local_socket, .events = POLLIN },
+    };
+    while (running_signal) {
+        fds[1].fd = handoff_socket;
+        if (poll(fds, 5, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERR, "poll failed: %s", strerror(errno));
+            return -1;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            server_handoff();
+        }
+        if (fds[2].revents & POLLIN) {
+            timestamp_timer_fire(timer_fd);
+        }
+        if (fds[4].revents) {
+            return local_socket;
+        }
+        if (fds[3].revents) {
+            return server_socket;
+        }
     }
-    syslog(LOG_INFO, "Timestamp thread created successfully.");
-#endif
+    return -1;
+}
 
-    // Create server socket and set options
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        syslog(LOG_ERR, "Failed to create socket: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+// Accept a connection on whichever of the blocking listeners server_socket
+// and local_socket (-1 if none) has one waiting, appending timestamps while
+// waiting when timer_fd is not -1. Same return as accept(); fails with EINTR
+// once shutdown is requested.
+int server_accept(int server_socket, int local_socket, int timer_fd, struct sockaddr *addr, socklen_t *addr_len) {
+    int listener = server_poll(server_socket, local_socket, timer_fd);
+    if (listener == -1) {
+        errno = EINTR;
+        return -1;
     }
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        syslog(LOG_ERR, "Failed to set SO_REUSEADDR: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    struct sockaddr_in server_addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_port = htons(PORT),
-    };
-    syslog(LOG_INFO, "Binding to address: %s, port: %d",
-           inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    return accept(listener, addr, addr_len);
+}
+
+// Wait until fd is readable, appending timestamps and serving handoff
+// requests meanwhile. Returns false once shutdown is requested.
+bool server_wait_readable(int fd, int timer_fd) {
+    return server_poll(fd, -1, timer_fd) != -1;
+}
+
+// Block the calling server thread until shutdown is requested, serving
+// handoff requests meanwhile
+void server_wait_shutdown(void) {
+    server_poll(-1, -1, -1);
+}
+
+// metrics_now() value by which connections still draining are cut
+uint64_t server_drain_deadline(const struct server_options *options) {
+    return metrics_now() + (uint64_t)options->drain_timeout_ms * 1000000;
+}
+
+// Milliseconds left until deadline, rounded up; 0 once it has passed
+int server_drain_remaining(uint64_t deadline) {
+    uint64_t now = metrics_now();
+    return now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+}
+
+// Give the connections still open until the drain deadline (-D) to finish,
+// then shut their sockets so the threads serving them see the end of input
+void server_drain(const struct server_options *options) {
+    uint64_t deadline = server_drain_deadline(options);
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = DRAIN_POLL_MS * 1000000L };
+    while (metrics_connections_active() > 0 && server_drain_remaining(deadline) > 0) {
+        nanosleep(&pause, NULL);
     }
-    syslog(LOG_INFO, "Socket successfully bound to address: %s, port: %d",
-           inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
-    if (listen(server_socket, BACKLOG) == -1) {
-        syslog(LOG_ERR, "Failed to listen on socket: %s", strerror(errno));
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    uint64_t open = metrics_connections_active();
+    if (open > 0) {
+        log_message(LOG_INFO, "Drain deadline passed, closing %llu connection(s)", (unsigned long long)open);
+        metrics_connections_shutdown();
     }
-    syslog(LOG_INFO, "Listening for connections...");
-    // Main server loop: accept and handle client connections
-    while (1) {
-        pthread_mutex_lock(&running_mutex);
-        bool local_running = running;
-        pthread_mutex_unlock(&running_mutex);
-        if (!local_running) break;
-
-        // Allocate and initialize client info struct for new connection
-        struct {
-            int client_socket;
-            struct sockaddr_in client_addr;
-            socklen_t client_addr_len;
-        } *client_info = malloc(sizeof(*client_info));
-        if (!client_info) {
-            syslog(LOG_ERR, "Memory allocation failed");
+}
+
+// Join the threads whose clients are gone; all of them when wait is set
+static void thread_reap(bool wait) {
+    pthread_mutex_lock(&list_mutex);
+    struct thread_entry **link = &SLIST_FIRST(&head);
+    while (*link) {
+        struct thread_entry *entry = *link;
+        if (!wait && !entry->done) {
+            link = &SLIST_NEXT(entry, entries);
             continue;
         }
-        client_info->client_addr_len = sizeof(client_info->client_addr);
-        client_info->client_socket = accept(server_socket, (struct sockaddr *)&client_info->client_addr, &client_info->client_addr_len);
-        if (client_info->client_socket < 0) {
+        *link = SLIST_NEXT(entry, entries);
+        pthread_mutex_unlock(&list_mutex);
+        pthread_join(entry->thread_id, NULL);
+        slab_free(&thread_entry_cache, entry);
+        pthread_mutex_lock(&list_mutex);
+        link = &SLIST_FIRST(&head);
+    }
+    pthread_mutex_unlock(&list_mutex);
+}
+
+// Thread-per-connection server loop: accept and handle client connections
+// until shutdown, then drain them
+static void thread_server_run(int server_socket, const struct server_options *options) {
+    while (running_signal) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = server_accept(server_socket, options->local_socket, options->timestamp_fd,
+                                          (struct sockaddr *)&client_addr, &client_addr_len);
+        if (client_socket < 0) {
             if (errno == EINTR) {
-                free(client_info);
                 break;
             }
-            syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
-            free(client_info);
+            log_message(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            continue;
+        }
+
+        // Allocate and initialize connection state for the new client
+        struct connection *conn = slab_alloc(&connection_cache);
+        if (!conn) {
+            log_message(LOG_ERR, "Memory allocation failed");
+            close(client_socket);
+            continue;
+        }
+        if (connection_open(conn, client_socket, (struct sockaddr *)&client_addr) != 0) {
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
             continue;
         }
 
         // Create a thread to handle the new client
-        struct thread_entry *entry = malloc(sizeof(struct thread_entry));
+        struct thread_entry *entry = slab_alloc(&thread_entry_cache);
         if (!entry) {
-            syslog(LOG_ERR, "Memory allocation failed");
-            close(client_info->client_socket);
-            free(client_info);
+            log_message(LOG_ERR, "Memory allocation failed");
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
             continue;
         }
-        if (pthread_create(&entry->thread_id, NULL, (void *(*)(void *))client_handler, client_info) != 0) {
-            syslog(LOG_ERR, "Thread creation failed: %s", strerror(errno));
-            close(client_info->client_socket);
-            free(client_info);
-            free(entry);
+        entry->done = false;
+        int incoming_cpu = conn->incoming_cpu; // conn belongs to the thread once it starts
+        // Listed before the thread can look for its entry
+        pthread_mutex_lock(&list_mutex);
+        if (pthread_create(&entry->thread_id, NULL, client_handler, conn) != 0) {
+            pthread_mutex_unlock(&list_mutex);
+            log_message(LOG_ERR, "Thread creation failed: %s", strerror(errno));
+            connection_close(conn);
+            slab_free(&connection_cache, conn);
+            slab_free(&thread_entry_cache, entry);
             continue;
         }
-        // Add thread to the active thread list
-        pthread_mutex_lock(&list_mutex);
         SLIST_INSERT_HEAD(&head, entry, entries);
         pthread_mutex_unlock(&list_mutex);
+        cpu_place_client(entry->thread_id, incoming_cpu);
+        thread_reap(false);
     }
-    close(server_socket);
 
-    // Wait for all client threads to finish and clean up
-    struct thread_entry *entry;
-    while (!SLIST_EMPTY(&head)) {
-        entry = SLIST_FIRST(&head);
-        pthread_join(entry->thread_id, NULL);
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(entry);
+    server_drain(options);
+    thread_reap(true);
+}
+
+int main(int argc, char *argv[]) {
+    struct server_options options;
+    openlog("aesdsocket", LOG_PID, LOG_USER);
+
+    // Settings come from the config file (-F) and the command line
+    if (config_load(&options, argc, argv) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (options.daemon) {
+        log_message(LOG_INFO, "Starting daemon mode...");
+        daemonize();
+    }
+
+    // Logging moves off the calling threads from here on; the drain thread
+    // is started after daemonize() since threads do not survive fork()
+    if (log_open(options.log_file) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    atexit(log_close);
+    if (cpu_start(&options) != 0 || config_start() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Signals only flag shutdown; the server loops wait on shutdown_fd
+    shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_fd == -1) {
+        log_message(LOG_ERR, "Failed to create shutdown eventfd: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // sendfile() has no MSG_NOSIGNAL, report closed clients as EPIPE instead
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    // Hot restart: a running server hands over its listeners and finishes
+    // before this one opens the store
+    if (options.handoff_path) {
+        options.handoff_wait = server_inherit(&options);
     }
+
+    if (metrics_start(options.stats_path, options.handoff_wait) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Open the shared append path before anything can write
+    if (store_open(&options) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    options.timestamp_fd = timestamp_timer_open(&options);
+    limit_start(&options);
+
+    // Event loops each get their own listener, the first one opened here
+    if ((options.mode == SERVER_MODE_EPOLL || options.mode == SERVER_MODE_URING) && options.shard_listeners) {
+        options.listen_shards = server_thread_count(&options);
+    }
+    if (inherited_count > 0 && inherited_count != options.listen_shards) {
+        // New shards could not join the old SO_REUSEPORT group, so share one
+        log_message(LOG_WARNING, "Inherited %d listener(s) for %d shard(s), sharing one",
+                    inherited_count, options.listen_shards);
+        while (inherited_count > 1) {
+            close(inherited[--inherited_count]);
+        }
+        options.listen_shards = 1;
+    }
+    int server_socket = server_listen(&options);
+    if (server_socket < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (options.local_path) {
+        options.local_socket = server_listen_local(&options);
+        if (options.local_socket < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (inherited_local != -1) {
+        close(inherited_local); // The predecessor had -U, this server does not
+    }
+    static const char *mode_names[] = {
+        [SERVER_MODE_THREAD] = "thread",
+        [SERVER_MODE_EPOLL] = "epoll",
+        [SERVER_MODE_POOL] = "pool",
+        [SERVER_MODE_URING] = "uring",
+    };
+    if (options.handoff_path && server_handoff_open(&options) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    log_message(LOG_INFO, "Listening for connections in %s mode...", mode_names[options.mode]);
+    // Threads started so far (committer, stats, log drain) keep the process
+    // mask; the ones started from here are placed explicitly
+    cpu_pin_acceptor();
+    if (options.mode == SERVER_MODE_EPOLL) {
+        epoll_server_run(server_socket, &options);
+    } else if (options.mode == SERVER_MODE_POOL) {
+        pool_server_run(server_socket, &options);
+    } else if (options.mode == SERVER_MODE_URING) {
+        uring_server_run(server_socket, &options);
+    } else {
+        thread_server_run(server_socket, &options);
+    }
+    close(server_socket);
+    if (options.local_socket != -1) {
+        server_close_local(&options);
+    }
+    if (options.timestamp_fd != -1) {
+        close(options.timestamp_fd);
+    }
+
     pthread_mutex_destroy(&list_mutex);
-    pthread_mutex_destroy(&file_mutex);
+    config_stop();
+    metrics_stop();
+    store_close();
+    if (options.handoff_path) {
+        server_handoff_close(&options);
+    }
+    log_close();
     closelog();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,468 @@
+/*
+ * aesdsocket.h
+ *
+ * Shared definitions for the aesdsocket server: configuration constants,
+ * the per-connection state machine and the server loop entry points.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>     // For sig_atomic_t
+#include <stdio.h>      // For FILE
+#include <stdbool.h>    // For boolean data type
+#include <pthread.h>    // For POSIX threads
+#include <stdint.h>     // For uint32_t
+#include <stdatomic.h>  // For the metrics counters
+#include <sys/types.h>  // For off_t, ssize_t
+#include <sys/queue.h>  // For queue functions
+#include <sys/uio.h>    // For struct iovec
+#include <netinet/in.h> // For Internet address family
+#include <arpa/inet.h>  // For INET6_ADDRSTRLEN
+#include "../aesd-char-driver/aesd_ioctl.h" // For struct aesd_seekto
+
+#include "aesdsocket-log.h"
+
+#define PORT 9000       // Default port to listen on, see -p
+#define BACKLOG 1024    // Default pending connections per listen queue, see -b
+#define ECHO_CACHE_SIZE (4 * 1024 * 1024) // Default largest data shared as an echo snapshot, see -e
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#if USE_AESD_CHAR_DEVICE
+#define DATA_FILE "/dev/aesdchar"     // Default device, see data_file
+#else
+#define DATA_FILE "/var/tmp/aesdsocketdata" // Default file to store data, see data_file
+#define INDEX_SUFFIX ".idx"                 // Persisted command index next to the data file, see -i
+#define MANIFEST_SUFFIX ".manifest"         // Segment list of a segmented store, see -g
+#define LOCK_SUFFIX ".lock"                 // Held by the server appending to the data file
+#endif
+#define DRAIN_TIMEOUT_MS 5000 // Default time open connections get to finish at shutdown, see -D
+#define DRAIN_POLL_MS 10      // How often blocking modes check whether draining is done
+#define HANDOFF_GRACE_MS 2000 // Extra wait for a predecessor to finish before its store lock is awaited, see -H
+#define LISTENERS_MAX 253     // Listening sockets handed over in one message (SCM_MAX_FD)
+#define TIMESTAMP_INTERVAL 10 // Default seconds between timestamp records in file mode, see -T
+#define BUFFER_SIZE 1024
+#define FAIR_QUANTUM (64 * 1024) // Bytes a connection gets read or appended in one turn before others
+#define POOL_QUEUE_PER_WORKER 4  // Default pool: at least one worker per this many queue slots
+#define POOL_WORKERS_MAX 256     // ... up to this many, see server_thread_count()
+#define SENDFILE_MAX 0x7ffff000 // Largest transfer Linux performs in one sendfile() call
+
+// Per-connection output queue: by default, stop reading from a client once
+// this many echo bytes are queued for it, and resume when it has drained
+// below the low mark (see output_high_watermark and output_low_watermark).
+// Reading also stops while fewer than OUTPUT_QUEUE_RESERVE entries are free,
+// the most one processed text line can queue (an echo and a command reply).
+#define OUTPUT_QUEUE_LEN 16
+#define OUTPUT_QUEUE_RESERVE 2
+#define OUTPUT_HIGH_WATERMARK (256 * 1024)
+#define OUTPUT_LOW_WATERMARK (64 * 1024)
+
+// Text records are buffered in chains of rx_segment_size byte segments until
+// their newline arrives; up to RX_IOV_INLINE segments are written without
+// allocating an iovec array
+#define RX_SEGMENT_SIZE (16 * 1024) // Default, see rx_buffer_size
+#define RX_SEGMENT_SIZE_MAX (16 * 1024 * 1024)
+#define RX_IOV_INLINE 8
+
+// Commands recognised as a line of their own (or without the newline at the
+// end of input, as older clients send them); anything else is data.
+//   AESDCHAR_IOCSEEKTO:X,Y  send from byte Y of command X to the end
+//   AESDCHAR_READRANGE:O,L  send L bytes starting at byte offset O
+//   AESDCHAR_READCMDS:X,N   send N commands starting at command X
+//   AESDCHAR_TAIL:N         send the last N commands
+//   AESDCHAR_ECHO:0|1       turn the full-file echo after each newline off/on
+//   AESDCHAR_STATS          send server metrics and this connection's counters
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:"
+#define READRANGE_COMMAND "AESDCHAR_READRANGE:"
+#define READCMDS_COMMAND "AESDCHAR_READCMDS:"
+#define TAIL_COMMAND "AESDCHAR_TAIL:"
+#define STATS_COMMAND "AESDCHAR_STATS"
+#define ECHO_COMMAND "AESDCHAR_ECHO:"
+#define COMMAND_PREFIX "AESDCHAR_"
+#define COMMAND_LEN(command) (sizeof(command) - 1)
+#define SEEKTO_COMMAND_LEN COMMAND_LEN(SEEKTO_COMMAND)
+
+// How incoming connections are serviced, selected with -m at startup
+enum server_mode {
+    SERVER_MODE_THREAD, // One thread per connection (default)
+    SERVER_MODE_EPOLL,  // Edge-triggered epoll loops multiplexing all clients
+    SERVER_MODE_POOL,   // Fixed worker pool fed by a bounded connection queue
+    SERVER_MODE_URING,  // io_uring completion loops, falling back to epoll if unsupported
+};
+
+// What the worker pool does with a new connection when its queue is full
+enum overload_policy {
+    OVERLOAD_REJECT, // Close the new connection
+    OVERLOAD_QUEUE,  // Stop accepting until a slot frees, leaving clients in the listen backlog
+    OVERLOAD_SHED,   // Close the oldest queued connection to make room
+};
+
+// When committed appends are synced to disk before their callers are released
+enum fsync_policy {
+    FSYNC_NONE,     // Never; released once written (default)
+    FSYNC_INTERVAL, // Every fsync_interval_ms, callers wait for the next sync
+    FSYNC_BATCH,    // Every batch is written with RWF_DSYNC
+};
+
+// Settings from the config file and the command line, see aesdsocket-config.c
+struct server_options {
+    bool daemon;                     // Detach from the terminal
+    enum server_mode mode;
+    int num_threads;                 // Event loops or pool workers, 0 = one per online CPU (pool: see POOL_QUEUE_PER_WORKER)
+    size_t queue_capacity;           // Pool: connections waiting for a worker
+    enum overload_policy overload;   // Pool: behaviour when the queue is full
+    bool persist_index;              // File mode: keep the command index next to the data file
+    enum fsync_policy fsync_policy;  // File mode: durability of appends before they are acknowledged
+    int fsync_interval_ms;           // FSYNC_INTERVAL period
+    off_t segment_size;              // File mode: rotate to a new segment file at this size, 0 = one file
+    off_t retain_bytes;              // Segmented: delete old segments beyond this many bytes, 0 = keep
+    time_t retain_age;               // Segmented: delete segments sealed this many seconds ago, 0 = keep
+    uint32_t retain_commands;        // File mode: serve only the last N commands, 0 = all
+    bool map_store;                  // File mode: map the data and echo from the mapping
+    size_t echo_cache_size;          // File mode: share echoes of data up to this size from one snapshot, 0 = off
+    int64_t timestamp_interval_ns;   // Append a timestamp record this often, 0 = never
+    int timestamp_fd;                // timerfd driving the timestamps, -1 if none; set at startup
+    int drain_timeout_ms;            // Time open connections get to finish at shutdown
+    unsigned int max_client_connections; // Open connections admitted per client address, 0 = no limit
+    uint64_t byte_rate;              // Bytes per second each connection may send, 0 = no limit
+    uint64_t record_rate;            // Records (lines or frames) per second each connection may send, 0 = no limit
+    const char *handoff_path;        // Unix socket for passing listeners to a new server, NULL = off
+    bool handoff_wait;               // A predecessor handed over: wait for it to release the store; set at startup
+    int log_level;                   // Most verbose level logged
+    const char *log_file;            // Log to this file instead of syslog
+    const char *stats_path;          // Serve metrics on a Unix socket at this path
+    int backlog;                     // listen() backlog of each listening socket
+    bool shard_listeners;            // Event loops: one SO_REUSEPORT listener per loop (-P clears)
+    int listen_shards;               // Listening sockets sharing the port, set at startup
+    const char *worker_cpus;         // CPU list for loops, workers and client threads, NULL = any
+    const char *accept_cpus;         // CPU list for the accepting thread, NULL = any
+    int port;                        // TCP port to listen on
+    const char *local_path;          // Also listen on this Unix socket, '@' = abstract name; NULL = off
+    int local_socket;                // Its listener, -1 if none; set at startup
+    const char *data_file;           // Data file, or the device in char device mode
+    size_t rx_buffer_size;           // Bytes per receive buffer (rx segment)
+    bool tcp_nodelay;                // Client sockets: disable Nagle's algorithm
+    bool tcp_cork;                   // Client sockets: cork while echoes are being sent
+    size_t send_buffer;              // Client sockets: SO_SNDBUF, 0 = system default
+    size_t receive_buffer;           // Client sockets: SO_RCVBUF, 0 = system default
+    size_t output_high_watermark;    // Stop reading from a client with this many echo bytes queued
+    size_t output_low_watermark;     // ... until it has drained below this many
+};
+
+// Settings SIGHUP may change while the server runs, read where they apply
+struct server_tunables {
+    _Atomic bool tcp_nodelay;
+    _Atomic bool tcp_cork;
+    _Atomic int send_buffer;
+    _Atomic int receive_buffer;
+    _Atomic size_t output_high_watermark;
+    _Atomic size_t output_low_watermark;
+};
+
+extern struct server_tunables tunables;
+
+// Result of driving a connection one step forward
+enum connection_status {
+    CONN_ERROR = -1, // Connection must be closed
+    CONN_OK = 0,     // Step completed
+    CONN_AGAIN = 1,  // Socket would block, retry when writable
+};
+
+// Wire protocol of a connection, decided by its first bytes
+enum connection_protocol {
+    PROTOCOL_UNKNOWN, // Nothing conclusive received yet
+    PROTOCOL_TEXT,    // Newline-terminated data and AESDCHAR_ commands
+    PROTOCOL_BINARY,  // Length-prefixed frames, see aesdsocket-protocol.h
+};
+
+#define OUTPUT_PREFIX_MAX 32 // Prefix bytes an output entry holds without allocating
+
+// Something owed to a client: optional prefix bytes, then a snapshot of data
+// file contents [offset, end)
+struct output_range {
+    off_t offset;                      // Next data file offset to send
+    off_t end;                         // Data file length when the echo was requested
+    bool framed;                       // Part of a reply that must be sent in full
+    size_t prefix_len;
+    size_t prefix_sent;
+    char *prefix_heap;                 // Prefix longer than OUTPUT_PREFIX_MAX, freed with the entry
+    uint64_t queued_ns;                // When the input that caused it was received
+    struct echo_snapshot *snapshot;    // Char device mode: the data as of when it was queued
+    char prefix[OUTPUT_PREFIX_MAX];
+};
+
+// Latency histograms: 2^HISTOGRAM_SUB_BITS buckets per power of two
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Per-connection counters, written by the serving thread and read by snapshots
+struct connection_metrics {
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t packets_in;
+    _Atomic uint64_t echoes;
+    _Atomic uint64_t echo_bytes;
+    _Atomic uint64_t rate_limited;     // Times reading was paused by a rate limit
+};
+
+// Token bucket of a rate limit, see aesdsocket-limit.c
+struct token_bucket {
+    double tokens;                     // Negative while in debt
+    uint64_t updated_ns;               // Last charge, 0 before the first
+};
+
+struct rx_segment {
+    struct rx_segment *next;
+    size_t len;                        // Bytes received into data
+    char *data;                        // rx_segment_size bytes from io_buffer_cache
+};
+
+// Received text not yet stored: every segment but the last is full
+struct rx_chain {
+    struct rx_segment *head;
+    struct rx_segment *tail;
+    size_t start;                      // Consumed bytes at the front of head
+    size_t length;                     // Unconsumed bytes across the chain
+    size_t scanned;                    // Leading bytes known to hold no unprocessed newline
+};
+
+// Records queued for the committer, see store_append_submit(). Released
+// once durable under the fsync policy, to the caller waiting for them or to
+// the completion queue of the event loop that queued them.
+struct store_append {
+    const struct iovec *iov;
+    int iovcnt;
+    off_t end;                         // Store length including these records
+    int error;                         // errno of a failed write, 0 on success
+    bool snapshot_wanted;              // Char device mode: keep the data as written, for an echo
+    struct echo_snapshot *snapshot;    // The device contents right after the write, pinned for the caller
+    bool done;
+    uint64_t requested_ns;
+    uint64_t started_ns;               // When the committer took the batch
+    struct store_completions *completions; // Event loop to report to, NULL if the caller waits
+    struct store_append *next;         // Commit queue, then completion queue
+};
+
+// Appends released to an event loop, announced through its eventfd
+struct store_completions {
+    struct store_append *done;         // Protected by the store's commit mutex
+    struct store_append **done_tail;
+    int event_fd;
+};
+
+// Per-connection state shared by every server mode
+struct connection {
+    int client_socket;
+    int data_fd;                       // Device, open for the whole session; -1 in file mode
+    char client_ip[INET6_ADDRSTRLEN];
+    int client_port;
+    struct output_range output[OUTPUT_QUEUE_LEN]; // FIFO of pending echoes
+    unsigned int output_head;
+    unsigned int output_count;
+    size_t output_bytes;               // Bytes still to send across the queue
+    bool output_throttled;             // Above the high watermark, stop reading
+    bool echo_enabled;                 // Echo the whole data file after each newline
+    enum connection_protocol protocol;
+    struct rx_chain rx_chain;          // Text: partial and unprocessed records
+    char *rx_buffer;                   // Input held until it can be parsed (magic, partial frames)
+    size_t rx_len;
+    size_t rx_capacity;
+    ssize_t echo_total;                // Bytes sent for the echo at the queue head
+    bool zero_copy;                    // Echo with sendfile(), cleared if the data can't splice
+    bool corked;                       // TCP_CORK set while echoes are sent, see tcp_cork
+    uint64_t rx_time;                  // When the input being processed was received
+    int incoming_cpu;                  // CPU the network stack processes its packets on, -1 if unknown
+    bool local;                        // Accepted on the Unix socket (-U), identified by SO_PEERCRED
+    pid_t peer_pid;                    // Local clients: credentials of the connecting process
+    uid_t peer_uid;
+    gid_t peer_gid;
+    struct connection_metrics metrics;
+    LIST_ENTRY(connection) metrics_entries; // Registry of open connections
+    bool admitted;                     // Counted against its client address, see -c
+    struct token_bucket byte_bucket;
+    struct token_bucket record_bucket;
+    uint64_t paused_until;             // Rate limited: read nothing before this time, 0 if not paused
+    bool deferred;                     // On its event loop's deferred list
+    struct store_completions *completions; // Event loops: where its appends are reported, NULL = appends block
+    struct store_append append;        // Records handed to the committer
+    bool append_pending;               // Parked: no input is processed until the append completes
+    bool append_echo;                  // Text: echo the data once it is stored
+    size_t append_len;                 // Text: rx chain bytes being stored
+    uint64_t append_rx_time;           // rx_time of the input being stored
+    char *append_buffer;               // Binary: input buffer holding the payload, freed once stored
+    size_t append_capacity;
+    struct iovec append_iov[RX_IOV_INLINE]; // Describes the records unless they span more segments
+    bool closing;                      // Event loops: closed once its last append completes
+    bool input_ended;                  // The client shut down its side, see connection_end_input()
+    TAILQ_ENTRY(connection) deferred_entries; // Event loops: clients to serve again without an event
+    char buffer[BUFFER_SIZE + 1];      // Negotiation/transfer/command buffer, +1 for NUL when parsing
+    LIST_ENTRY(connection) entries;    // Used by event loops to track their clients
+};
+
+extern volatile sig_atomic_t running_signal;
+
+#define SLAB_NODES_MAX 8 // NUMA nodes with a depot of their own; higher nodes share by node % SLAB_NODES_MAX
+
+// Free blocks of a slab cache freed on one NUMA node, linked through their first word
+struct slab_depot {
+    void *blocks;
+    size_t count;
+};
+
+// Cache of fixed-size blocks, see aesdsocket-slab.c. Define one per object
+// type with SLAB_CACHE(); align 0 aligns blocks to pages.
+struct slab_cache {
+    const char *name;
+    size_t size;                       // Block size, rounded up to align on first use
+    size_t align;
+    size_t max_cached;                 // Blocks each node's depot keeps, the rest go back to the heap
+    _Atomic bool registered;
+    int index;                         // Magazine slot, -1 if none was left
+    pthread_mutex_t lock;
+    struct slab_depot depots[SLAB_NODES_MAX]; // Free blocks shared between threads, protected by lock
+    _Atomic uint64_t heap_allocs;
+    _Atomic uint64_t heap_frees;
+    _Atomic uint64_t remote_refills;   // Blocks a thread took from another node's depot
+};
+
+#define SLAB_CACHED_MAX 1024 // Default depot limit per cache and node
+#define SLAB_CACHE(cache_name, block_size, block_align, cached_max) { \
+    .name = (cache_name), .size = (block_size), .align = (block_align), .max_cached = (cached_max), \
+    .lock = PTHREAD_MUTEX_INITIALIZER, }
+
+extern struct slab_cache io_buffer_cache;
+extern struct slab_cache connection_cache;
+
+// Where a stretch of the data can be read from, see store_extent_get()
+struct store_extent {
+    int fd;
+    off_t file_offset;                 // Offset of the first byte within fd
+    off_t len;                         // Bytes readable from fd, 0 if no longer served
+    const char *data;                  // The same bytes in memory, NULL if not mapped
+    struct store_segment *segment;     // Pinned segment, NULL in char device mode
+    struct echo_snapshot *snapshot;    // Pinned echo snapshot holding data, or NULL
+};
+
+int store_open(const struct server_options *options);
+void store_close(void);
+int store_append(const char *data, size_t len, off_t *length);
+int store_appendv(const struct iovec *iov, int iovcnt, off_t *length);
+void store_append_submit(struct store_append *request, const struct iovec *iov, int iovcnt,
+                         bool snapshot, struct store_completions *completions);
+void store_append_wait(struct store_append *request);
+void store_completions_init(struct store_completions *completions, int event_fd);
+struct store_append *store_completions_take(struct store_completions *completions);
+const char *store_data_path(void);
+off_t store_length(void);
+off_t store_start(void);
+void store_read_lock(void);
+void store_read_unlock(void);
+struct echo_snapshot *store_snapshot_get(void);
+void store_snapshot_put(struct echo_snapshot *snapshot);
+int store_extent_get(struct echo_snapshot *snapshot, off_t offset, off_t end, struct store_extent *extent);
+void store_extent_put(struct store_extent *extent);
+int store_seekto(int fd, const struct aesd_seekto *seekto, off_t *position);
+uint32_t store_command_count(int fd);
+int store_command_range(int fd, uint32_t first, uint32_t count, off_t *start, off_t *end);
+
+int connection_open(struct connection *conn, int client_socket, const struct sockaddr *client_addr);
+void connection_close(struct connection *conn);
+char *connection_rx_space(struct connection *conn, size_t *space);
+int connection_handle_data(struct connection *conn, size_t len);
+int connection_send_pending(struct connection *conn);
+void connection_output_sent(struct connection *conn, size_t bytes);
+int connection_output_truncated(struct connection *conn);
+int connection_receive(struct connection *conn, const char *data, size_t len);
+int connection_queue_reply(struct connection *conn, const void *prefix, size_t prefix_len,
+                           off_t offset, off_t end);
+int connection_buffer_input(struct connection *conn, const char *data, size_t len);
+int connection_append(struct connection *conn, const struct iovec *iov, int count);
+int connection_append_done(struct connection *conn);
+int connection_detach_input(struct connection *conn, size_t pos);
+bool connection_flush_input(struct connection *conn);
+void connection_end_input(struct connection *conn);
+bool connection_input_pending(struct connection *conn);
+int connection_resume_input(struct connection *conn);
+void connection_serve(struct connection *conn);
+
+extern size_t rx_segment_size;
+
+char *rx_chain_space(struct rx_chain *chain, size_t *space);
+void rx_chain_commit(struct rx_chain *chain, size_t len);
+ssize_t rx_chain_find_newline(struct rx_chain *chain);
+size_t rx_chain_copy(const struct rx_chain *chain, size_t from, size_t len, char *dst);
+int rx_chain_iovec(const struct rx_chain *chain, size_t len, struct iovec *iov, int max_iov);
+int rx_chain_segments(const struct rx_chain *chain, size_t len);
+void rx_chain_consume(struct rx_chain *chain, size_t len);
+void rx_chain_free(struct rx_chain *chain);
+
+int binary_process_frames(struct connection *conn);
+bool binary_frame_ready(const struct connection *conn);
+int binary_append_done(struct connection *conn);
+
+uint64_t metrics_now(void);
+int metrics_start(const char *path, bool takeover);
+void metrics_stop(void);
+ssize_t metrics_format(struct connection *conn, char **text);
+void metrics_connection_opened(struct connection *conn);
+void metrics_connection_closed(struct connection *conn);
+void metrics_received(struct connection *conn, size_t len);
+void metrics_sent(struct connection *conn, size_t len);
+void metrics_queued(struct connection *conn, size_t len);
+void metrics_acked(uint64_t queued_ns);
+void metrics_append(uint64_t requested_ns, uint64_t started_ns, uint64_t released_ns);
+void metrics_commit(size_t records, bool synced);
+void metrics_echo_snapshot(size_t bytes_read);
+void metrics_limit_rejected(void);
+void metrics_rate_limited(struct connection *conn, bool by_records);
+uint64_t metrics_connections_active(void);
+void metrics_connections_shutdown(void);
+
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *block);
+void slab_report(FILE *out);
+
+void limit_start(const struct server_options *options);
+bool limit_admit(struct connection *conn);
+void limit_release(struct connection *conn);
+void limit_charge(struct connection *conn, size_t bytes, size_t records);
+int limit_pause_ms(struct connection *conn);
+
+int config_load(struct server_options *options, int argc, char *argv[]);
+int config_start(void);
+void config_stop(void);
+void config_socket_setup(int socket, bool tcp);
+int config_socket_reclaim(const char *path);
+
+int cpu_start(const struct server_options *options);
+int cpu_worker(int index);
+bool cpu_workers_pinned(void);
+void cpu_place_worker(pthread_t thread, int index);
+void cpu_place_client(pthread_t thread, int incoming_cpu);
+void cpu_pin_acceptor(void);
+void cpu_steer_listener(int server_socket, int index);
+int cpu_incoming(int client_socket);
+int cpu_node(int cpu);
+int cpu_node_count(void);
+int cpu_current(void);
+int cpu_current_node(void);
+
+int server_thread_count(const struct server_options *options);
+void server_pin_thread(pthread_t thread, int index);
+int server_listen(const struct server_options *options);
+int server_accept(int server_socket, int local_socket, int timer_fd, struct sockaddr *addr, socklen_t *addr_len);
+bool server_wait_readable(int fd, int timer_fd);
+void server_request_shutdown(void);
+void server_wait_shutdown(void);
+uint64_t server_drain_deadline(const struct server_options *options);
+int server_drain_remaining(uint64_t deadline);
+void server_drain(const struct server_options *options);
+int timestamp_timer_open(const struct server_options *options);
+void timestamp_timer_fire(int timer_fd);
+int epoll_server_run(int server_socket, const struct server_options *options);
+int pool_server_run(int server_socket, const struct server_options *options);
+int uring_server_run(int server_socket, const struct server_options *options);
+
+#endif /* AESDSOCKET_H */